@@ -0,0 +1,240 @@
+/*
+ * cli_util.c
+ *
+ * Reply buffers and framing for the md_monitor CLI
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <libaio.h>
+
+#include "list.h"
+#include "md_monitor.h"
+#include "md_debug.h"
+#include "mpath_util.h"
+#include "cli_util.h"
+
+/*
+ * Make room for at least 'size' bytes including
+ * the terminating NUL.
+ */
+int cli_buf_reserve(struct cli_buf *b, size_t size)
+{
+	size_t newsize = b->size ? b->size : CLI_BUFLEN;
+	char *newbuf;
+
+	if (size <= b->size)
+		return 0;
+	while (newsize < size)
+		newsize *= 2;
+	newbuf = realloc(b->buf, newsize);
+	if (!newbuf) {
+		warn("cannot allocate CLI buffer of %lu bytes",
+		     (unsigned long)newsize);
+		return -ENOMEM;
+	}
+	if (!b->buf)
+		newbuf[0] = '\0';
+	b->buf = newbuf;
+	b->size = newsize;
+	return 0;
+}
+
+void cli_buf_reset(struct cli_buf *b)
+{
+	cli_buf_reserve(b, 1);
+	if (b->buf)
+		b->buf[0] = '\0';
+	b->len = 0;
+}
+
+void cli_buf_free(struct cli_buf *b)
+{
+	free(b->buf);
+	b->buf = NULL;
+	b->len = 0;
+	b->size = 0;
+}
+
+/*
+ * Extend the buffer to 'len' bytes, padding with 'c'.
+ */
+int cli_buf_fill(struct cli_buf *b, size_t len, char c)
+{
+	if (len <= b->len)
+		return 0;
+	if (cli_buf_reserve(b, len + 1) < 0)
+		return -ENOMEM;
+	memset(b->buf + b->len, c, len - b->len);
+	b->len = len;
+	b->buf[len] = '\0';
+	return 0;
+}
+
+int cli_printf(struct cli_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	if (cli_buf_reserve(b, b->len + 1) < 0)
+		return -ENOMEM;
+	va_start(ap, fmt);
+	len = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return -EINVAL;
+	if (b->len + len >= b->size) {
+		if (cli_buf_reserve(b, b->len + len + 1) < 0) {
+			b->buf[b->len] = '\0';
+			return -ENOMEM;
+		}
+		va_start(ap, fmt);
+		vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+	}
+	b->len += len;
+	return len;
+}
+
+int cli_send_frame(int fd, const char *buf, size_t len, int flags, int status)
+{
+	struct cli_frame hdr;
+
+	hdr.len = len;
+	hdr.flags = flags;
+	hdr.status = status;
+	if (write_all(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return -EIO;
+	if (len && write_all(fd, buf, len) != len)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Send the contents of 'b' as a sequence of frames.
+ */
+int cli_send_reply(int fd, struct cli_buf *b, int status)
+{
+	size_t off = 0, len;
+	sigset_t set, old;
+	int ret = 0;
+
+	/* Block SIGPIPE */
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	do {
+		len = b->len - off;
+		if (len > CLI_FRAME_MAX)
+			len = CLI_FRAME_MAX;
+		ret = cli_send_frame(fd, b->buf + off, len,
+				     off + len < b->len ? CLI_FRAME_MORE : 0,
+				     status);
+		off += len;
+	} while (!ret && off < b->len);
+
+	/* And unblock it again */
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return ret;
+}
+
+/*
+ * Receive a frame and append its payload to 'b'.
+ * Returns the payload length or a negative error.
+ */
+int cli_recv_frame(int fd, struct cli_buf *b, int *flags, int *status,
+		   unsigned int timeout)
+{
+	struct cli_frame hdr;
+	ssize_t ret;
+
+	ret = read_all(fd, &hdr, sizeof(hdr), timeout);
+	if (ret < 0)
+		return ret;
+	if (ret < sizeof(hdr))
+		return -ECONNRESET;
+	if (hdr.len > CLI_FRAME_MAX)
+		return -EMSGSIZE;
+	if (cli_buf_reserve(b, b->len + hdr.len + 1) < 0)
+		return -ENOMEM;
+	if (hdr.len) {
+		ret = read_all(fd, b->buf + b->len, hdr.len, timeout);
+		if (ret != hdr.len)
+			return ret < 0 ? ret : -ECONNRESET;
+	}
+	b->len += hdr.len;
+	b->buf[b->len] = '\0';
+	*flags = hdr.flags;
+	*status = hdr.status;
+	return hdr.len;
+}
+
+/*
+ * Non-blocking variant of cli_recv_frame() for event loops.
+ * Read whatever is available from 'fd' into the partial frame
+ * buffer 'in', and append the payload of all complete frames
+ * to 'b'. Returns 1 once the last frame of a message has been
+ * received, 0 if more data is needed, or a negative error;
+ * messages larger than CLI_REQUEST_MAX fail with -EMSGSIZE.
+ */
+int cli_recv_frames(int fd, struct cli_buf *in, struct cli_buf *b)
+{
+	struct cli_frame hdr;
+	size_t off = 0;
+	ssize_t ret;
+	int last = 0;
+
+	if (cli_buf_reserve(in, in->len + CLI_BUFLEN + 1) < 0)
+		return -ENOMEM;
+	ret = read(fd, in->buf + in->len, CLI_BUFLEN);
+	if (ret < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+	if (ret == 0)
+		return -ECONNRESET;
+	in->len += ret;
+
+	while (!last && in->len - off >= sizeof(hdr)) {
+		memcpy(&hdr, in->buf + off, sizeof(hdr));
+		if (hdr.len > CLI_FRAME_MAX ||
+		    b->len + hdr.len > CLI_REQUEST_MAX)
+			return -EMSGSIZE;
+		if (in->len - off < sizeof(hdr) + hdr.len)
+			break;
+		if (cli_buf_reserve(b, b->len + hdr.len + 1) < 0)
+			return -ENOMEM;
+		memcpy(b->buf + b->len, in->buf + off + sizeof(hdr), hdr.len);
+		b->len += hdr.len;
+		b->buf[b->len] = '\0';
+		off += sizeof(hdr) + hdr.len;
+		last = !(hdr.flags & CLI_FRAME_MORE);
+	}
+	if (off) {
+		memmove(in->buf, in->buf + off, in->len - off);
+		in->len -= off;
+	}
+	return last;
+}
@@ -0,0 +1,70 @@
+/*
+ * cli_util.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CLI_UTIL_H
+#define _CLI_UTIL_H
+
+#include <stdint.h>
+
+/* Abstract socket names */
+#define CLI_SOCKET_NAME "/org/kernel/md/md_monitor"
+#define CLI_STREAM_NAME "/org/kernel/md/md_monitor/stream"
+
+/* Maximum datagram and request size */
+#define CLI_BUFLEN 4096
+
+/*
+ * Stream protocol: each message is sent as one or more frames,
+ * each consisting of a 'struct cli_frame' header followed by
+ * 'len' bytes of payload. All frames of a reply carry the
+ * command status (an errno value, 0 on success), and all but
+ * the last one have CLI_FRAME_MORE set.
+ */
+#define CLI_FRAME_MORE	0x1
+#define CLI_FRAME_MAX	65536
+#define CLI_REPLY_MAX	(16 * 1024 * 1024)
+#define CLI_REQUEST_MAX	(1024 * 1024)
+
+struct cli_frame {
+	uint32_t len;
+	uint16_t flags;
+	uint16_t status;
+};
+
+/* Growable, always NUL-terminated reply buffer */
+struct cli_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+extern int cli_buf_reserve(struct cli_buf *b, size_t size);
+extern void cli_buf_reset(struct cli_buf *b);
+extern void cli_buf_free(struct cli_buf *b);
+extern int cli_buf_fill(struct cli_buf *b, size_t len, char c);
+extern int cli_printf(struct cli_buf *b, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+extern int cli_send_frame(int fd, const char *buf, size_t len,
+			  int flags, int status);
+extern int cli_send_reply(int fd, struct cli_buf *b, int status);
+extern int cli_recv_frame(int fd, struct cli_buf *b, int *flags,
+			  int *status, unsigned int timeout);
+extern int cli_recv_frames(int fd, struct cli_buf *in, struct cli_buf *b);
+
+#endif /* _CLI_UTIL_H */
@@ -21,11 +21,13 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <linux/fs.h>
 #include <errno.h>
 #include <syslog.h>
@@ -37,6 +39,22 @@
 #include "md_monitor.h"
 #include "md_debug.h"
 #include "dasd_ioctl.h"
+#include "md_metrics.h"
+#include "md_trace.h"
+#include "md_probes.h"
+#include "md_rusage.h"
+
+#ifndef IOCB_FLAG_IOPRIO
+#define IOCB_FLAG_IOPRIO	(1 << 1)
+#endif
+
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_PRIO_VALUE(class, data)	(((class) << IOPRIO_CLASS_SHIFT) | data)
+#define IOPRIO_WHO_PROCESS	1
+
+static const char *ioprio_class_name[IOPRIO_NR_CLASSES] = {
+	"none", "rt", "be", "idle"
+};
 
 int dasd_set_attribute(struct device_monitor *dev, const char *attr, int value)
 {
@@ -188,13 +206,174 @@ void dasd_cleanup_aio(struct device_monitor *dev)
 	}
 }
 
-enum device_io_status dasd_check_aio(struct device_monitor *dev, int timeout)
+const char *dasd_ioprio_name(int ioclass)
+{
+	if (ioclass < 0 || ioclass >= IOPRIO_NR_CLASSES)
+		return "unknown";
+	return ioprio_class_name[ioclass];
+}
+
+int dasd_ioprio_parse(const char *str)
+{
+	int ioclass;
+
+	for (ioclass = 0; ioclass < IOPRIO_NR_CLASSES; ioclass++) {
+		if (!strcmp(str, ioprio_class_name[ioclass]))
+			return ioclass;
+	}
+	if (!strcmp(str, "default"))
+		return IOPRIO_CLASS_NONE;
+	if (!strcmp(str, "realtime"))
+		return IOPRIO_CLASS_RT;
+	return -EINVAL;
+}
+
+/*
+ * Priority value for probes; realtime probes use
+ * the highest priority level within the class.
+ */
+static int dasd_ioprio_value(int ioclass)
+{
+	switch (ioclass) {
+	case IOPRIO_CLASS_RT:
+		return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_RT, 0);
+	case IOPRIO_CLASS_BE:
+		return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 4);
+	case IOPRIO_CLASS_IDLE:
+		return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+	}
+	return 0;
+}
+
+/*
+ * Set the I/O priority of the calling checker thread.
+ * Used for kernels which do not support per-request
+ * priorities for async I/O.
+ */
+int dasd_set_ioprio(struct device_monitor *dev, int ioclass)
+{
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		    dasd_ioprio_value(ioclass)) < 0) {
+		warn("%s: failed to set I/O priority %s: %m",
+		     dev->dev_name, dasd_ioprio_name(ioclass));
+		return -errno;
+	}
+	info("%s: set I/O priority %s", dev->dev_name,
+	     dasd_ioprio_name(ioclass));
+	return 0;
+}
+
+/*
+ * Read the I/O statistics from /sys/block/<dev>/stat.
+ * Returns the number of completed I/Os, the number
+ * of I/Os currently in flight, and the time in milliseconds
+ * the device has been busy.
+ */
+static int dasd_read_stat(struct device_monitor *dev, unsigned long *ios,
+			  unsigned long *inflight, unsigned long *ticks)
+{
+	char attrpath[261];
+	char stat[256];
+	unsigned long st[10];
+	ssize_t len;
+	int stat_fd;
+
+	sprintf(attrpath, "%s/stat", udev_device_get_syspath(dev->device));
+	md_rusage_syscall(MD_SYS_OPEN);
+	stat_fd = open(attrpath, O_RDONLY);
+	if (stat_fd < 0) {
+		dbg("%s: cannot open %s: %m", dev->dev_name, attrpath);
+		return -errno;
+	}
+	md_rusage_syscall(MD_SYS_READ);
+	len = read(stat_fd, stat, sizeof(stat) - 1);
+	md_rusage_syscall(MD_SYS_CLOSE);
+	close(stat_fd);
+	if (len <= 0) {
+		dbg("%s: cannot read %s: %m", dev->dev_name, attrpath);
+		return -EIO;
+	}
+	stat[len] = '\0';
+	if (sscanf(stat, "%lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+		   &st[0], &st[1], &st[2], &st[3], &st[4],
+		   &st[5], &st[6], &st[7], &st[8], &st[9]) != 10) {
+		warn("%s: invalid stat '%s'", dev->dev_name, stat);
+		return -EINVAL;
+	}
+	/* reads completed + writes completed */
+	*ios = st[0] + st[4];
+	*inflight = st[8];
+	*ticks = st[9];
+	return 0;
+}
+
+/*
+ * Sample the queue ahead of a new probe.
+ * The service time is averaged over all I/O completed since
+ * the previous probe, and the queueing delay is estimated
+ * from the number of I/Os queued ahead of the probe.
+ */
+static void dasd_sample_queue(struct device_monitor *dev)
+{
+	unsigned long ios, inflight, ticks;
+
+	if (dasd_read_stat(dev, &ios, &inflight, &ticks) < 0) {
+		dev->submit_ios = 0;
+		dev->submit_inflight = 0;
+		dev->qdelay = 0;
+		return;
+	}
+	if (dev->svc_ios && ios > dev->svc_ios)
+		dev->svctm = (ticks - dev->svc_ticks) * 1000 /
+			(ios - dev->svc_ios);
+	dev->svc_ios = ios;
+	dev->svc_ticks = ticks;
+	dev->submit_ios = ios;
+	dev->submit_inflight = inflight;
+	dev->qdelay = inflight * dev->svctm;
+}
+
+/*
+ * Check whether a timed-out probe is merely queued behind
+ * other I/O. Returns 1 if the device completed other I/O since
+ * the probe has been submitted and 'max_timeout' is not reached.
+ */
+static int dasd_probe_slow(struct device_monitor *dev,
+			   unsigned long max_timeout)
+{
+	unsigned long ios, inflight, ticks, elapsed;
+
+	if (max_timeout <= dev->aio_timeout || !dev->submit_ios ||
+	    !dev->aio_start_time)
+		return 0;
+	elapsed = (md_trace_now() - dev->aio_start_time) / 1000000;
+	if (elapsed >= max_timeout)
+		return 0;
+	if (dasd_read_stat(dev, &ios, &inflight, &ticks) < 0)
+		return 0;
+	if (ios == dev->submit_ios)
+		return 0;
+	info("%s: probe pending for %lu msecs, %lu I/Os completed, "
+	     "%lu in flight", dev->dev_name, elapsed,
+	     ios - dev->submit_ios, inflight);
+	dev->submit_ios = ios;
+	return 1;
+}
+
+/*
+ * Submit a probe if none is pending and wait for its completion.
+ * 'timeout' and 'max_timeout' are in msecs; a 'timeout' of 0
+ * only reaps a completed probe.
+ */
+enum device_io_status dasd_check_aio(struct device_monitor *dev,
+				     unsigned long timeout,
+				     unsigned long max_timeout)
 {
 	struct iocb *ios[1] = { &dev->io };
 	unsigned long pgsize = getpagesize();
 	unsigned char *ioptr;
 	struct io_event event;
-	struct timespec	tmo = { .tv_sec = timeout };
+	struct timespec	tmo;
 	int rc;
 	enum device_io_status io_status = IO_UNKNOWN;
 	sigset_t newmask, oldmask;
@@ -205,23 +384,59 @@ enum device_io_status dasd_check_aio(struct device_monitor *dev, int timeout)
 		return io_status;
 	}
 
+	md_msecs_to_timespec(timeout, &tmo);
 	if (timeout && !dev->aio_active) {
-		info("%s: start new request",
-		     dev->dev_name);
+		dasd_sample_queue(dev);
+		dev->aio_timeout = timeout + (dev->qdelay + 999) / 1000;
+		if (dev->aio_timeout > max_timeout)
+			dev->aio_timeout = max_timeout;
+		if (dev->aio_timeout < timeout)
+			dev->aio_timeout = timeout;
+		dbg("%s: start new request, %lu in flight, "
+		    "qdelay %lu usec, timeout %lu msecs", dev->dev_name,
+		    dev->submit_inflight, dev->qdelay, dev->aio_timeout);
+		md_msecs_to_timespec(dev->aio_timeout, &tmo);
 		memset(&dev->io, 0, sizeof(struct iocb));
 		ioptr = (unsigned char *) (((unsigned long)dev->buf +
 					    pgsize - 1) & (~(pgsize - 1)));
 		io_prep_pread(&dev->io, dev->fd, ioptr,
 			      (size_t)dev->blksize, 0);
-		if (gettimeofday(&dev->aio_start_time, NULL)) {
-			warn("%s: failed to get time: %m", dev->dev_name);
-			dev->aio_start_time.tv_sec = 0;
+		dev->aio_ioprio = dev->ioprio;
+		if (dev->ioprio != IOPRIO_CLASS_NONE && !dev->ioprio_noflag) {
+			dev->io.u.c.flags |= IOCB_FLAG_IOPRIO;
+			dev->io.aio_reqprio = dasd_ioprio_value(dev->ioprio);
+		}
+		dev->aio_start_time = md_trace_now();
+		md_rusage_syscall(MD_SYS_IO_SUBMIT);
+		rc = io_submit(dev->ioctx, 1, ios);
+		if (rc == -EINVAL && (dev->io.u.c.flags & IOCB_FLAG_IOPRIO)) {
+			info("%s: per-request I/O priority not supported, "
+			     "using thread priority", dev->dev_name);
+			dev->ioprio_noflag = 1;
+			dev->io.u.c.flags &= ~IOCB_FLAG_IOPRIO;
+			dev->io.aio_reqprio = 0;
+			md_rusage_syscall(MD_SYS_IO_SUBMIT);
+			rc = io_submit(dev->ioctx, 1, ios);
 		}
-		if (io_submit(dev->ioctx, 1, ios) != 1) {
-			warn("%s: io_submit failed: %m", dev->dev_name);
+		if (rc != 1) {
+			warn("%s: io_submit failed: %s", dev->dev_name,
+			     strerror(-rc));
 			return IO_ERROR;
 		}
 		dev->aio_active = 1;
+		dev->trace_start = md_trace_now();
+		MD_PROBE3(probe_submit, dev->dev_name, dev->submit_inflight,
+			  dev->aio_timeout);
+		md_trace(TRACE_PROBE_SUBMIT, dev->trace_id, dev->md_status,
+			 dev->md_status, IO_PENDING, dev->submit_inflight);
+	} else if (timeout && max_timeout > timeout &&
+		   dev->aio_start_time) {
+		unsigned long elapsed;
+
+		/* Do not wait beyond the upper bound for a pending probe */
+		elapsed = (md_trace_now() - dev->aio_start_time) / 1000000;
+		if (elapsed < max_timeout && max_timeout - elapsed < timeout)
+			md_msecs_to_timespec(max_timeout - elapsed, &tmo);
 	}
 	/* Unblock SIGHUP */
 	memset(&act, 0x00, sizeof(struct sigaction));
@@ -236,6 +451,11 @@ enum device_io_status dasd_check_aio(struct device_monitor *dev, int timeout)
 	rc = io_getevents(dev->ioctx, 1L, 1L, &event, &tmo);
 	sigaction(SIGHUP, &oact, NULL);
 	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	md_rusage_syscall(MD_SYS_SIGACTION);
+	md_rusage_syscall(MD_SYS_SIGACTION);
+	md_rusage_syscall(MD_SYS_SIGMASK);
+	md_rusage_syscall(MD_SYS_SIGMASK);
+	md_rusage_syscall(MD_SYS_IO_GETEVENTS);
 	if (rc < 0) {
 		if (rc != -EINTR) {
 			info("%s: async io returned %d",
@@ -252,7 +472,11 @@ enum device_io_status dasd_check_aio(struct device_monitor *dev, int timeout)
 			io_status = IO_PENDING;
 		}
 	} else if (rc < 1L) {
-		if (timeout) {
+		if (timeout && dev->aio_active &&
+		    dasd_probe_slow(dev, max_timeout)) {
+			warn("%s: path slow", dev->dev_name);
+			io_status = IO_PENDING;
+		} else if (timeout) {
 			warn("%s: path timeout", dev->dev_name);
 			io_status = IO_TIMEOUT;
 		} else if (dev->aio_active) {
@@ -263,25 +487,108 @@ enum device_io_status dasd_check_aio(struct device_monitor *dev, int timeout)
 			io_status = IO_UNKNOWN;
 		}
 	} else {
-		struct timeval diff, end_time;
+		unsigned long latency = 0;
+		struct probe_stat *stat;
 
-		if (dev->aio_start_time.tv_sec &&
-		    gettimeofday(&end_time, NULL) == 0) {
-			timersub(&end_time, &dev->aio_start_time, &diff);
-		} else {
-			diff.tv_sec = 0;
-			diff.tv_usec = 0;
+		if (dev->aio_start_time) {
+			dev->aio_end_time = md_trace_now();
+			latency = (dev->aio_end_time -
+				   dev->aio_start_time) / 1000;
+			dev->aio_latency = latency;
+			stat = &dev->probe_stat[dev->aio_ioprio];
+			stat->count++;
+			stat->sum += dev->aio_latency;
+			if (dev->aio_latency > stat->max)
+				stat->max = dev->aio_latency;
+			md_metrics_probe_latency(dev->aio_latency);
 		}
 		dev->aio_active = 0;
+		dev->probe_ios++;
 		if (event.res != dev->blksize) {
 			warn("%s: path failed, %lu.%06lu secs", dev->dev_name,
-			     diff.tv_sec, diff.tv_usec);
+			     latency / 1000000, latency % 1000000);
 			io_status = IO_FAILED;
 		} else {
-			info("%s: path ok, %lu.%06lu secs", dev->dev_name,
-			     diff.tv_sec, diff.tv_usec);
+			/* Only log transitions, 'path ok' is the steady state */
+			if (dev->io_status != IO_OK)
+				info("%s: path ok, %lu.%06lu secs",
+				     dev->dev_name, latency / 1000000,
+				     latency % 1000000);
+			else
+				dbg("%s: path ok, %lu.%06lu secs",
+				    dev->dev_name, latency / 1000000,
+				    latency % 1000000);
+			io_status = IO_OK;
+		}
+	}
+	if (io_status == IO_OK || io_status == IO_FAILED)
+		MD_PROBE3(probe_complete, dev->dev_name, io_status,
+			  dev->aio_latency);
+	else if (io_status == IO_TIMEOUT || io_status == IO_ERROR)
+		MD_PROBE3(probe_complete, dev->dev_name, io_status, 0);
+	if (io_status != IO_PENDING && io_status != IO_UNKNOWN &&
+	    dev->trace_start)
+		md_trace_span(TRACE_PROBE_DONE, dev->trace_id, dev->trace_start,
+			      dev->md_status, dev->md_status, io_status);
+	return io_status;
+}
+
+/*
+ * Passive path check.
+ * Returns IO_OK if the device completed I/O other than our own
+ * probes since the last call, IO_PENDING if I/O is in flight but
+ * no I/O has been completed for 'hung_timeout' msecs, and
+ * IO_UNKNOWN if the device is idle and needs an active probe.
+ */
+enum device_io_status dasd_check_stat(struct device_monitor *dev,
+				      unsigned long hung_timeout)
+{
+	unsigned long ios, inflight, ticks, completed, idle;
+	uint64_t now;
+	enum device_io_status io_status = IO_UNKNOWN;
+
+	if (dasd_read_stat(dev, &ios, &inflight, &ticks) < 0)
+		return IO_UNKNOWN;
+	now = md_trace_now();
+
+	if (!dev->stat_time) {
+		/* First sample */
+		dev->stat_ios = ios;
+		dev->stat_inflight = inflight;
+		dev->stat_time = now;
+		dev->probe_ios = 0;
+		return IO_UNKNOWN;
+	}
+	completed = ios - dev->stat_ios;
+	if (completed > dev->probe_ios)
+		completed -= dev->probe_ios;
+	else
+		completed = 0;
+	dev->probe_ios = 0;
+	dev->stat_ios = ios;
+	dev->stat_inflight = inflight;
+
+	if (completed || !inflight) {
+		if (dev->stat_hung)
+			info("%s: in-flight I/O completed again",
+			     dev->dev_name);
+		dev->stat_hung = 0;
+		dev->stat_time = now;
+		if (completed) {
+			dbg("%s: %lu I/Os completed, %lu in flight",
+			    dev->dev_name, completed, inflight);
 			io_status = IO_OK;
 		}
+	} else {
+		idle = (now - dev->stat_time) / 1000000;
+		if (idle >= hung_timeout) {
+			if (!dev->stat_hung)
+				warn("%s: %lu I/Os in flight, no I/O "
+				     "completed for %lu msecs", dev->dev_name,
+				     inflight, idle);
+			dev->stat_hung = 1;
+			io_status = IO_PENDING;
+		}
 	}
 	return io_status;
 }
@@ -25,7 +25,13 @@ extern int dasd_set_attribute(struct device_monitor *dev, const char *attr,
 extern int dasd_setup_aio(struct device_monitor *dev);
 extern void dasd_cleanup_aio(struct device_monitor *dev);
 extern enum device_io_status dasd_check_aio(struct device_monitor *dev,
-					    int timeout);
+					    unsigned long timeout,
+					    unsigned long max_timeout);
+extern enum device_io_status dasd_check_stat(struct device_monitor *dev,
+					     unsigned long hung_timeout);
+extern int dasd_set_ioprio(struct device_monitor *dev, int ioclass);
+extern int dasd_ioprio_parse(const char *str);
+extern const char *dasd_ioprio_name(int ioclass);
 
 #endif /* _DASD_UTIL_H */
 
@@ -0,0 +1,169 @@
+/*
+ * md_alloc.c
+ *
+ * Memory locking and allocation checks for the failover path
+ *
+ * With '--mlock' all current and future mappings are locked,
+ * so the failover path does not page-fault when the host is
+ * swapping. Built with -DMD_ALLOC_CHECK, malloc() and all other
+ * glibc allocation entry points, including the aligned variants,
+ * are interposed to count allocations on the failover path.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "md_debug.h"
+#include "cli_util.h"
+#include "md_alloc.h"
+
+static int alloc_locked;
+
+#ifdef MD_ALLOC_CHECK
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+
+static __thread int alloc_depth;
+static unsigned long alloc_regions;
+static unsigned long alloc_count;
+static void *alloc_caller;
+
+void md_alloc_enter(void)
+{
+	if (!alloc_depth++)
+		__atomic_fetch_add(&alloc_regions, 1, __ATOMIC_RELAXED);
+}
+
+void md_alloc_exit(void)
+{
+	if (alloc_depth > 0)
+		alloc_depth--;
+}
+
+/* Must not log or allocate itself */
+static void md_alloc_account(void *caller)
+{
+	if (!alloc_depth)
+		return;
+	__atomic_fetch_add(&alloc_count, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&alloc_caller, caller, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	md_alloc_account(__builtin_return_address(0));
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	md_alloc_account(__builtin_return_address(0));
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	md_alloc_account(__builtin_return_address(0));
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+	void *ptr;
+
+	md_alloc_account(__builtin_return_address(0));
+	if (!align || (align & (align - 1)) || align % sizeof(void *))
+		return EINVAL;
+	ptr = __libc_memalign(align, size);
+	if (!ptr)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+	md_alloc_account(__builtin_return_address(0));
+	return __libc_memalign(align, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+	md_alloc_account(__builtin_return_address(0));
+	return __libc_memalign(align, size);
+}
+
+void *valloc(size_t size)
+{
+	md_alloc_account(__builtin_return_address(0));
+	return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size)
+{
+	md_alloc_account(__builtin_return_address(0));
+	return __libc_pvalloc(size);
+}
+#endif
+
+/*
+ * Lock all current and future mappings into memory.
+ * Thread stacks are small (see setup_thread_attr), so
+ * this is mostly the preallocated buffers.
+ */
+int md_alloc_lock(void)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		warn("cannot lock memory: %m");
+		return -errno;
+	}
+	alloc_locked = 1;
+	info("memory locked");
+	return 0;
+}
+
+int md_alloc_status(struct cli_buf *reply)
+{
+	int rc;
+
+	rc = cli_printf(reply, "%smemory %s", reply->len ? "\n" : "",
+			alloc_locked ? "locked" : "not locked");
+#ifdef MD_ALLOC_CHECK
+	if (rc >= 0)
+		rc = cli_printf(reply, "\nfail path: %lu calls, "
+				"%lu allocations, last caller %p",
+				__atomic_load_n(&alloc_regions,
+						__ATOMIC_RELAXED),
+				__atomic_load_n(&alloc_count,
+						__ATOMIC_RELAXED),
+				__atomic_load_n(&alloc_caller,
+						__ATOMIC_RELAXED));
+#else
+	if (rc >= 0)
+		rc = cli_printf(reply, "\nfail path: not checked");
+#endif
+	return rc < 0 ? rc : 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * md_alloc.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MD_ALLOC_H
+#define _MD_ALLOC_H
+
+/*
+ * The failover path must not allocate memory once the
+ * daemon is running. With MD_ALLOC_CHECK the allocator is
+ * interposed and every allocation between md_alloc_enter()
+ * and md_alloc_exit() is counted; otherwise these are no-ops.
+ */
+#ifdef MD_ALLOC_CHECK
+extern void md_alloc_enter(void);
+extern void md_alloc_exit(void);
+#else
+#define md_alloc_enter() do { } while (0)
+#define md_alloc_exit() do { } while (0)
+#endif
+
+struct cli_buf;
+
+extern int md_alloc_lock(void);
+extern int md_alloc_status(struct cli_buf *reply);
+
+#endif /* _MD_ALLOC_H */
@@ -27,4 +27,33 @@
 
 extern void log_fn(int priority, const char *format, ...);
 
+/*
+ * Rate limited logging: each call site logs at most
+ * LOG_RATELIMIT_BURST messages per LOG_RATELIMIT_INTERVAL
+ * seconds, the number of suppressed messages is logged
+ * once the interval has passed.
+ */
+#define LOG_RATELIMIT_INTERVAL	5
+#define LOG_RATELIMIT_BURST	10
+
+struct log_ratelimit {
+	long begin;
+	int printed;
+	int missed;
+};
+
+#define log_ratelimited(prio, fmt, args...)			\
+do {								\
+	static struct log_ratelimit __rs;			\
+								\
+	if (log_ratelimit(&__rs, __func__))			\
+		log_fn(prio, fmt "\n", ##args);			\
+} while (0)
+
+#define dbg_ratelimited(fmt, args...) log_ratelimited(LOG_DEBUG, fmt, ##args)
+#define info_ratelimited(fmt, args...) log_ratelimited(LOG_INFO, fmt, ##args)
+#define warn_ratelimited(fmt, args...) log_ratelimited(LOG_WARNING, fmt, ##args)
+
+extern int log_ratelimit(struct log_ratelimit *rs, const char *func);
+
 #endif /* _MD_DEBUG_H */
@@ -0,0 +1,421 @@
+/*
+ * md_log.c
+ *
+ * Asynchronous logging
+ *
+ * Log messages are queued in a lock-free ring and written
+ * out in batches by a dedicated thread, so a slow log sink
+ * never blocks the path checkers. If the ring is full the
+ * message is dropped and accounted instead.
+ *
+ * Identical messages from the same call site for the same
+ * device are folded into a 'last message repeated' line.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "md_debug.h"
+#include "md_log.h"
+
+/*
+ * Bounded multi-producer, single-consumer ring.
+ * 'seq' of a free slot equals the position it will be
+ * claimed at; once the message is complete it is set to
+ * 'pos + 1', and the writer sets it to 'pos + LOG_RING_SIZE'
+ * after the slot has been written out.
+ */
+struct log_slot {
+	unsigned long seq;
+	int priority;
+	time_t time;
+	const char *format;
+	char msg[LOG_MSGLEN];
+};
+
+/*
+ * Folding state, indexed by call site and device.
+ * The device is taken from the message prefix up to
+ * the first ':'; messages without prefix are not folded.
+ */
+struct log_fold {
+	const char *format;
+	char key[LOG_KEYLEN];
+	char msg[LOG_MSGLEN];
+	int priority;
+	unsigned long repeated;
+	time_t first;
+};
+
+static struct log_slot *log_ring;
+static unsigned long log_tail;		/* next position to claim */
+static unsigned long log_head;		/* next position to write */
+static unsigned long log_dropped;
+static unsigned long log_dropped_reported;
+static int log_running;
+static int log_sleeping;
+static int log_efd = -1;
+static int log_syslog;
+static FILE *log_fd;
+static pthread_t log_thread;
+static char *log_batch;
+static struct log_fold *log_folds;
+static time_t log_fold_scan;
+
+/* Timestamp cache, only used by the writer */
+static time_t log_time_cached = -1;
+static char log_time_str[LOG_TIMELEN];
+
+void log_format_time(time_t t, char *buf, size_t len)
+{
+	struct tm tm;
+
+	if (gmtime_r(&t, &tm))
+		strftime(buf, len, "%a %d %T ", &tm);
+	else
+		buf[0] = '\0';
+}
+
+static void log_ring_wakeup(void)
+{
+	uint64_t one = 1;
+	ssize_t ret;
+
+	/* The writer also wakes up periodically */
+	ret = write(log_efd, &one, sizeof(one));
+	(void)ret;
+}
+
+/*
+ * Returns 1 if the message may be logged. Updates are
+ * not serialized, so concurrent callers might exceed the
+ * burst slightly around the start of an interval.
+ */
+int log_ratelimit(struct log_ratelimit *rs, const char *func)
+{
+	long now = time(NULL);
+	long begin = __atomic_load_n(&rs->begin, __ATOMIC_RELAXED);
+	int missed;
+
+	if (now - begin >= LOG_RATELIMIT_INTERVAL &&
+	    __atomic_compare_exchange_n(&rs->begin, &begin, now, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		missed = __atomic_exchange_n(&rs->missed, 0,
+					     __ATOMIC_RELAXED);
+		__atomic_store_n(&rs->printed, 0, __ATOMIC_RELAXED);
+		if (missed)
+			warn("%s: %d messages suppressed", func, missed);
+	}
+	if (__atomic_add_fetch(&rs->printed, 1, __ATOMIC_RELAXED) <=
+	    LOG_RATELIMIT_BURST)
+		return 1;
+	__atomic_add_fetch(&rs->missed, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+unsigned long log_ring_dropped(void)
+{
+	return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Queue a message. Returns -EAGAIN if the ring is not
+ * running and the caller has to log synchronously.
+ */
+int log_ring_vprintf(int priority, const char *format, va_list ap)
+{
+	struct log_slot *slot;
+	unsigned long pos, seq;
+	long dif;
+
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+		return -EAGAIN;
+
+	pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		dif = (long)seq - (long)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&log_tail, &pos,
+							pos + 1, 1,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* Ring full */
+			__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+			return 0;
+		} else
+			pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	}
+	slot->priority = priority;
+	slot->time = time(NULL);
+	slot->format = format;
+	vsnprintf(slot->msg, LOG_MSGLEN, format, ap);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Wake up the writer if it is about to sleep */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_RELAXED))
+		log_ring_wakeup();
+	return 0;
+}
+
+static int log_ring_ready(void)
+{
+	struct log_slot *slot = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == log_head + 1;
+}
+
+static void log_batch_flush(size_t *len)
+{
+	if (*len) {
+		fwrite(log_batch, 1, *len, log_fd);
+		fflush(log_fd);
+		*len = 0;
+	}
+}
+
+static void log_batch_add(size_t *len, time_t t, const char *msg)
+{
+	size_t msglen = strlen(msg), tlen;
+
+	if (t != log_time_cached) {
+		log_format_time(t, log_time_str, LOG_TIMELEN);
+		log_time_cached = t;
+	}
+	tlen = strlen(log_time_str);
+	if (*len + tlen + msglen + 1 > LOG_BATCH)
+		log_batch_flush(len);
+	memcpy(log_batch + *len, log_time_str, tlen);
+	*len += tlen;
+	memcpy(log_batch + *len, msg, msglen);
+	*len += msglen;
+	/* Truncated messages lose their newline */
+	if (!msglen || msg[msglen - 1] != '\n')
+		log_batch[(*len)++] = '\n';
+}
+
+static void log_emit(size_t *len, int priority, time_t t, const char *msg)
+{
+	if (log_syslog)
+		syslog(priority, "%s", msg);
+	else
+		log_batch_add(len, t, msg);
+}
+
+static void log_fold_flush(struct log_fold *fold, size_t *len, time_t now)
+{
+	char msg[LOG_MSGLEN];
+
+	if (!fold->repeated)
+		return;
+	snprintf(msg, LOG_MSGLEN, "%s: last message repeated %lu times\n",
+		 fold->key, fold->repeated);
+	log_emit(len, fold->priority, now, msg);
+	fold->repeated = 0;
+}
+
+/*
+ * Check whether a message repeats the previous message
+ * from the same call site for the same device.
+ * Returns 1 if the message should be suppressed.
+ */
+static int log_fold(struct log_slot *slot, size_t *len)
+{
+	struct log_fold *fold;
+	unsigned long hash = (unsigned long)slot->format;
+	size_t keylen;
+	int i;
+
+	keylen = strcspn(slot->msg, ": ");
+	if (slot->msg[keylen] != ':' || !keylen || keylen >= LOG_KEYLEN)
+		return 0;
+	for (i = 0; i < keylen; i++)
+		hash = hash * 31 + (unsigned char)slot->msg[i];
+	fold = &log_folds[(hash ^ (hash >> 16)) & (LOG_FOLD_SIZE - 1)];
+	if (fold->format == slot->format &&
+	    !strncmp(fold->key, slot->msg, keylen) && !fold->key[keylen]) {
+		if (!strcmp(fold->msg, slot->msg)) {
+			if (!fold->repeated++)
+				fold->first = slot->time;
+			return 1;
+		}
+		log_fold_flush(fold, len, slot->time);
+	} else {
+		log_fold_flush(fold, len, slot->time);
+		fold->format = slot->format;
+		memcpy(fold->key, slot->msg, keylen);
+		fold->key[keylen] = '\0';
+	}
+	strcpy(fold->msg, slot->msg);
+	fold->priority = slot->priority;
+	return 0;
+}
+
+/*
+ * Report repeated messages which have been
+ * suppressed for more than LOG_FOLD_INTERVAL seconds.
+ */
+static void log_fold_expire(size_t *len, time_t now, int force)
+{
+	struct log_fold *fold;
+	int i;
+
+	if (!force && now - log_fold_scan < LOG_FOLD_INTERVAL)
+		return;
+	log_fold_scan = now;
+	for (i = 0; i < LOG_FOLD_SIZE; i++) {
+		fold = &log_folds[i];
+		if (fold->repeated &&
+		    (force || now - fold->first >= LOG_FOLD_INTERVAL))
+			log_fold_flush(fold, len, now);
+	}
+}
+
+/*
+ * Write out all complete messages.
+ * Must only be called by the writer.
+ */
+static int log_ring_flush(int force)
+{
+	struct log_slot *slot;
+	unsigned long dropped;
+	char msg[LOG_MSGLEN];
+	time_t now = time(NULL);
+	size_t len = 0;
+	int num = 0;
+
+	while (log_ring_ready()) {
+		slot = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+		if (!log_fold(slot, &len))
+			log_emit(&len, slot->priority, slot->time, slot->msg);
+		__atomic_store_n(&slot->seq, log_head + LOG_RING_SIZE,
+				 __ATOMIC_RELEASE);
+		log_head++;
+		num++;
+	}
+	dropped = log_ring_dropped();
+	if (dropped != log_dropped_reported) {
+		snprintf(msg, LOG_MSGLEN, "log ring full, %lu messages "
+			 "dropped\n", dropped - log_dropped_reported);
+		log_dropped_reported = dropped;
+		log_emit(&len, LOG_WARNING, now, msg);
+	}
+	log_fold_expire(&len, now, force);
+	if (!log_syslog)
+		log_batch_flush(&len);
+	return num;
+}
+
+static void *log_writer_thread(void *ctx)
+{
+	struct pollfd pfd;
+	uint64_t val;
+
+	pfd.fd = log_efd;
+	pfd.events = POLLIN;
+	while (1) {
+		if (log_ring_flush(0))
+			continue;
+		if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+			break;
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!log_ring_ready() && poll(&pfd, 1, 100) > 0 &&
+		    read(log_efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+			warn("log writer: cannot read eventfd: %m");
+		__atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+	}
+	return ((void *)0);
+}
+
+int start_log_ring(FILE *fd, int use_syslog)
+{
+	unsigned long i;
+	int rc;
+
+	log_ring = calloc(LOG_RING_SIZE, sizeof(struct log_slot));
+	log_batch = malloc(LOG_BATCH);
+	log_folds = calloc(LOG_FOLD_SIZE, sizeof(struct log_fold));
+	if (!log_ring || !log_batch || !log_folds) {
+		err("cannot allocate log ring");
+		goto out_free;
+	}
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		log_ring[i].seq = i;
+	log_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (log_efd < 0) {
+		err("cannot create log eventfd: %m");
+		goto out_free;
+	}
+	log_fd = fd;
+	log_syslog = use_syslog;
+	log_fold_scan = time(NULL);
+	__atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+	rc = pthread_create(&log_thread, NULL, log_writer_thread, NULL);
+	if (rc) {
+		__atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+		log_thread = 0;
+		err("Failed to start log writer thread: %s", strerror(rc));
+		close(log_efd);
+		log_efd = -1;
+		goto out_free;
+	}
+	info("Start log writer thread");
+	return 0;
+
+out_free:
+	free(log_ring);
+	log_ring = NULL;
+	free(log_batch);
+	log_batch = NULL;
+	free(log_folds);
+	log_folds = NULL;
+	return -1;
+}
+
+/*
+ * Stop the writer after all queued messages have
+ * been written; further messages are logged synchronously.
+ */
+void stop_log_ring(void)
+{
+	if (!log_thread)
+		return;
+	info("Stop log writer thread");
+	__atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+	log_ring_wakeup();
+	pthread_join(log_thread, NULL);
+	log_thread = 0;
+	/* Messages queued while the writer exited */
+	log_ring_flush(1);
+	close(log_efd);
+	log_efd = -1;
+}
@@ -0,0 +1,41 @@
+/*
+ * md_log.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MD_LOG_H
+#define _MD_LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define LOG_RING_SIZE	1024	/* must be a power of 2 */
+#define LOG_MSGLEN	256
+#define LOG_BATCH	65536
+#define LOG_TIMELEN	32
+#define LOG_KEYLEN	32
+#define LOG_FOLD_SIZE	256	/* must be a power of 2 */
+#define LOG_FOLD_INTERVAL 30
+
+extern int log_ring_vprintf(int priority, const char *format, va_list ap);
+extern unsigned long log_ring_dropped(void);
+extern void log_format_time(time_t t, char *buf, size_t len);
+extern int start_log_ring(FILE *fd, int use_syslog);
+extern void stop_log_ring(void);
+
+#endif /* _MD_LOG_H */
@@ -0,0 +1,428 @@
+/*
+ * md_metrics.c
+ *
+ * Metrics registry and exposition in Prometheus text format
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <libaio.h>
+
+#include "list.h"
+#include "md_monitor.h"
+#include "md_debug.h"
+#include "cli_util.h"
+#include "md_status.h"
+#include "md_metrics.h"
+#include "md_log.h"
+
+#define MD_HIST_MAX 16
+#define METRICS_REQLEN 1024
+
+/*
+ * Histograms count observations in microseconds;
+ * bucket 'i' holds values up to 'bounds[i]', the
+ * last bucket holds everything above.
+ */
+struct md_histogram {
+	const unsigned long *bounds;
+	int nr_bounds;
+	unsigned long buckets[MD_HIST_MAX + 1];
+	unsigned long sum;
+};
+
+static const unsigned long probe_bounds[] = {
+	500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+static const unsigned long lock_bounds[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000,
+};
+
+#define NR_BOUNDS(b) (int)(sizeof(b) / sizeof(b[0]))
+
+static struct md_histogram probe_latency = {
+	.bounds = probe_bounds,
+	.nr_bounds = NR_BOUNDS(probe_bounds),
+};
+
+static struct md_histogram lock_wait = {
+	.bounds = lock_bounds,
+	.nr_bounds = NR_BOUNDS(lock_bounds),
+};
+
+/* Indexed by 'enum device_io_status' */
+static const char *probe_result_name[IO_RESERVED] = {
+	"unknown", "error", "ok", "failed", "pending", "timeout", "retry"
+};
+
+static unsigned long probe_results[IO_RESERVED];
+static unsigned long probes_skipped;
+static unsigned long uevents;
+
+static pthread_t metrics_thread;
+static int metrics_sock = -1;
+static int metrics_tcp_sock = -1;
+
+static void md_counter_inc(unsigned long *counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static unsigned long md_counter_read(unsigned long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void md_histogram_observe(struct md_histogram *h, unsigned long val)
+{
+	int i;
+
+	for (i = 0; i < h->nr_bounds; i++) {
+		if (val <= h->bounds[i])
+			break;
+	}
+	__atomic_add_fetch(&h->buckets[i], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, val, __ATOMIC_RELAXED);
+}
+
+void md_metrics_probe(int io_status)
+{
+	if (io_status >= 0 && io_status < IO_RESERVED)
+		md_counter_inc(&probe_results[io_status]);
+}
+
+void md_metrics_probe_skipped(void)
+{
+	md_counter_inc(&probes_skipped);
+}
+
+void md_metrics_probe_latency(unsigned long usecs)
+{
+	md_histogram_observe(&probe_latency, usecs);
+}
+
+void md_metrics_uevent(void)
+{
+	md_counter_inc(&uevents);
+}
+
+void md_metrics_lock_wait(unsigned long usecs)
+{
+	md_histogram_observe(&lock_wait, usecs);
+}
+
+int md_metrics_header(struct cli_buf *reply, const char *name,
+		      const char *type, const char *help)
+{
+	return cli_printf(reply, "# HELP %s %s\n# TYPE %s %s\n",
+			  name, help, name, type);
+}
+
+/*
+ * Print a histogram with cumulative buckets in seconds.
+ * The total count is derived from the buckets, so it always
+ * matches the '+Inf' bucket even while observations are added.
+ */
+static int md_metrics_histogram(struct cli_buf *reply, const char *name,
+				const char *help, struct md_histogram *h)
+{
+	unsigned long count = 0, sum;
+	int i, rc;
+
+	rc = md_metrics_header(reply, name, MD_METRICS_HISTOGRAM, help);
+	for (i = 0; i <= h->nr_bounds && rc >= 0; i++) {
+		count += md_counter_read(&h->buckets[i]);
+		if (i < h->nr_bounds)
+			rc = cli_printf(reply, "%s_bucket{le=\"%lu.%06lu\"} %lu\n",
+					name, h->bounds[i] / 1000000,
+					h->bounds[i] % 1000000, count);
+		else
+			rc = cli_printf(reply, "%s_bucket{le=\"+Inf\"} %lu\n",
+					name, count);
+	}
+	sum = md_counter_read(&h->sum);
+	if (rc >= 0)
+		rc = cli_printf(reply, "%s_sum %lu.%06lu\n%s_count %lu\n",
+				name, sum / 1000000, sum % 1000000,
+				name, count);
+	return rc;
+}
+
+int md_metrics_print(struct cli_buf *reply)
+{
+	int i, rc;
+
+	rc = md_metrics_header(reply, "md_monitor_probes_total",
+			       MD_METRICS_COUNTER,
+			       "Path checker probes by result.");
+	for (i = 0; i < IO_RESERVED && rc >= 0; i++)
+		rc = cli_printf(reply,
+				"md_monitor_probes_total{result=\"%s\"} %lu\n",
+				probe_result_name[i],
+				md_counter_read(&probe_results[i]));
+	if (rc >= 0)
+		rc = cli_printf(reply, "md_monitor_probes_total"
+				"{result=\"skipped\"} %lu\n",
+				md_counter_read(&probes_skipped));
+	if (rc >= 0)
+		rc = md_metrics_histogram(reply,
+					  "md_monitor_probe_latency_seconds",
+					  "Latency of completed probes.",
+					  &probe_latency);
+	if (rc >= 0)
+		rc = md_metrics_header(reply, "md_monitor_uevents_total",
+				       MD_METRICS_COUNTER,
+				       "Processed udev events.");
+	if (rc >= 0)
+		rc = cli_printf(reply, "md_monitor_uevents_total %lu\n",
+				md_counter_read(&uevents));
+	if (rc >= 0)
+		rc = md_metrics_histogram(reply,
+					  "md_monitor_device_lock_wait_seconds",
+					  "Time spent waiting for the device "
+					  "list lock.", &lock_wait);
+	if (rc >= 0)
+		rc = md_metrics_header(reply, "md_monitor_log_dropped_total",
+				       MD_METRICS_COUNTER,
+				       "Log messages dropped as the log "
+				       "ring was full.");
+	if (rc >= 0)
+		rc = cli_printf(reply, "md_monitor_log_dropped_total %lu\n",
+				log_ring_dropped());
+	return rc;
+}
+
+/*
+ * Handle a single scrape request. Only 'GET' is supported;
+ * the reply is sent with HTTP/1.0 semantics and the
+ * connection is closed afterwards.
+ */
+static void metrics_handle(int fd)
+{
+	struct cli_buf body;
+	struct timeval tmo;
+	char req[METRICS_REQLEN];
+	const char *status = "200 OK", *path;
+	size_t reqlen = 0, pathlen, off;
+	ssize_t len;
+	int rc;
+
+	tmo.tv_sec = 1;
+	tmo.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tmo, sizeof(tmo));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof(tmo));
+	while (reqlen < sizeof(req) - 1) {
+		len = recv(fd, req + reqlen, sizeof(req) - 1 - reqlen, 0);
+		if (len <= 0)
+			break;
+		reqlen += len;
+		req[reqlen] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+	req[reqlen] = '\0';
+
+	memset(&body, 0, sizeof(body));
+	if (strncmp(req, "GET ", 4)) {
+		status = "405 Method Not Allowed";
+	} else {
+		path = req + 4;
+		pathlen = strcspn(path, " \r\n");
+		if (!(pathlen == 1 && path[0] == '/') &&
+		    !(pathlen == 8 && !strncmp(path, "/metrics", 8)))
+			status = "404 Not Found";
+	}
+	if (!strncmp(status, "200", 3)) {
+		rc = md_metrics_collect(&body);
+		if (rc < 0) {
+			warn("metrics: cannot format reply: %s",
+			     strerror(-rc));
+			status = "500 Internal Server Error";
+			cli_buf_reset(&body);
+		}
+	}
+	if (!body.len)
+		cli_printf(&body, "%s\n", status);
+
+	snprintf(req, sizeof(req), "HTTP/1.0 %s\r\n"
+		 "Content-Type: text/plain; version=0.0.4\r\n"
+		 "Content-Length: %zu\r\n"
+		 "Connection: close\r\n\r\n", status, body.len);
+	len = send(fd, req, strlen(req), MSG_NOSIGNAL);
+	for (off = 0; len > 0 && body.buf && off < body.len; off += len)
+		len = send(fd, body.buf + off, body.len - off, MSG_NOSIGNAL);
+	if (len < 0)
+		dbg("metrics: send failed: %m");
+	cli_buf_free(&body);
+}
+
+static void *metrics_status_thread(void *ctx)
+{
+	struct pollfd pfd[2];
+	int i, fd, nfds, oldstate;
+
+	nfds = 0;
+	if (metrics_sock >= 0) {
+		pfd[nfds].fd = metrics_sock;
+		pfd[nfds].events = POLLIN;
+		nfds++;
+	}
+	if (metrics_tcp_sock >= 0) {
+		pfd[nfds].fd = metrics_tcp_sock;
+		pfd[nfds].events = POLLIN;
+		nfds++;
+	}
+	while (1) {
+		if (poll(pfd, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("metrics: poll failed: %m");
+			break;
+		}
+		for (i = 0; i < nfds; i++) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			fd = accept4(pfd[i].fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0) {
+				dbg("metrics: accept failed: %m");
+				continue;
+			}
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,
+					       &oldstate);
+			metrics_handle(fd);
+			close(fd);
+			pthread_setcancelstate(oldstate, NULL);
+		}
+	}
+	return ((void *)0);
+}
+
+static int metrics_listen_unix(void)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	if (mkdir(MD_STATUS_DIR, 0755) < 0 && errno != EEXIST) {
+		warn("cannot create %s: %m", MD_STATUS_DIR);
+		return -1;
+	}
+	memset(&sun, 0x00, sizeof(struct sockaddr_un));
+	sun.sun_family = AF_LOCAL;
+	strcpy(sun.sun_path, MD_METRICS_SOCKET);
+	fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		warn("cannot open metrics socket: %m");
+		return -1;
+	}
+	unlink(MD_METRICS_SOCKET);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(fd, 16) < 0) {
+		warn("cannot listen on %s: %m", MD_METRICS_SOCKET);
+		close(fd);
+		return -1;
+	}
+	/* Allow unprivileged exporters to scrape */
+	chmod(MD_METRICS_SOCKET, 0666);
+	return fd;
+}
+
+static int metrics_listen_tcp(int port)
+{
+	struct sockaddr_in sin;
+	const int feature_on = 1;
+	int fd;
+
+	memset(&sin, 0x00, sizeof(struct sockaddr_in));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		warn("cannot open metrics port: %m");
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+		   &feature_on, sizeof(feature_on));
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(fd, 16) < 0) {
+		warn("cannot listen on metrics port %d: %m", port);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Start serving metrics on MD_METRICS_SOCKET and,
+ * if 'port' is set, on the loopback interface.
+ */
+int start_metrics(int port)
+{
+	int rc;
+
+	info("Start metrics thread");
+	metrics_sock = metrics_listen_unix();
+	if (port)
+		metrics_tcp_sock = metrics_listen_tcp(port);
+	if (metrics_sock < 0 && metrics_tcp_sock < 0) {
+		warn("metrics not available");
+		return -1;
+	}
+
+	rc = pthread_create(&metrics_thread, NULL,
+			    metrics_status_thread, NULL);
+	if (rc) {
+		err("Failed to start metrics thread: %m");
+		metrics_thread = 0;
+		stop_metrics();
+	}
+	return rc;
+}
+
+void stop_metrics(void)
+{
+	if (metrics_thread) {
+		info("Stop metrics thread");
+		pthread_cancel(metrics_thread);
+		pthread_join(metrics_thread, NULL);
+		metrics_thread = 0;
+	}
+	if (metrics_sock >= 0) {
+		close(metrics_sock);
+		unlink(MD_METRICS_SOCKET);
+		metrics_sock = -1;
+	}
+	if (metrics_tcp_sock >= 0) {
+		close(metrics_tcp_sock);
+		metrics_tcp_sock = -1;
+	}
+}
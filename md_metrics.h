@@ -0,0 +1,53 @@
+/*
+ * md_metrics.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MD_METRICS_H
+#define _MD_METRICS_H
+
+/* Unix socket serving the metrics */
+#define MD_METRICS_SOCKET	"/run/md_monitor/metrics"
+
+#define MD_METRICS_COUNTER	"counter"
+#define MD_METRICS_GAUGE	"gauge"
+#define MD_METRICS_HISTOGRAM	"histogram"
+
+struct cli_buf;
+
+/* Event accounting, safe to call from any thread */
+extern void md_metrics_probe(int io_status);
+extern void md_metrics_probe_skipped(void);
+extern void md_metrics_probe_latency(unsigned long usecs);
+extern void md_metrics_uevent(void);
+extern void md_metrics_lock_wait(unsigned long usecs);
+
+/* Exposition in Prometheus text format */
+extern int md_metrics_header(struct cli_buf *reply, const char *name,
+			     const char *type, const char *help);
+extern int md_metrics_print(struct cli_buf *reply);
+
+/*
+ * Provided by md_monitor; formats all metrics,
+ * including the per-array and CLI metrics.
+ */
+extern int md_metrics_collect(struct cli_buf *reply);
+
+extern int start_metrics(int port);
+extern void stop_metrics(void);
+
+#endif /* _MD_METRICS_H */
@@ -49,6 +49,8 @@
 #endif
 #include <pthread.h>
 #include <dirent.h>
+#include <spawn.h>
+#include <sys/wait.h>
 #include <libaio.h>
 
 #include <libudev.h>
@@ -59,22 +61,38 @@
 #include "mpath_util.h"
 #include "dasd_util.h"
 #include "dasd_ioctl.h"
+#include "cli_util.h"
+#include "md_status.h"
+#include "md_metrics.h"
+#include "md_log.h"
+#include "md_trace.h"
+#include "md_probes.h"
+#include "md_mutex.h"
+#include "md_rusage.h"
+#include "md_alloc.h"
+#include "md_snapshot.h"
 
 const char version_str[] = "md_monitor version 6.6";
 
 LIST_HEAD(md_list);
 LIST_HEAD(device_list);
 LIST_HEAD(pending_list);
+LIST_HEAD(recovery_list);
 pthread_mutex_t md_lock;
 pthread_mutex_t device_lock;
 pthread_mutex_t pending_lock;
 pthread_cond_t pending_cond;
+pthread_mutex_t status_gen_lock;
+pthread_cond_t status_gen_cond;
+static unsigned long status_gen;
+pthread_rwlock_t cli_query_lock;
 pthread_attr_t monitor_attr;
 pthread_attr_t cli_attr;
 
 static int udev_exit;
-static int monitor_timeout;
-static int failfast_timeout = 5;
+/* Timeouts are in msecs */
+static unsigned long monitor_timeout;
+static unsigned long failfast_timeout = 5000;
 static int failfast_retries = 2;
 sigset_t thread_sigmask;
 static int daemonize_monitor;
@@ -83,29 +101,50 @@ static char logname[MD_NAMELEN];
 static int use_syslog;
 static int fail_mirror_side = 1;
 static int stop_on_sync = 1;
-static unsigned long checker_timeout = 1;
+static unsigned long checker_timeout = 1000;
+static int max_recovery;
+static int recovery_running;
+static unsigned long sync_latency;
+static unsigned long sync_speed_floor = 1000;
+static int passive_check;
+static unsigned long hung_timeout;
+static unsigned long max_io_timeout;
+static int probe_ioprio = IOPRIO_CLASS_NONE;
+static unsigned long coalesce_msecs = 100;
+static int metrics_port;
+static int watchdog_factor;
+static int watchdog_fail;
+static int mlock_monitor;
+static pthread_t watchdog_thread;
+static unsigned long snapshot_interval;	/* msecs */
+static int snapshot_running;
+static pthread_t snapshot_thread;
+static unsigned long exec_requests;
 static pid_t monitor_pid;
 FILE *logfd;
 
 void log_fn(int priority, const char *format, ...)
 {
 	va_list ap;
-	time_t curtime;
-	struct tm *cur_tm;
 
 	if (log_priority < priority)
 		return;
 
+	/* Queue the message once the log writer is running */
 	va_start(ap, format);
+	if (!log_ring_vprintf(priority, format, ap)) {
+		va_end(ap);
+		return;
+	}
+	va_end(ap);
 
+	va_start(ap, format);
 	if (use_syslog)
 		vsyslog(priority, format, ap);
 	else {
-		char timestr[32];
+		char timestr[LOG_TIMELEN];
 
-		time(&curtime);
-		cur_tm = gmtime(&curtime);
-		strftime(timestr, 32, "%a %d %T ", cur_tm);
+		log_format_time(time(NULL), timestr, LOG_TIMELEN);
 		fprintf(logfd, "%s", timestr);
 		vfprintf(logfd, format, ap);
 		fflush(logfd);
@@ -191,6 +230,9 @@ static void add_component(struct md_monitor *, struct device_monitor *,
 static void remove_component(struct device_monitor *);
 static int fail_component(struct device_monitor *, enum md_rdev_status);
 static int reset_component(struct device_monitor *);
+static void md_event_notify(const char *, const char *, const char *,
+			    enum md_rdev_status, enum md_rdev_status,
+			    enum device_io_status);
 static void fail_mirror(struct device_monitor *, enum md_rdev_status);
 static void reset_mirror(struct device_monitor *);
 static void discover_md_components(struct md_monitor *md);
@@ -203,9 +245,18 @@ int num_time = 0;
 
 static void lock_device_list(void)
 {
-	pthread_mutex_lock(&device_lock);
-	if (gettimeofday(&start_time, NULL) != 0)
+	struct timeval wait_time;
+
+	if (gettimeofday(&wait_time, NULL) != 0)
+		wait_time.tv_sec = 0;
+	md_mutex_lock(&device_lock, LOCK_DEVICE_LIST);
+	if (gettimeofday(&start_time, NULL) != 0) {
 		start_time.tv_sec = 0;
+	} else if (wait_time.tv_sec) {
+		timersub(&start_time, &wait_time, &wait_time);
+		md_metrics_lock_wait(wait_time.tv_sec * 1000000 +
+				     wait_time.tv_usec);
+	}
 }
 
 static void unlock_device_list(void)
@@ -218,7 +269,38 @@ static void unlock_device_list(void)
 		timeradd(&sum_time, &diff_time, &sum_time);
 		num_time++;
 	}
-	pthread_mutex_unlock(&device_lock);
+	md_mutex_unlock(&device_lock);
+}
+
+static unsigned long md_monotonic_msecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Publish the progress of a checker or executor thread;
+ * the next heartbeat is due within 'expect' msecs.
+ */
+static void md_heartbeat(struct md_heartbeat *hb, const char *activity,
+			 unsigned long expect)
+{
+	__atomic_store_n(&hb->activity, activity, __ATOMIC_RELAXED);
+	__atomic_store_n(&hb->expect, expect, __ATOMIC_RELAXED);
+	__atomic_store_n(&hb->stamp, md_monotonic_msecs(), __ATOMIC_RELEASE);
+}
+
+static void md_heartbeat_stop(struct md_heartbeat *hb)
+{
+	__atomic_store_n(&hb->stamp, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&hb->stalled, 0, __ATOMIC_RELAXED);
+}
+
+static int md_heartbeat_stalled(struct md_heartbeat *hb)
+{
+	return __atomic_load_n(&hb->stalled, __ATOMIC_RELAXED);
 }
 
 void sig_handler(int signum)
@@ -234,7 +316,7 @@ static struct md_monitor *lookup_md(const char *mdname, int remove)
 	if (!mdname)
 		return NULL;
 
-	pthread_mutex_lock(&md_lock);
+	md_mutex_lock(&md_lock, LOCK_MD_LIST);
 	list_for_each_entry(tmp, &md_list, entry) {
 		const char *tmpname = udev_device_get_sysname(tmp->device);
 		if (!strcmp(tmp->dev_name, mdname)) {
@@ -248,10 +330,47 @@ static struct md_monitor *lookup_md(const char *mdname, int remove)
 	}
 	if (remove && md)
 		list_del_init(&md->entry);
-	pthread_mutex_unlock(&md_lock);
+	md_mutex_unlock(&md_lock);
 	return md;
 }
 
+/*
+ * Arrays are refcounted, so threads can use an array without
+ * holding md_lock. md_list holds one reference, which is dropped
+ * by remove_md(). md_monitor_get() must be called while the array
+ * cannot be removed, ie with md_lock held, with pending_lock held
+ * for an array on recovery_list, or with another reference.
+ */
+static struct md_monitor *md_monitor_get(struct md_monitor *md_dev)
+{
+	__atomic_fetch_add(&md_dev->ref, 1, __ATOMIC_RELAXED);
+	return md_dev;
+}
+
+static void md_monitor_put(struct md_monitor *md_dev)
+{
+	if (__atomic_sub_fetch(&md_dev->ref, 1, __ATOMIC_ACQ_REL))
+		return;
+	pthread_mutex_destroy(&md_dev->status_lock);
+	pthread_mutex_destroy(&md_dev->device_lock);
+	free(md_dev);
+}
+
+/*
+ * Return a reference to the udev device of the array for
+ * sysfs I/O without locks held, or NULL if it has been removed.
+ */
+static struct udev_device *md_monitor_device(struct md_monitor *md_dev)
+{
+	struct udev_device *md_device = NULL;
+
+	md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
+	if (md_dev->device)
+		md_device = udev_device_ref(md_dev->device);
+	md_mutex_unlock(&md_dev->status_lock);
+	return md_device;
+}
+
 static struct md_monitor *lookup_md_alias(const char *mdpath)
 {
 	struct md_monitor *tmp, *md = NULL;
@@ -267,7 +386,7 @@ static struct md_monitor *lookup_md_alias(const char *mdpath)
 	else
 		mdname++;
 
-	pthread_mutex_lock(&md_lock);
+	md_mutex_lock(&md_lock, LOCK_MD_LIST);
 	list_for_each_entry(tmp, &md_list, entry) {
 		if (strlen(tmp->dev_name) && !strcmp(tmp->dev_name, mdname)) {
 			md = tmp;
@@ -285,7 +404,7 @@ static struct md_monitor *lookup_md_alias(const char *mdpath)
 			break;
 		}
 	}
-	pthread_mutex_unlock(&md_lock);
+	md_mutex_unlock(&md_lock);
 	return md;
 }
 
@@ -304,13 +423,13 @@ static struct device_monitor * lookup_md_component(struct md_monitor *md_dev,
 	    strncmp(devname, "dm-", 3)) {
 		lookup_symlinks = 1;
 	}
-	pthread_mutex_lock(&md_dev->status_lock);
+	md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
 	if (!md_dev->device) {
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 		return NULL;
 	}
-	pthread_mutex_unlock(&md_dev->status_lock);
-	pthread_mutex_lock(&md_dev->device_lock);
+	md_mutex_unlock(&md_dev->status_lock);
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
 	list_for_each_entry(tmp, &md_dev->children, siblings) {
 		/* No locking required, tmp->device is static */
 		if (lookup_symlinks) {
@@ -333,23 +452,23 @@ static struct device_monitor * lookup_md_component(struct md_monitor *md_dev,
 				}
 			}
 		}
-		pthread_mutex_lock(&tmp->lock);
+		md_mutex_lock(&tmp->lock, LOCK_DEVICE);
 		if (!strncmp(devname, tmp->md_name,
 			     strlen(devname))) {
 			found = tmp;
-			pthread_mutex_unlock(&tmp->lock);
+			md_mutex_unlock(&tmp->lock);
 			break;
 		}
 		if (!strncmp(devname, tmp->dev_name,
 			     strlen(devname))) {
 			found = tmp;
-			pthread_mutex_unlock(&tmp->lock);
+			md_mutex_unlock(&tmp->lock);
 			break;
 		}
-		pthread_mutex_unlock(&tmp->lock);
+		md_mutex_unlock(&tmp->lock);
 	}
 out:
-	pthread_mutex_unlock(&md_dev->device_lock);
+	md_mutex_unlock(&md_dev->device_lock);
 	return found;
 }
 
@@ -360,7 +479,7 @@ static struct md_monitor *lookup_md_new(struct udev_device *md_dev)
 	struct md_monitor *tmp, *md = NULL;
 
 	alias_name = udev_device_get_property_value(md_dev, "MD_DEVICE");
-	pthread_mutex_lock(&md_lock);
+	md_mutex_lock(&md_lock, LOCK_MD_LIST);
 	list_for_each_entry(tmp, &md_list, entry) {
 		const char *tmpname;
 
@@ -389,6 +508,7 @@ static struct md_monitor *lookup_md_new(struct udev_device *md_dev)
 			memset(md, 0, sizeof(struct md_monitor));
 		else
 			goto out_unlock;
+		md->trace_id = md_trace_register(mdname);
 		if (alias_name)
 			mdname = alias_name;
 		if (strlen(mdname) > MD_NAMELEN) {
@@ -397,8 +517,11 @@ static struct md_monitor *lookup_md_new(struct udev_device *md_dev)
 		strncpy(md->dev_name, mdname, MD_NAMELEN);
 		md->dev_name[MD_NAMELEN - 1] = '\0';
 		md->raid_disks = -1;
+		md->status_idx = -1;
+		md->ref = 1;
 		INIT_LIST_HEAD(&md->children);
 		INIT_LIST_HEAD(&md->pending);
+		INIT_LIST_HEAD(&md->recovery);
 		pthread_mutex_init(&md->status_lock, NULL);
 		pthread_mutex_init(&md->device_lock, NULL);
 		list_add(&md->entry, &md_list);
@@ -407,9 +530,12 @@ static struct md_monitor *lookup_md_new(struct udev_device *md_dev)
 	if (!md->device) {
 		md->device = md_dev;
 		udev_device_ref(md_dev);
+		/* Command arguments for the failover path */
+		snprintf(md->dev_path, sizeof(md->dev_path), "/dev/%s",
+			 udev_device_get_sysname(md_dev));
 	}
 out_unlock:
-	pthread_mutex_unlock(&md_lock);
+	md_mutex_unlock(&md_lock);
 	return md;
 }
 
@@ -436,9 +562,9 @@ static struct device_monitor *device_monitor_get(struct device_monitor *dev)
 	if (!dev)
 		return NULL;
 
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	dev->ref++;
-	pthread_mutex_unlock(&dev->lock);
+	md_mutex_unlock(&dev->lock);
 
 	return dev;
 }
@@ -448,18 +574,18 @@ static void device_monitor_put(struct device_monitor *dev)
 	if (!dev)
 		return;
 
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	dev->ref--;
 	if (dev->ref == 0) {
 		udev_device_unref(dev->device);
 		dev->device = NULL;
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 		pthread_mutex_destroy(&dev->lock);
 		pthread_cond_destroy(&dev->io_cond);
 		free(dev);
 		return;
 	}
-	pthread_mutex_unlock(&dev->lock);
+	md_mutex_unlock(&dev->lock);
 }
 
 static struct device_monitor *allocate_device(struct udev_device *udev_dev)
@@ -480,12 +606,15 @@ static struct device_monitor *allocate_device(struct udev_device *udev_dev)
 	memset(dev, 0, sizeof(struct device_monitor));
 	dev->device = udev_dev;
 	dev->ref = 1;
+	dev->trace_id = md_trace_register(devname);
 	dev->md_slot = dev->md_slot_saved = -1;
+	dev->status_idx = -1;
 	dev->md_index = -1;
 	dev->md_side = -1;
 	dev->io_status = IO_UNKNOWN;
+	dev->probe_status = IO_UNKNOWN;
 	pthread_mutex_init(&dev->lock, NULL);
-	pthread_cond_init(&dev->io_cond, NULL);
+	md_cond_init(&dev->io_cond);
 	INIT_LIST_HEAD(&dev->siblings);
 	udev_device_ref(dev->device);
 	strcpy(dev->dev_name, devname);
@@ -593,17 +722,19 @@ static void attach_device(struct udev_device *udev_dev)
 	if (found_md) {
 		const char *mdname = udev_device_get_sysname(found_md->device);
 
-		pthread_mutex_lock(&found_md->device_lock);
+		md_mutex_lock(&found_md->device_lock, LOCK_MD_DEVICE);
 		if (!list_empty(&found->siblings)) {
 			warn("%s: Already monitoring %s",
 			     mdname, found->md_name);
 		} else {
 			add_component(found_md, found, devname);
 			info("%s: Start monitoring %s", mdname, found->md_name);
+			md_trace_set_parent(found->trace_id,
+					    found_md->trace_id);
 			list_add(&found->siblings, &found_md->children);
 			monitor_device(found);
 		}
-		pthread_mutex_unlock(&found_md->device_lock);
+		md_mutex_unlock(&found_md->device_lock);
 	} else {
 		dbg("%s: no md array found", devname);
 	}
@@ -633,16 +764,17 @@ static void detach_device(struct udev_device *udev_dev)
 			struct md_monitor *md_dev;
 			const char *mdname = NULL;
 
-			pthread_mutex_lock(&found->lock);
+			md_mutex_lock(&found->lock, LOCK_DEVICE);
 			if (found->parent)
 				mdname = udev_device_get_sysname(found->parent);
-			pthread_mutex_unlock(&found->lock);
+			md_mutex_unlock(&found->lock);
 			md_dev = lookup_md(mdname, 0);
 			if (md_dev) {
 				remove_md_component(md_dev, found);
-				pthread_mutex_lock(&md_dev->device_lock);
+				md_mutex_lock(&md_dev->device_lock,
+					      LOCK_MD_DEVICE);
 				list_del_init(&found->siblings);
-				pthread_mutex_unlock(&md_dev->device_lock);
+				md_mutex_unlock(&md_dev->device_lock);
 				remove_component(found);
 			}
 		}
@@ -763,6 +895,7 @@ enum md_rdev_status md_rdev_check_state(struct device_monitor *dev, int *md_slot
 	if (!sysname)
 		return UNKNOWN;
 	sprintf(attrpath, "/dev/%s", sysname);
+	md_rusage_syscall(MD_SYS_OPEN);
 	ioctl_fd = open(attrpath, O_RDONLY|O_NONBLOCK);
 	if (ioctl_fd < 0) {
 		warn("%s: cannot open %s for MD ioctl: %m",
@@ -770,11 +903,13 @@ enum md_rdev_status md_rdev_check_state(struct device_monitor *dev, int *md_slot
 		return UNKNOWN;
 	}
 	info.number = dev->md_index;
+	md_rusage_syscall(MD_SYS_IOCTL);
 	if (ioctl(ioctl_fd, GET_DISK_INFO, &info) < 0) {
 		err("%s: ioctl GET_DISK_INFO failed: %m",
 		    dev->dev_name);
 		md_status = UNKNOWN;
 	}
+	md_rusage_syscall(MD_SYS_CLOSE);
 	close(ioctl_fd);
 
 	if (md_status == UNKNOWN)
@@ -800,6 +935,104 @@ enum md_rdev_status md_rdev_check_state(struct device_monitor *dev, int *md_slot
 	return md_status;
 }
 
+/*
+ * Wake up everyone waiting for a status change.
+ * Lock order: status_gen_lock nests inside all other locks.
+ */
+static void md_status_changed(void)
+{
+	md_mutex_lock(&status_gen_lock, LOCK_STATUS_GEN);
+	status_gen++;
+	pthread_cond_broadcast(&status_gen_cond);
+	md_mutex_unlock(&status_gen_lock);
+}
+
+/*
+ * Log the device state at 'info' level on transitions
+ * only; the steady state is logged at 'debug' level, so
+ * the log volume does not grow with the number of devices.
+ * Each device is updated by a single checker thread.
+ */
+void md_log_state(struct device_monitor *dev, enum md_rdev_status md_status,
+		  enum device_io_status io_status)
+{
+	if (dev->log_status != md_status || dev->log_io != io_status) {
+		info("%s: state %s / %s", dev->dev_name,
+		     md_rdev_print_state(md_status),
+		     device_io_print_state(io_status));
+		dev->log_status = md_status;
+		dev->log_io = io_status;
+	} else {
+		dbg("%s: state %s / %s", dev->dev_name,
+		    md_rdev_print_state(md_status),
+		    device_io_print_state(io_status));
+	}
+}
+
+/*
+ * Account the time an array has been degraded.
+ * Must be called with md_dev->status_lock held
+ * after 'degraded' has been modified.
+ */
+static void md_degraded_update(struct md_monitor *md_dev)
+{
+	time_t now = time(NULL);
+
+	if (md_dev->degraded && !md_dev->degraded_start) {
+		md_dev->degraded_start = now;
+	} else if (!md_dev->degraded && md_dev->degraded_start) {
+		md_dev->degraded_secs += now - md_dev->degraded_start;
+		md_dev->degraded_start = 0;
+	}
+}
+
+/*
+ * Publish the device status to the status table.
+ * Must be called with dev->lock held.
+ */
+static void md_publish_dev(struct device_monitor *dev)
+{
+	struct md_status_dev rec;
+
+	memset(&rec, 0, sizeof(rec));
+	snprintf(rec.name, MD_STATUS_NAMELEN, "%.*s",
+		 MD_STATUS_NAMELEN - 1, dev->dev_name);
+	if (dev->parent)
+		snprintf(rec.md_name, MD_STATUS_NAMELEN, "%s",
+			 udev_device_get_sysname(dev->parent));
+	rec.slot = dev->md_slot;
+	rec.side = dev->md_side;
+	rec.md_status = dev->md_status;
+	rec.io_status = dev->io_status;
+	rec.latency = dev->aio_latency;
+	md_status_set_dev(&rec, &dev->status_idx);
+}
+
+/*
+ * Publish the array status to the status table.
+ * The fields are read without locking; every path
+ * modifying them republishes after the update.
+ */
+static void md_publish_md(struct md_monitor *md_dev)
+{
+	struct md_status_array rec;
+
+	if (!md_dev->device)
+		return;
+	memset(&rec, 0, sizeof(rec));
+	snprintf(rec.name, MD_STATUS_NAMELEN, "%s",
+		 udev_device_get_sysname(md_dev->device));
+	snprintf(rec.alias, MD_STATUS_NAMELEN, "%.*s",
+		 MD_STATUS_NAMELEN - 1, md_dev->dev_name);
+	rec.raid_disks = md_dev->raid_disks;
+	rec.degraded = md_dev->degraded;
+	rec.pending_side = md_dev->pending_side;
+	rec.pending_status = md_dev->pending_status;
+	rec.recovery_state = md_dev->recovery_state;
+	rec.in_recovery = md_dev->in_recovery;
+	md_status_set_array(&rec, &md_dev->status_idx);
+}
+
 enum md_rdev_status md_rdev_update_state(struct device_monitor *dev,
 					 enum md_rdev_status md_status, int md_slot)
 {
@@ -851,10 +1084,19 @@ enum md_rdev_status md_rdev_update_state(struct device_monitor *dev,
 		dev->md_status = md_status;
 		break;
 	}
-	if (old_status != dev->md_status)
+	if (old_status != dev->md_status) {
 		info("%s: md state update from %s to %s", dev->dev_name,
 		     md_rdev_print_state(old_status),
 		     md_rdev_print_state(dev->md_status));
+		MD_PROBE4(state_change, dev->dev_name, old_status,
+			  dev->md_status, dev->io_status);
+		md_trace(TRACE_MD_STATE, dev->trace_id, old_status,
+			 dev->md_status, dev->io_status, md_slot);
+		md_event_notify("md", dev->parent ?
+				udev_device_get_sysname(dev->parent) : NULL,
+				dev->dev_name, old_status, dev->md_status,
+				dev->io_status);
+	}
 	if (md_slot != old_slot) {
 		dev->md_slot = md_slot;
 		if (dev->md_slot_saved < 0 && dev->md_slot >= 0)
@@ -862,20 +1104,28 @@ enum md_rdev_status md_rdev_update_state(struct device_monitor *dev,
 		info("%s: md slot number update from %d to %d",
 		     dev->dev_name, old_slot, dev->md_slot);
 	}
+	if (old_status != dev->md_status || md_slot != old_slot) {
+		md_publish_dev(dev);
+		md_status_changed();
+	}
 	return md_status;
 }
 
-int md_set_attribute(struct md_monitor *md_dev, const char *attr,
-		     const char *value)
+/*
+ * The md_sysfs_* variants take the udev device of the array,
+ * for callers which pinned it with udev_device_ref().
+ */
+static int md_sysfs_set(struct udev_device *md_device, const char *attr,
+			const char *value)
 {
-	const char *md_name = udev_device_get_sysname(md_dev->device);
+	const char *md_name = udev_device_get_sysname(md_device);
 	int attr_fd;
 	char attrpath[256];
 	char status[64];
 	ssize_t len, status_len = 64;
 	int rc = 0;
 
-	sprintf(attrpath, "%s/md/%s", udev_device_get_syspath(md_dev->device),
+	sprintf(attrpath, "%s/md/%s", udev_device_get_syspath(md_device),
 		attr);
 	attr_fd = open(attrpath, O_RDWR);
 	if (attr_fd < 0) {
@@ -926,6 +1176,103 @@ remove:
 	return rc;
 }
 
+int md_set_attribute(struct md_monitor *md_dev, const char *attr,
+		     const char *value)
+{
+	return md_sysfs_set(md_dev->device, attr, value);
+}
+
+static int md_sysfs_get(struct udev_device *md_device, const char *attr,
+			char *value, size_t value_len)
+{
+	const char *md_name = udev_device_get_sysname(md_device);
+	int attr_fd;
+	char attrpath[256];
+	ssize_t len;
+
+	sprintf(attrpath, "%s/md/%s", udev_device_get_syspath(md_device),
+		attr);
+	attr_fd = open(attrpath, O_RDONLY);
+	if (attr_fd < 0) {
+		dbg("%s: failed to open '%s' attribute for %s: %m",
+		    md_name, attr, attrpath);
+		return -errno;
+	}
+	memset(value, 0, value_len);
+	len = read(attr_fd, value, value_len - 1);
+	if (len < 0) {
+		warn("%s: cannot read '%s' attribute: %m",
+		     md_name, attr);
+		len = -errno;
+	} else if (len > 0 && value[len - 1] == '\n') {
+		value[len - 1] = '\0';
+		len--;
+	}
+	close(attr_fd);
+	return len;
+}
+
+int md_get_attribute(struct md_monitor *md_dev, const char *attr,
+		     char *value, size_t value_len)
+{
+	return md_sysfs_get(md_dev->device, attr, value, value_len);
+}
+
+/*
+ * Estimate the amount of data (in KiB) to be resynced on re-add.
+ * md does not export the number of dirty bits, so use the number
+ * of allocated bitmap pages from /proc/mdstat as an upper bound.
+ * Each bitmap page holds 2048 16-bit chunk counters.
+ * Arrays without a bitmap need a full resync.
+ */
+static unsigned long md_recovery_estimate(struct md_monitor *md_dev)
+{
+	const char *md_name = udev_device_get_sysname(md_dev->device);
+	char value[64], line[256];
+	unsigned long component_size = 0, chunksize = 0;
+	unsigned long pages = 0, total_pages, estimate;
+	FILE *mdstat;
+	int found = 0;
+
+	if (md_get_attribute(md_dev, "component_size",
+			     value, sizeof(value)) > 0)
+		component_size = strtoul(value, NULL, 10);
+	if (md_get_attribute(md_dev, "bitmap/chunksize",
+			     value, sizeof(value)) > 0)
+		chunksize = strtoul(value, NULL, 10);
+	if (!chunksize)
+		return component_size;
+
+	mdstat = fopen("/proc/mdstat", "r");
+	if (!mdstat)
+		return component_size;
+	while (fgets(line, sizeof(line), mdstat)) {
+		char *ptr;
+
+		if (!found) {
+			ptr = strchr(line, ' ');
+			if (ptr && ptr - line == strlen(md_name) &&
+			    !strncmp(line, md_name, ptr - line))
+				found = 1;
+			continue;
+		}
+		if (line[0] != ' ')
+			break;
+		ptr = strstr(line, "bitmap:");
+		if (ptr && sscanf(ptr, "bitmap: %lu/%lu pages",
+				  &pages, &total_pages) == 2)
+			break;
+	}
+	fclose(mdstat);
+
+	estimate = pages * 2048 * (chunksize >> 10);
+	if (component_size && estimate > component_size)
+		estimate = component_size;
+	dbg("%s: estimated resync size %lu KiB (%lu bitmap pages)",
+	    md_name, estimate, pages);
+	return estimate;
+}
+
 void device_monitor_cleanup(void *data)
 {
 	struct device_monitor *dev = data;
@@ -937,11 +1284,13 @@ void device_monitor_cleanup(void *data)
 	}
 
 	info("%s: shutdown device monitor thread", dev->dev_name);
-	pthread_mutex_lock(&dev->lock);
+	md_heartbeat_stop(&dev->hb);
+	md_rusage_stop();
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	dev->running = 0;
 	dev->thread = 0;
 	pthread_cond_signal(&dev->io_cond);
-	pthread_mutex_unlock(&dev->lock);
+	md_mutex_unlock(&dev->lock);
 	device_monitor_put(dev);
 }
 
@@ -986,13 +1335,13 @@ device_monitor_update(struct device_monitor *dev,
 	} else {
 		switch (new_status) {
 		case IN_SYNC:
-			pthread_mutex_lock(&dev->lock);
-			if (dev->running && stop_on_sync) {
+			md_mutex_lock(&dev->lock, LOCK_DEVICE);
+			if (dev->running && stop_on_sync && !dev->sync_probe) {
 				info("%s: path ok, stopping monitor",
 				     dev->dev_name);
 				dev->running = 0;
 			}
-			pthread_mutex_unlock(&dev->lock);
+			md_mutex_unlock(&dev->lock);
 			break;
 		case RECOVERY:
 		case BLOCKED:
@@ -1005,6 +1354,17 @@ device_monitor_update(struct device_monitor *dev,
 			break;
 		}
 	}
+	/* Called for every probe, so only report changes */
+	if (io_status != dev->event_io || new_status != dev->event_status) {
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
+		md_event_notify("io", dev->parent ?
+				udev_device_get_sysname(dev->parent) : NULL,
+				dev->dev_name, dev->event_status, new_status,
+				io_status);
+		md_mutex_unlock(&dev->lock);
+		dev->event_io = io_status;
+		dev->event_status = new_status;
+	}
 	return new_status;
 }
 
@@ -1012,12 +1372,15 @@ void *device_monitor_thread (void *ctx)
 {
 	struct device_monitor *dev = ctx;
 	unsigned long pgsize = getpagesize();
-	enum device_io_status io_status;
+	enum device_io_status io_status, stat_status;
 	enum md_rdev_status md_status, new_status;
 	struct timespec tmo;
-	int rc, aio_timeout = 0, sig_timeout = checker_timeout;
+	unsigned long aio_timeout = 0, sig_timeout = checker_timeout;
+	int rc, may_skip;
 
 	device_monitor_get(dev);
+	md_rusage_start(SUBSYS_CHECKER);
+	md_heartbeat(&dev->hb, "setup", checker_timeout);
 	/* Reset any stale ioctl flags */
 	dasd_timeout_ioctl(dev->device, 0);
 
@@ -1035,20 +1398,50 @@ void *device_monitor_thread (void *ctx)
 		pthread_exit(&rc);
 	}
 
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	while (dev->running) {
-		dbg("%s: check aio state, timeout %d secs",
+		dbg("%s: check aio state, timeout %lu msecs",
 		    dev->dev_name, aio_timeout);
 		if (dev->md_status == TIMEOUT) {
+			md_heartbeat(&dev->hb, "timeout reset",
+				     checker_timeout);
 			dasd_timeout_ioctl(dev->device, 0);
 			dev->md_status = UNKNOWN;
 		}
-		pthread_mutex_unlock(&dev->lock);
-		io_status = dasd_check_aio(dev, aio_timeout);
+		/*
+		 * Failed I/O is counted as completed in the stat file,
+		 * so only skip the probe on in_sync devices whose last
+		 * probe succeeded. Resync sources are always probed,
+		 * as the resync throttling needs the probe latency.
+		 */
+		may_skip = passive_check && dev->md_status == IN_SYNC &&
+			dev->probe_status == IO_OK && !dev->sync_probe;
+		md_mutex_unlock(&dev->lock);
+		md_heartbeat(&dev->hb, "probe", max_io_timeout);
+		if (dev->ioprio != probe_ioprio) {
+			dev->ioprio = probe_ioprio;
+			dasd_set_ioprio(dev, dev->ioprio);
+		}
+		/* Sampled on every round to detect hung in-flight I/O */
+		stat_status = IO_UNKNOWN;
+		if (aio_timeout && !dev->aio_active)
+			stat_status = dasd_check_stat(dev, hung_timeout);
+		if (may_skip && stat_status == IO_OK) {
+			/* Device is busy completing I/O, skip the probe */
+			dbg("%s: I/O in progress, skip probe", dev->dev_name);
+			dev->probes_skipped++;
+			md_metrics_probe_skipped();
+			io_status = IO_OK;
+		} else {
+			io_status = dasd_check_aio(dev, aio_timeout,
+						   max_io_timeout);
+			dev->probe_status = io_status;
+			md_metrics_probe(io_status);
+		}
 		if (io_status == IO_ERROR) {
 			warn("%s: error during aio submission, exit",
 			     dev->dev_name);
-			pthread_mutex_lock(&dev->lock);
+			md_mutex_lock(&dev->lock, LOCK_DEVICE);
 			break;
 		}
 		pthread_testcancel();
@@ -1056,39 +1449,46 @@ void *device_monitor_thread (void *ctx)
 			int md_slot = -1;
 
 			/* Re-check; status might have been changed during aio */
+			md_heartbeat(&dev->hb, "md state check",
+				     checker_timeout);
 			md_status = md_rdev_check_state(dev, &md_slot);
 			if (md_status == UNKNOWN) {
 				/* array has been stopped */
 				info("%s: stopping monitor in status %s",
 				     dev->dev_name,
 				     md_rdev_print_state(md_status));
-				pthread_mutex_lock(&dev->lock);
+				md_mutex_lock(&dev->lock, LOCK_DEVICE);
 				break;
 			}
 
 			/* Write status back */
-			pthread_mutex_lock(&dev->lock);
+			md_mutex_lock(&dev->lock, LOCK_DEVICE);
 			new_status = md_rdev_update_state(dev, md_status, md_slot);
 		} else {
-			pthread_mutex_lock(&dev->lock);
+			md_mutex_lock(&dev->lock, LOCK_DEVICE);
 			new_status = TIMEOUT;
 		}
 		/* dev->lock held */
 		if (io_status == IO_PENDING) {
 			/*
 			 * io_getevents or sigtimedwait
-			 * got interrupted by a signal.
+			 * got interrupted by a signal, or the
+			 * probe is queued behind other I/O.
 			 * Check whether we need to fail the mirror.
 			 */
-			pthread_mutex_unlock(&dev->lock);
+			md_mutex_unlock(&dev->lock);
+			md_heartbeat(&dev->hb, "state update", checker_timeout);
 			info("%s: path checker interrupted, new state %s",
 			     dev->dev_name, md_rdev_print_state(new_status));
 			if (new_status == FAULTY || new_status == TIMEOUT) {
 				fail_mirror(dev, new_status);
 			}
 			aio_timeout = monitor_timeout;
-			pthread_mutex_lock(&dev->lock);
+			md_mutex_lock(&dev->lock, LOCK_DEVICE);
+			if (dev->io_status != io_status)
+				md_status_changed();
 			dev->io_status = io_status;
+			md_publish_dev(dev);
 			pthread_cond_signal(&dev->io_cond);
 			continue;
 		}
@@ -1104,23 +1504,28 @@ void *device_monitor_thread (void *ctx)
 			aio_timeout = monitor_timeout;
 			continue;
 		}
+		if (dev->io_status != io_status)
+			md_status_changed();
 		dev->io_status = io_status;
+		md_publish_dev(dev);
 		pthread_cond_signal(&dev->io_cond);
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
+		md_heartbeat(&dev->hb, "state update", checker_timeout);
 		new_status = device_monitor_update(dev, io_status, new_status);
-		info("%s: state %s / %s",
-		     dev->dev_name, md_rdev_print_state(new_status),
-		     device_io_print_state(io_status));
+		md_log_state(dev, new_status, io_status);
 		if (new_status == STOPPED) {
-			pthread_mutex_lock(&dev->lock);
+			md_mutex_lock(&dev->lock, LOCK_DEVICE);
 			break;
 		}
-		tmo.tv_sec = sig_timeout;
-		tmo.tv_nsec = 0;
-		info("%s: waiting %ld seconds ...",
-		     dev->dev_name, (long)tmo.tv_sec);
+		__atomic_fetch_add(&dev->cpu_usecs, md_rusage_account(1),
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_add(&dev->cpu_probes, 1, __ATOMIC_RELAXED);
+		md_msecs_to_timespec(sig_timeout, &tmo);
+		dbg("%s: waiting %lu msecs ...", dev->dev_name, sig_timeout);
+		md_heartbeat(&dev->hb, "wait", sig_timeout);
 		rc = sigtimedwait(&thread_sigmask, NULL, &tmo);
-		pthread_mutex_lock(&dev->lock);
+		md_heartbeat(&dev->hb, "lock", checker_timeout);
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
 		if (rc < 0) {
 			if (errno == EINTR) {
 				info("%s: ignore signal",
@@ -1137,7 +1542,7 @@ void *device_monitor_thread (void *ctx)
 			aio_timeout = 0;
 		}
 	}
-	pthread_mutex_unlock(&dev->lock);
+	md_mutex_unlock(&dev->lock);
 
 	pthread_cleanup_pop(1);
 	return ((void *)0);
@@ -1151,7 +1556,7 @@ static void monitor_device(struct device_monitor *dev)
 		return;
 
 	device_monitor_get(dev);
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	if (dev->running) {
 		/* check if thread is still alive */
 		if (dev->thread) {
@@ -1161,32 +1566,32 @@ static void monitor_device(struct device_monitor *dev)
 			info("%s: notify monitor thread",
 			     dev->dev_name);
 			/* Release the lock to avoid deadlocking */
-			pthread_mutex_unlock(&dev->lock);
+			md_mutex_unlock(&dev->lock);
 			device_monitor_put(dev);
 			pthread_kill(thread, SIGHUP);
 			return;
 		}
 		info("%s: Re-start monitor", dev->dev_name);
 		dev->running = 0;
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 		/* Yield lock here to give stale threads time to react */
 		pthread_yield();
 	} else {
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 		/* Start new monitor thread */
 		info("%s: Start new monitor", dev->dev_name);
 	}
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	dev->running = 1;
-	pthread_mutex_unlock(&dev->lock);
+	md_mutex_unlock(&dev->lock);
 	rc = pthread_create(&dev->thread, &monitor_attr,
 			    device_monitor_thread, dev);
 	if (rc) {
-		pthread_mutex_lock(&dev->lock);
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
 		dev->running = 0;
 		dev->io_status = IO_UNKNOWN;
 		dev->thread = 0;
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 		warn("%s: Failed to start monitor thread, error %d",
 		     dev->dev_name, rc);
 	}
@@ -1206,7 +1611,7 @@ static void add_component(struct md_monitor *md, struct device_monitor *dev,
 	if (md_namelen > MD_NAMELEN)
 		md_namelen = MD_NAMELEN;
 
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	info("%s: Add component %s (%d/%d)", dev->dev_name, md_name,
 	     dev->md_index, dev->md_slot);
 	if (!dev->parent) {
@@ -1219,15 +1624,18 @@ static void add_component(struct md_monitor *md, struct device_monitor *dev,
 		md_rdev_update_index(md, dev);
 	if (!strncmp(dev->dev_name, "dasd", 4))
 		is_dasd = 1;
-	pthread_mutex_unlock(&dev->lock);
+	md_publish_dev(dev);
+	md_mutex_unlock(&dev->lock);
+	md_publish_md(md);
 	if (is_dasd) {
 		dasd_set_attribute(dev, "failfast", 1);
+		/* The DASD attributes are in whole seconds */
 		if (dasd_set_attribute(dev, "timeout",
-			(failfast_retries + 1) * failfast_timeout) < 0) {
+			(monitor_timeout + 999) / 1000) < 0) {
 			dasd_set_attribute(dev, "failfast_retries",
 					   failfast_retries);
 			dasd_set_attribute(dev, "failfast_expires",
-					   failfast_timeout);
+					   (failfast_timeout + 999) / 1000);
 		}
 	}
 }
@@ -1237,11 +1645,12 @@ static void remove_component(struct device_monitor *dev)
 	info("%s: Remove component (%d/%d)",
 	     dev->dev_name, dev->md_index, dev->md_slot);
 
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	if (dev->parent)
 		udev_device_unref(dev->parent);
 	dev->parent = NULL;
-	pthread_mutex_unlock(&dev->lock);
+	md_mutex_unlock(&dev->lock);
+	md_status_remove_dev(dev->dev_name);
 }
 
 static int fail_component(struct device_monitor *dev,
@@ -1253,11 +1662,11 @@ static int fail_component(struct device_monitor *dev,
 
 	/* Check state if we need to do anything here */
 	old_status = md_rdev_check_state(dev, &md_slot);
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	dev->md_status = old_status;
 	md_status = md_rdev_update_state(dev, new_status, md_slot);
 	if (md_status == new_status) {
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 		info("%s: already in state '%s'",
 		     dev->dev_name, md_rdev_print_state(md_status));
 		return rc;
@@ -1267,13 +1676,13 @@ static int fail_component(struct device_monitor *dev,
 	if (dev->running && thread) {
 		if (new_status == REMOVED)
 			dev->running = 0;
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 		info("%s: notify monitor thread for new status %s",
 		     dev->dev_name, md_rdev_print_state(new_status));
 		pthread_kill(thread, SIGHUP);
 		rc = EBUSY;
 	} else {
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 	}
 
 	return rc;
@@ -1281,11 +1690,11 @@ static int fail_component(struct device_monitor *dev,
 
 static int reset_component(struct device_monitor *dev)
 {
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	if (dev->io_status != IO_OK) {
 		info("%s: I/O status %s, do not reset device", dev->dev_name,
 		     device_io_print_state(dev->io_status));
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 		return -EIO;
 	}
 
@@ -1312,21 +1721,24 @@ static int reset_component(struct device_monitor *dev)
 		     md_rdev_print_state(dev->md_status));
 		break;
 	}
-	pthread_mutex_unlock(&dev->lock);
+	md_publish_dev(dev);
+	md_mutex_unlock(&dev->lock);
+	md_status_changed();
 
 	return 0;
 }
 
-static void fail_mirror(struct device_monitor *dev, enum md_rdev_status status)
+static void __fail_mirror(struct device_monitor *dev,
+			  enum md_rdev_status status)
 {
 	struct md_monitor *md_dev;
 	struct device_monitor *tmp;
 	const char *md_name = NULL;
 
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	if (dev->parent)
 		md_name = udev_device_get_sysname(dev->parent);
-	pthread_mutex_unlock(&dev->lock);
+	md_mutex_unlock(&dev->lock);
 	md_dev = lookup_md(md_name, 0);
 	if (!md_dev) {
 		warn("%s: No md device found", dev->dev_name);
@@ -1335,116 +1747,147 @@ static void fail_mirror(struct device_monitor *dev, enum md_rdev_status status)
 	md_name = udev_device_get_sysname(md_dev->device);
 	if (md_dev->in_discovery) {
 		info("%s: md in discovery, not failing mirror", md_name);
+		MD_PROBE4(fail_mirror, dev->dev_name, md_name, status,
+			  "discovery");
 		return;
 	}
+	md_trace(TRACE_FAIL_MIRROR, dev->trace_id, dev->md_status, status,
+		 dev->io_status, dev->md_side);
 	if (!fail_mirror_side || status == REMOVED) {
+		MD_PROBE4(fail_mirror, dev->dev_name, md_name, status,
+			  "component");
 		fail_component(dev, status);
 		return;
 	}
 
-	pthread_mutex_lock(&md_dev->status_lock);
+	md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
 	if (!md_dev->device) {
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 		return;
 	}
+	if (md_dev->pending_status == IN_SYNC) {
+		/* A queued recovery must not hold off failing the array */
+		md_mutex_lock(&pending_lock, LOCK_PENDING);
+		if (md_dev->recovery_state == RECOVERY_QUEUED) {
+			info("%s: cancel queued recovery", md_name);
+			list_del_init(&md_dev->recovery);
+			md_dev->recovery_state = RECOVERY_IDLE;
+			md_dev->pending_status = UNKNOWN;
+			md_dev->pending_side = 0;
+		}
+		md_mutex_unlock(&pending_lock);
+	}
 	if (md_dev->pending_status) {
 		info("%s: %s already scheduled, not failing", md_name,
 		     md_rdev_print_state(md_dev->pending_status));
-		pthread_mutex_unlock(&md_dev->status_lock);
+		MD_PROBE4(fail_mirror, dev->dev_name, md_name, status,
+			  "scheduled");
+		md_mutex_unlock(&md_dev->status_lock);
 		return;
 	}
 
 	if (md_dev->degraded & (1 << dev->md_side)) {
 		/* Mirror side is already failed, nothing to be done here */
 		info("%s: mirror side %d is already failed", md_name, dev->md_side);
-		pthread_mutex_unlock(&md_dev->status_lock);
+		MD_PROBE4(fail_mirror, dev->dev_name, md_name, status,
+			  "side_failed");
+		md_mutex_unlock(&md_dev->status_lock);
 	} else if (md_dev->degraded) {
 		/* Mirror is already degraded, do not notify md */
 		info("%s: other mirror side for %d is already failed",
 		     md_name, dev->md_side);
+		MD_PROBE4(fail_mirror, dev->dev_name, md_name, status,
+			  "degraded");
 		md_dev->degraded |= (1 << dev->md_side);
-		pthread_mutex_unlock(&md_dev->status_lock);
-		pthread_mutex_lock(&md_dev->device_lock);
+		md_degraded_update(md_dev);
+		md_mutex_unlock(&md_dev->status_lock);
+		md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
 		list_for_each_entry(tmp, &md_dev->children, siblings) {
 			if (tmp->md_side == dev->md_side) {
-				pthread_mutex_lock(&tmp->lock);
+				md_mutex_lock(&tmp->lock, LOCK_DEVICE);
 				tmp->md_status = BLOCKED;
-				pthread_mutex_unlock(&tmp->lock);
+				md_publish_dev(tmp);
+				md_mutex_unlock(&tmp->lock);
 			}
 		}
-		pthread_mutex_unlock(&md_dev->device_lock);
+		md_mutex_unlock(&md_dev->device_lock);
+		md_status_changed();
 	} else {
 		info("%s: Failing all devices on side %d, status %s",
 		     md_name, dev->md_side, md_rdev_print_state(status));
+		MD_PROBE4(fail_mirror, dev->dev_name, md_name, status, "fail");
 		if (list_empty(&md_dev->pending)) {
-			pthread_mutex_lock(&pending_lock);
+			md_mutex_lock(&pending_lock, LOCK_PENDING);
 			md_dev->pending_status = status;
 			md_dev->pending_side = (1 << dev->md_side);
+			md_dev->pending_time = md_trace_now();
 			list_add(&md_dev->pending, &pending_list);
 			pthread_cond_signal(&pending_cond);
-			pthread_mutex_unlock(&pending_lock);
+			md_mutex_unlock(&pending_lock);
 		} else {
 			info("%s: fail already scheduled", md_name);
 		}
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 	}
-
+	md_publish_md(md_dev);
 }
 
-static void reset_mirror(struct device_monitor *dev)
+static void __reset_mirror(struct device_monitor *dev)
 {
 	struct md_monitor *md_dev;
 	int ready_devices;
 	struct device_monitor *tmp;
 	const char *md_name = NULL;
 
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	if (dev->parent)
 		md_name = udev_device_get_sysname(dev->parent);
-	pthread_mutex_unlock(&dev->lock);
+	md_mutex_unlock(&dev->lock);
 	md_dev = lookup_md(md_name, 0);
 	if (!md_dev) {
 		warn("%s: No md device found", dev->dev_name);
 		return;
 	}
-	pthread_mutex_lock(&md_dev->status_lock);
+	md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
 	if (!md_dev->device) {
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 		return;
 	}
 	md_name = udev_device_get_sysname(md_dev->device);
 	if (md_dev->in_recovery) {
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 		info("%s: array in recovery, skip reset", md_name);
+		MD_PROBE4(reset_mirror, dev->dev_name, md_name, 0, "recovery");
 		return;
 	}
 	if (md_dev->pending_status) {
 		info("%s: %s already scheduled, not resetting", md_name,
 		     md_rdev_print_state(md_dev->pending_status));
-		pthread_mutex_unlock(&md_dev->status_lock);
+		MD_PROBE4(reset_mirror, dev->dev_name, md_name, 0, "scheduled");
+		md_mutex_unlock(&md_dev->status_lock);
 		return;
 	}
-	pthread_mutex_unlock(&md_dev->status_lock);
+	md_mutex_unlock(&md_dev->status_lock);
 
 	info("%s: reset mirror side %d", md_name, dev->md_side);
-	pthread_mutex_lock(&md_dev->device_lock);
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
 	ready_devices = 0;
 	list_for_each_entry(tmp, &md_dev->children, siblings) {
 		int recheck = 0;
 		pthread_t thread;
 
-		pthread_mutex_lock(&tmp->lock);
+		md_mutex_lock(&tmp->lock, LOCK_DEVICE);
 		dbg("%s: dev %s side %d state %s / %s slot %d", md_name, tmp->dev_name,
 		     tmp->md_side, md_rdev_print_state(tmp->md_status),
 		     device_io_print_state(tmp->io_status));
 		if (tmp->md_status == RECOVERY) {
-			pthread_mutex_unlock(&tmp->lock);
+			md_mutex_unlock(&tmp->lock);
 			continue;
 		}
 		if (tmp->io_status == IO_UNKNOWN ||
 		    tmp->io_status == IO_FAILED ||
 		    tmp->io_status == IO_RETRY) {
-			pthread_mutex_unlock(&tmp->lock);
+			md_mutex_unlock(&tmp->lock);
 			continue;
 		}
 		if (tmp->md_side != dev->md_side)
@@ -1460,51 +1903,110 @@ static void reset_mirror(struct device_monitor *dev)
 			if (tmp->md_slot < 0)
 				ready_devices++;
 		}
-		pthread_mutex_unlock(&tmp->lock);
+		md_mutex_unlock(&tmp->lock);
 		if (recheck) {
 			info("%s: notify monitor thread to recheck slot",
 			     tmp->dev_name);
 			pthread_kill(thread, SIGHUP);
 		}
 	}
-	pthread_mutex_unlock(&md_dev->device_lock);
+	md_mutex_unlock(&md_dev->device_lock);
 	/* Not enough devices, don't reset mirror side */
 	if (ready_devices != md_dev->raid_disks) {
 		info("%s: not enough devices to reset (%d/%d)", md_name,
 		     ready_devices, md_dev->raid_disks);
+		MD_PROBE4(reset_mirror, dev->dev_name, md_name, ready_devices,
+			  "not_ready");
 		return;
 	}
 	info("%s: reset mirror, %d of %d devices ready", md_name,
 	     ready_devices, md_dev->raid_disks);
+	MD_PROBE4(reset_mirror, dev->dev_name, md_name, ready_devices, "reset");
+	md_trace(TRACE_RESET_MIRROR, dev->trace_id, dev->md_status, IN_SYNC,
+		 dev->io_status, ready_devices);
 
-	pthread_mutex_lock(&md_dev->status_lock);
+	md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
 	if (list_empty(&md_dev->pending)) {
-		pthread_mutex_lock(&pending_lock);
+		md_mutex_lock(&pending_lock, LOCK_PENDING);
 		md_dev->pending_status = IN_SYNC;
 		md_dev->pending_side = (1 << dev->md_side);
+		md_dev->pending_time = md_trace_now();
 		list_add(&md_dev->pending, &pending_list);
 		pthread_cond_signal(&pending_cond);
-		pthread_mutex_unlock(&pending_lock);
+		md_mutex_unlock(&pending_lock);
 	} else {
 		info("%s: reset already scheduled", md_name);
 	}
-	pthread_mutex_unlock(&md_dev->status_lock);
+	md_mutex_unlock(&md_dev->status_lock);
 }
 
-static void fail_md_component(struct md_monitor *md_dev,
-			      struct device_monitor *dev)
+/*
+ * Scheduling a failover or a reset must not allocate memory,
+ * see md_alloc.h.
+ */
+static void fail_mirror(struct device_monitor *dev, enum md_rdev_status status)
+{
+	md_alloc_enter();
+	__fail_mirror(dev, status);
+	md_alloc_exit();
+}
+
+static void reset_mirror(struct device_monitor *dev)
+{
+	md_alloc_enter();
+	__reset_mirror(dev);
+	md_alloc_exit();
+}
+
+/*
+ * Fail a component after a 'Fail' event. The component named
+ * in the event is failed unless MD reports it as recovering,
+ * a sibling only if MD has failed it, too.
+ */
+static void __fail_md_component(struct md_monitor *md_dev,
+				struct device_monitor *dev, int sibling)
 {
 	enum md_rdev_status md_status, new_status;
-	int md_slot = -1;
+	int md_slot = -1, side_failed = 0;
 
 	/*
 	 * Fail does not necessarily indicate the device has gone,
 	 * so just invoke a state check.
 	 */
-	info("%s: fail component in state %s", dev->dev_name,
-	     md_rdev_print_state(dev->md_status));
+	if (!sibling)
+		info("%s: fail component in state %s", dev->dev_name,
+		     md_rdev_print_state(dev->md_status));
+
+	/*
+	 * mdadm sends one 'Fail' event per device when a mirror
+	 * side fails; once the side is failed or a fail is
+	 * scheduled there is no need to query MD for each device.
+	 */
+	if (fail_mirror_side) {
+		md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
+		if (md_dev->degraded & (1 << dev->md_side))
+			side_failed = 1;
+		else if ((md_dev->pending_side & (1 << dev->md_side)) &&
+			 (md_dev->pending_status == FAULTY ||
+			  md_dev->pending_status == TIMEOUT))
+			side_failed = 1;
+		md_mutex_unlock(&md_dev->status_lock);
+	}
+	if (side_failed) {
+		if (sibling)
+			return;
+		info("%s: mirror side %d already failing, skip state check",
+		     dev->dev_name, dev->md_side);
+		monitor_device(dev);
+		return;
+	}
 
 	md_status = md_rdev_check_state(dev, &md_slot);
+	if (sibling && md_status != FAULTY && md_status != TIMEOUT)
+		return;
+	if (sibling)
+		info("%s: failed by MD in state %s", dev->dev_name,
+		     md_rdev_print_state(md_status));
 	if (md_status == UNKNOWN ||
 	    md_status == RECOVERY ||
 	    md_status == SPARE ||
@@ -1525,7 +2027,7 @@ static void fail_md_component(struct md_monitor *md_dev,
 		return;
 	} else if (md_status != TIMEOUT)
 		md_status = FAULTY;
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	new_status = md_rdev_update_state(dev, md_status, md_slot);
 	if (new_status == TIMEOUT)
 		dev->io_status = IO_TIMEOUT;
@@ -1533,19 +2035,73 @@ static void fail_md_component(struct md_monitor *md_dev,
 		dev->io_status = IO_FAILED;
 	else
 		dev->io_status = IO_OK;
-	pthread_mutex_unlock(&dev->lock);
+	md_publish_dev(dev);
+	md_mutex_unlock(&dev->lock);
+	md_status_changed();
 	if (new_status != IN_SYNC)
 		fail_mirror(dev, new_status);
 
 	monitor_device(dev);
 }
 
+/*
+ * mdadm sends one 'Fail' event per component, so the first
+ * event within 'coalesce_msecs' checks all components of the
+ * array in one pass. Later events in that window are skipped
+ * for components which the pass has already failed.
+ * Only called from the CLI event loop.
+ */
+static int fail_md_components(struct md_monitor *md_dev,
+			      struct device_monitor *dev)
+{
+	struct device_monitor *tmp, **devs;
+	enum md_rdev_status md_status;
+	unsigned long now = md_monotonic_msecs();
+	int i, nr = 0, num = 0;
+
+	if (coalesce_msecs && md_dev->fail_pass &&
+	    now - md_dev->fail_pass < coalesce_msecs) {
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
+		md_status = dev->md_status;
+		md_mutex_unlock(&dev->lock);
+		if (md_status == FAULTY || md_status == TIMEOUT) {
+			dbg("%s: already failed by the last pass",
+			    dev->dev_name);
+			return 1;
+		}
+		__fail_md_component(md_dev, dev, 0);
+		return 0;
+	}
+	md_dev->fail_pass = now;
+	__fail_md_component(md_dev, dev, 0);
+	if (!coalesce_msecs)
+		return 0;
+
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
+	list_for_each_entry(tmp, &md_dev->children, siblings)
+		nr++;
+	devs = calloc(nr, sizeof(*devs));
+	if (devs) {
+		list_for_each_entry(tmp, &md_dev->children, siblings) {
+			if (tmp != dev)
+				devs[num++] = device_monitor_get(tmp);
+		}
+	}
+	md_mutex_unlock(&md_dev->device_lock);
+	for (i = 0; i < num; i++) {
+		__fail_md_component(md_dev, devs[i], 1);
+		device_monitor_put(devs[i]);
+	}
+	free(devs);
+	return 0;
+}
+
 static void sync_md_component(struct md_monitor *md_dev,
 			      struct device_monitor *dev)
 {
 	const char *md_name = udev_device_get_sysname(md_dev->device);
 
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	if (dev->md_status == PENDING) {
 		warn("%s: mdadm call still pending", dev->dev_name);
 	}
@@ -1556,7 +2112,9 @@ static void sync_md_component(struct md_monitor *md_dev,
 	 * IN_SYNC should override previous state.
 	 */
 	dev->md_status = IN_SYNC;
-	pthread_mutex_unlock(&dev->lock);
+	md_publish_dev(dev);
+	md_mutex_unlock(&dev->lock);
+	md_status_changed();
 	monitor_device(dev);
 }
 
@@ -1565,24 +2123,25 @@ static void remove_md_component(struct md_monitor *md_dev,
 {
 	pthread_t thread;
 
-	pthread_mutex_lock(&dev->lock);
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
 	if (dev->md_status == PENDING) {
 		warn("%s: mdadm call still pending", dev->dev_name);
 	}
 	info("%s: setting '%s' to REMOVED",
 	     md_dev->dev_name, dev->dev_name);
 	dev->md_status = REMOVED;
+	md_status_changed();
 	thread = dev->thread;
 	if (dev->running && thread) {
 		info("%s: shutdown monitor thread",
 		     dev->dev_name);
 		dev->running = 0;
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 		pthread_kill(thread, SIGHUP);
 		if (pthread_cancel(thread) == 0)
 			pthread_join(thread, NULL);
 	} else {
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 	}
 }
 
@@ -1614,7 +2173,7 @@ static void discover_md_components(struct md_monitor *md)
 	}
 	/* Temporarily move children devices onto a separate list */
 	INIT_LIST_HEAD(&update_list);
-	pthread_mutex_lock(&md->device_lock);
+	md_mutex_lock(&md->device_lock, LOCK_MD_DEVICE);
 	list_splice_init(&md->children, &update_list);
 	for (i = 0; i < 4096; i++) {
 		dev_t raid_devt, mon_devt, tmp_devt;
@@ -1667,7 +2226,7 @@ static void discover_md_components(struct md_monitor *md)
 			}
 		}
 		if (found) {
-			pthread_mutex_lock(&found->lock);
+			md_mutex_lock(&found->lock, LOCK_DEVICE);
 			if (!found->parent)
 				found->parent = md->device;
 
@@ -1678,7 +2237,8 @@ static void discover_md_components(struct md_monitor *md)
 			found->md_slot = info.raid_disk;
 			if (found->md_slot_saved < 0 && found->md_slot >= 0)
 				found->md_slot_saved = found->md_slot;
-			pthread_mutex_unlock(&found->lock);
+			md_mutex_unlock(&found->lock);
+			md_trace_set_parent(found->trace_id, md->trace_id);
 			list_move(&found->siblings, &md->children);
 			monitor_device(found);
 			found = NULL;
@@ -1711,13 +2271,13 @@ static void discover_md_components(struct md_monitor *md)
 			     udev_device_get_devpath(mon_dev));
 			unlock_device_list();
 		}
-		pthread_mutex_lock(&found->lock);
+		md_mutex_lock(&found->lock, LOCK_DEVICE);
 		found->md_index = i;
 		found->md_slot = info.raid_disk;
 		if (found->md_slot_saved < 0 && found->md_slot >= 0)
 			found->md_slot_saved = found->md_slot;
 		found->md_side = found->md_slot % (md->layout & 0xFF);
-		pthread_mutex_unlock(&found->lock);
+		md_mutex_unlock(&found->lock);
 		sysname = udev_device_get_sysname(raid_dev);
 		if (!strncmp(sysname, "dm-", 3)) {
 			sysname = udev_device_get_sysattr_value(raid_dev,
@@ -1736,16 +2296,17 @@ static void discover_md_components(struct md_monitor *md)
 			add_component(md, found, sysname);
 			info("%s: Start monitoring %s", mdname, found->md_name);
 			udev_device_unref(raid_dev);
+			md_trace_set_parent(found->trace_id, md->trace_id);
 			list_add(&found->siblings, &md->children);
 			monitor_device(found);
 		}
 		found = NULL;
 	}
-	pthread_mutex_unlock(&md->device_lock);
-	pthread_mutex_lock(&md->status_lock);
+	md_mutex_unlock(&md->device_lock);
+	md_mutex_lock(&md->status_lock, LOCK_MD_STATUS);
 	if (!md->in_recovery) {
 		/* Cleanup stale devices */
-		pthread_mutex_unlock(&md->status_lock);
+		md_mutex_unlock(&md->status_lock);
 		list_for_each_entry_safe(found, tmp, &update_list, siblings) {
 			info("%s: Remove stale device",
 			     found->dev_name);
@@ -1753,43 +2314,76 @@ static void discover_md_components(struct md_monitor *md)
 			list_del_init(&found->siblings);
 			remove_component(found);
 		}
-		pthread_mutex_lock(&md->status_lock);
+		md_mutex_lock(&md->status_lock, LOCK_MD_STATUS);
 	} else {
 		info("%s: skip stale device detection, array in recovery",
 		     mdname);
 	}
 	md->in_discovery = 0;
-	pthread_mutex_unlock(&md->status_lock);
+	md_mutex_unlock(&md->status_lock);
 	close(ioctl_fd);
 }
 
+/*
+ * Run 'mdadm --manage <md> <op> <arg>' without a shell.
+ * posix_spawn() does not duplicate the address space, so
+ * it does not allocate or fault in pages in the daemon.
+ * Returns the wait status like system().
+ */
+static int md_run_mdadm(struct md_monitor *md_dev, const char *op,
+			const char *arg)
+{
+	char *argv[] = { "mdadm", "--manage", md_dev->dev_path,
+			 (char *)op, (char *)arg, NULL };
+	pid_t pid;
+	int rc, status;
+
+	dbg("%s: call 'mdadm --manage %s %s %s'", md_dev->dev_name,
+	    md_dev->dev_path, op, arg);
+	rc = posix_spawnp(&pid, "mdadm", NULL, NULL, argv, environ);
+	if (rc) {
+		warn("%s: cannot run mdadm: %s", md_dev->dev_name,
+		     strerror(rc));
+		return -1;
+	}
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			warn("%s: cannot wait for mdadm: %m",
+			     md_dev->dev_name);
+			return -1;
+		}
+	}
+	return status;
+}
+
 static int fail_md(struct md_monitor *md_dev)
 {
 	const char *md_name = udev_device_get_sysname(md_dev->device);
-	char cmdline[256];
 	int rc, pending_side;
 	enum md_rdev_status pending_status;
 	struct device_monitor *dev;
+	uint64_t start;
 
-	pthread_mutex_lock(&md_dev->status_lock);
+	md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
 	pending_side = md_dev->pending_side;
 	pending_status = md_dev->pending_status;
 
 	if (!md_dev->pending_side) {
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 		warn("%s: no pending side", md_name);
 		return 0;
 	}
 	if (md_dev->degraded & md_dev->pending_side) {
 		info("%s: mirror side %d already failed", md_name,
 		     (md_dev->pending_side >> 1));
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 		return 0;
 	}
 	/* Set DASD timeout to abort all outstanding I/O */
 	if (md_dev->pending_status == TIMEOUT) {
-		pthread_mutex_unlock(&md_dev->status_lock);
-		pthread_mutex_lock(&md_dev->device_lock);
+		md_mutex_unlock(&md_dev->status_lock);
+		start = md_trace_now();
+		md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
 		list_for_each_entry(dev, &md_dev->children, siblings) {
 			if (dev->md_side == (pending_side >> 1)) {
 				if (!strncmp(dev->dev_name, "dasd", 4))
@@ -1799,21 +2393,27 @@ static int fail_md(struct md_monitor *md_dev)
 							      monitor_timeout);
 			}
 		}
-		pthread_mutex_unlock(&md_dev->device_lock);
+		md_mutex_unlock(&md_dev->device_lock);
+		md_trace_span(TRACE_SET_TIMEOUT, md_dev->trace_id, start,
+			      IN_SYNC, pending_status, IO_UNKNOWN);
 	} else {
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 	}
 
-	sprintf(cmdline, "mdadm --manage /dev/%s --fail set-%c", md_name,
-		(pending_side >> 1) ? 'B' : 'A' );
-	dbg("%s: call 'system' '%s'", md_name, cmdline);
-	rc = system(cmdline);
+	start = md_trace_now();
+	rc = md_run_mdadm(md_dev, "--fail",
+			  (pending_side >> 1) ? "set-B" : "set-A");
+	md_trace_span(TRACE_MDADM, md_dev->trace_id, start, IN_SYNC,
+		      pending_status, IO_UNKNOWN);
+	md_trace(TRACE_FAIL_MD, md_dev->trace_id, IN_SYNC, pending_status,
+		 IO_UNKNOWN, rc);
 	if (rc) {
 		warn("%s: cannot fail mirror, error %d", md_name, rc);
 	} else {
 		dbg("%s: mirror set-%c failed", md_name,
 		    (pending_side >> 1) ? 'B' : 'A');
-		pthread_mutex_lock(&md_dev->device_lock);
+		start = md_trace_now();
+		md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
 		/*
 		 * When failing one side we need to disable the
 		 * 'failfast' setting on the other, as the array
@@ -1826,46 +2426,59 @@ static int fail_md(struct md_monitor *md_dev)
 				dasd_set_attribute(dev, "failfast", 0);
 			}
 		}
-		pthread_mutex_unlock(&md_dev->device_lock);
-	}
+		md_mutex_unlock(&md_dev->device_lock);
+		md_trace_span(TRACE_FAIL_FANOUT, md_dev->trace_id, start,
+			      IN_SYNC, pending_status, IO_UNKNOWN);
+	}
+	if (!rc)
+		md_event_notify("fail", md_name,
+				(pending_side >> 1) ? "set-B" : "set-A",
+				IN_SYNC, pending_status, IO_UNKNOWN);
 	if (!rc || rc == 512) {
-		pthread_mutex_lock(&md_dev->status_lock);
+		md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
+		if (!rc)
+			md_dev->failovers++;
 		md_dev->degraded |= md_dev->pending_side;
+		md_degraded_update(md_dev);
 		md_dev->pending_side = 0;
 		md_dev->pending_status = UNKNOWN;
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 	}
+	md_publish_md(md_dev);
 	return rc == 512 ? -EBUSY : -EIO;
 }
 
 static int reset_md(struct md_monitor *md_dev)
 {
 	const char *md_name = udev_device_get_sysname(md_dev->device);
-	char cmdline[256];
 	int rc, ret = 0;
 	struct device_monitor *dev;
+	uint64_t start;
 
-	pthread_mutex_lock(&md_dev->status_lock);
+	md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
 	if (!md_dev->pending_side) {
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 		warn("%s: no pending side", md_name);
 		return 0;
 	}
-	pthread_mutex_unlock(&md_dev->status_lock);
-	pthread_mutex_lock(&md_dev->device_lock);
+	md_mutex_unlock(&md_dev->status_lock);
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
 	list_for_each_entry(dev, &md_dev->children, siblings) {
 		if (reset_component(dev) < 0) {
-			pthread_mutex_unlock(&md_dev->device_lock);
+			md_mutex_unlock(&md_dev->device_lock);
 			return 0;
 		}
 	}
-	pthread_mutex_unlock(&md_dev->device_lock);
+	md_mutex_unlock(&md_dev->device_lock);
 	if (!md_name)
 		return -EINVAL;
 
-	sprintf(cmdline, "mdadm --manage /dev/%s --re-add faulty", md_name);
-	dbg("%s: call 'system' '%s'", md_name, cmdline);
-	rc = system(cmdline);
+	start = md_trace_now();
+	rc = md_run_mdadm(md_dev, "--re-add", "faulty");
+	md_trace_span(TRACE_MDADM, md_dev->trace_id, start, FAULTY,
+		      RECOVERY, IO_UNKNOWN);
+	md_trace(TRACE_RESET_MD, md_dev->trace_id, FAULTY, RECOVERY,
+		 IO_UNKNOWN, rc);
 	if (rc) {
 		warn("%s: cannot reset mirror, error %d",
 		     md_name, rc);
@@ -1874,12 +2487,18 @@ static int reset_md(struct md_monitor *md_dev)
 		else
 			ret = -EIO;
 	} else {
-		pthread_mutex_lock(&md_dev->status_lock);
+		md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
+		md_event_notify("reset", md_name,
+				(md_dev->pending_side >> 1) ? "set-B" : "set-A",
+				FAULTY, RECOVERY, IO_UNKNOWN);
+		md_dev->readds++;
 		md_dev->degraded = 0;
+		md_degraded_update(md_dev);
 		md_dev->pending_side = 0;
 		md_dev->pending_status = UNKNOWN;
-		pthread_mutex_unlock(&md_dev->status_lock);
+		md_mutex_unlock(&md_dev->status_lock);
 	}
+	md_publish_md(md_dev);
 	return ret;
 }
 
@@ -1890,9 +2509,11 @@ static void remove_md(struct md_monitor *md_dev)
 	struct list_head remove_list;
 
 	INIT_LIST_HEAD(&remove_list);
-	pthread_mutex_lock(&md_dev->device_lock);
+	if (device)
+		md_status_remove_array(udev_device_get_sysname(device));
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
 	list_splice_init(&md_dev->children, &remove_list);
-	pthread_mutex_unlock(&md_dev->device_lock);
+	md_mutex_unlock(&md_dev->device_lock);
 
 	list_for_each_entry_safe(dev, tmp, &remove_list, siblings) {
 		info("%s: Remove MD component device %s",
@@ -1902,16 +2523,22 @@ static void remove_md(struct md_monitor *md_dev)
 		remove_component(dev);
 	}
 
+	md_mutex_lock(&pending_lock, LOCK_PENDING);
+	if (md_dev->recovery_state == RECOVERY_RUNNING)
+		recovery_running--;
+	md_dev->recovery_state = RECOVERY_IDLE;
+	list_del_init(&md_dev->recovery);
+	md_mutex_unlock(&pending_lock);
+
 	/* Synchronize with other threads */
-	pthread_mutex_lock(&md_dev->status_lock);
+	md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
 	md_dev->device = NULL;
 	info("%s: Stop monitoring", md_dev->dev_name);
 	if (device)
 		udev_device_unref(device);
-	pthread_mutex_unlock(&md_dev->status_lock);
-	pthread_mutex_destroy(&md_dev->status_lock);
-	pthread_mutex_destroy(&md_dev->device_lock);
-	free(md_dev);
+	md_mutex_unlock(&md_dev->status_lock);
+	md_monitor_put(md_dev);
+	md_status_changed();
 }
 
 static int check_md(struct md_monitor *md_dev, mdu_array_info_t *info)
@@ -2008,8 +2635,12 @@ static void unmonitor_md(const char *md_name)
 	struct md_monitor *found_md = NULL;
 
 	found_md = lookup_md(md_name, 1);
-	if (found_md)
+	if (found_md) {
+		/* Wait for queries referencing the array */
+		md_rwlock_wrlock(&cli_query_lock, LOCK_CLI_QUERY);
 		remove_md(found_md);
+		md_rwlock_unlock(&cli_query_lock);
+	}
 }
 
 static void discover_md(struct udev *udev)
@@ -2040,135 +2671,159 @@ static void discover_md(struct udev *udev)
 	udev_enumerate_unref(md_enumerate);
 }
 
-static int display_md_status(struct md_monitor *md_dev, char *buf, int buflen)
+static int display_md_status(struct md_monitor *md_dev, struct cli_buf *reply)
 {
 	struct device_monitor *dev;
-	int slot, max_slot = -1;
-	int len = 0;
+	int slot;
 	char status;
 
-	memset(buf, '.', buflen - 1);
-	pthread_mutex_lock(&md_dev->device_lock);
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
 	list_for_each_entry(dev, &md_dev->children, siblings) {
 		slot = dev->md_slot_saved;
 		if (slot < 0)
 			continue;
-		if (slot >= max_slot)
-			max_slot = slot;
-		if (slot >= buflen)
-			continue;
-		pthread_mutex_lock(&dev->lock);
+		if (cli_buf_fill(reply, slot + 1, '.') < 0) {
+			md_mutex_unlock(&md_dev->device_lock);
+			return -ENOMEM;
+		}
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
 		status = md_rdev_print_state_short(dev->md_status);
-		pthread_mutex_unlock(&dev->lock);
-		buf[slot] = status;
-		if (slot + 1> len)
-			len = slot + 1;
+		md_mutex_unlock(&dev->lock);
+		reply->buf[slot] = status;
 	}
-	pthread_mutex_unlock(&md_dev->device_lock);
-	max_slot++;
-	if (md_dev->raid_disks < buflen && md_dev->raid_disks > max_slot)
-		max_slot = md_dev->raid_disks;
-	if (max_slot >= buflen) {
-		warn("%s: CLI buffer too small, min %d\n",
-		     md_dev->dev_name, max_slot);
-		max_slot = buflen - 1;
+	md_mutex_unlock(&md_dev->device_lock);
+	if (cli_buf_fill(reply, md_dev->raid_disks, '.') < 0)
+		return -ENOMEM;
+	info("%s: md status %s", md_dev->dev_name, reply->buf);
+	return 0;
+}
+
+/*
+ * Wait for the first probe result of 'dev'.
+ * Gives up if the checker is stalled.
+ * Called with dev->lock held.
+ */
+static void device_wait_io(struct device_monitor *dev)
+{
+	struct timespec tmo;
+
+	while (dev->ioctx && dev->io_status == IO_UNKNOWN &&
+	       !md_heartbeat_stalled(&dev->hb)) {
+		md_cond_deadline(&tmo, 1000);
+		md_cond_timedwait(&dev->io_cond, &dev->lock, &tmo);
 	}
-	buf[max_slot] = '\0';
-	info("%s: md status %s", md_dev->dev_name, buf);
-	return max_slot;
 }
 
-static int display_io_status(struct md_monitor *md_dev, char *buf, int buflen)
+static int display_io_status(struct md_monitor *md_dev, struct cli_buf *reply)
 {
 	struct device_monitor *dev;
-	int slot, max_slot = -1;
-	int len = 0;
+	int slot;
 	char status;
 
-	memset(buf, '.', buflen - 1);
-
-	pthread_mutex_lock(&md_dev->device_lock);
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
 	list_for_each_entry(dev, &md_dev->children, siblings) {
 		slot = dev->md_slot_saved;
 		if (slot < 0)
 			continue;
-		if (slot >= max_slot)
-			max_slot = slot;
-		if (slot >= buflen)
-			continue;
-		pthread_mutex_lock(&dev->lock);
-		while (dev->ioctx && dev->io_status == IO_UNKNOWN)
-			pthread_cond_wait(&dev->io_cond, &dev->lock);
-
+		if (cli_buf_fill(reply, slot + 1, '.') < 0) {
+			md_mutex_unlock(&md_dev->device_lock);
+			return -ENOMEM;
+		}
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
+		device_wait_io(dev);
 		status = device_io_print_state_short(dev->io_status);
-		pthread_mutex_unlock(&dev->lock);
+		md_mutex_unlock(&dev->lock);
 
-		buf[slot] = status;
-		if (slot + 1> len)
-			len = slot + 1;
+		reply->buf[slot] = status;
 	}
-	pthread_mutex_unlock(&md_dev->device_lock);
+	md_mutex_unlock(&md_dev->device_lock);
 
-	max_slot++;
-	if (md_dev->raid_disks < buflen && md_dev->raid_disks > max_slot)
-		max_slot = md_dev->raid_disks;
-	if (max_slot >= buflen) {
-		warn("%s: CLI buffer too small, min %d",
-		     md_dev->dev_name, max_slot);
-		max_slot = buflen - 1;
-	}
-	buf[max_slot] = '\0';
+	if (cli_buf_fill(reply, md_dev->raid_disks, '.') < 0)
+		return -ENOMEM;
+	info("%s: io status %s", md_dev->dev_name, reply->buf);
+	return 0;
+}
+
+static int display_probe_status(struct md_monitor *md_dev,
+				struct cli_buf *reply)
+{
+	struct device_monitor *dev;
+	struct probe_stat *stat;
+	int ioclass, rc = 0;
 
-	info("%s: io status %s", md_dev->dev_name, buf);
-	return max_slot;
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
+	list_for_each_entry(dev, &md_dev->children, siblings) {
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
+		rc = cli_printf(reply, "%s%s: latency %lu usec inflight %lu "
+				"svctm %lu usec qdelay %lu usec "
+				"timeout %lu msecs skipped %lu ioprio %s",
+				reply->len ? "\n" : "", dev->dev_name,
+				dev->aio_latency, dev->submit_inflight,
+				dev->svctm, dev->qdelay, dev->aio_timeout,
+				dev->probes_skipped,
+				dasd_ioprio_name(dev->ioprio));
+		if (rc >= 0 && dev->cpu_probes)
+			rc = cli_printf(reply, " cpu %lu usec/probe",
+					dev->cpu_usecs / dev->cpu_probes);
+		if (rc >= 0 && md_heartbeat_stalled(&dev->hb))
+			rc = cli_printf(reply, " stalled in %s",
+					dev->hb.activity);
+		for (ioclass = 0; ioclass < IOPRIO_NR_CLASSES; ioclass++) {
+			stat = &dev->probe_stat[ioclass];
+			if (!stat->count || rc < 0)
+				continue;
+			rc = cli_printf(reply,
+					" %s probes %lu avg %lu max %lu usec",
+					dasd_ioprio_name(ioclass), stat->count,
+					stat->sum / stat->count, stat->max);
+		}
+		md_mutex_unlock(&dev->lock);
+		if (rc < 0)
+			break;
+	}
+	md_mutex_unlock(&md_dev->device_lock);
+	return rc < 0 ? rc : 0;
 }
 
-static int display_md(struct md_monitor *md_dev, char *buf)
+static int display_md(struct md_monitor *md_dev, struct cli_buf *reply)
 {
 	const char *mdname = udev_device_get_sysname(md_dev->device);
 	struct device_monitor *dev;
 	mdu_array_info_t info;
-	char status[4096];
-	int bufsize = 0, len = 0;
 	int rc;
 
 	rc = check_md(md_dev, &info);
 	if (rc) {
 		return -rc;
 	}
-	pthread_mutex_lock(&md_dev->device_lock);
-	buf[0] = '\0';
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
 	list_for_each_entry(dev, &md_dev->children, siblings) {
 		enum md_rdev_status md_status;
 		int md_slot = -1;
 
 		md_status = md_rdev_check_state(dev, &md_slot);
-		pthread_mutex_lock(&dev->lock);
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
 		md_rdev_update_state(dev, md_status, md_slot);
-		while (dev->ioctx && dev->io_status == IO_UNKNOWN)
-			pthread_cond_wait(&dev->io_cond, &dev->lock);
-
-		pthread_mutex_unlock(&dev->lock);
-		len = sprintf(status, "%s: dev %s slot %d/%d status %s %s\n",
-			      mdname, dev->dev_name,
-			      dev->md_slot, md_dev->raid_disks,
-			      md_rdev_print_state(dev->md_status),
-			      device_io_print_state(dev->io_status));
-		if ((bufsize + len) > CLI_BUFLEN) {
-			warn("%s: CLI buffer too small, min %d",
-			     md_dev->dev_name, bufsize + len);
-			memset(buf, 0, CLI_BUFLEN);
-			len = -ENOMEM;
-			break;
-		}
-		strcat(buf + bufsize, status);
-		bufsize += len;
-	}
-	pthread_mutex_unlock(&md_dev->device_lock);
+		device_wait_io(dev);
+		md_mutex_unlock(&dev->lock);
+		rc = cli_printf(reply, "%s: dev %s slot %d/%d status %s %s%s%s\n",
+				mdname, dev->dev_name,
+				dev->md_slot, md_dev->raid_disks,
+				md_rdev_print_state(dev->md_status),
+				device_io_print_state(dev->io_status),
+				dev->stat_hung ? " (hung)" : "",
+				md_heartbeat_stalled(&dev->hb) ?
+				" (stalled)" : "");
+		if (rc < 0)
+			break;
+	}
+	md_mutex_unlock(&md_dev->device_lock);
+	if (rc < 0)
+		return rc;
 	/* Strip trailing newline */
-	if (bufsize > 0)
-		bufsize--;
-	return bufsize;
+	if (reply->len > 0)
+		reply->buf[--reply->len] = '\0';
+	return 0;
 }
 
 static void reset_devices(struct udev_device *dev)
@@ -2249,10 +2904,10 @@ static void print_device(struct udev_device *device)
 {
 	int prop = 0;
 
-	warn("%-8s %s (%s)",
-	       udev_device_get_action(device),
-	       udev_device_get_devpath(device),
-	       udev_device_get_subsystem(device));
+	info_ratelimited("%-8s %s (%s)",
+			 udev_device_get_action(device),
+			 udev_device_get_devpath(device),
+			 udev_device_get_subsystem(device));
 	if (prop) {
 		struct udev_list_entry *list_entry;
 
@@ -2264,35 +2919,468 @@ static void print_device(struct udev_device *device)
 	}
 }
 
-static void *mdadm_exec_thread (void *ctx)
+/*
+ * Queue a 're-add' request for admission.
+ * The recovery list is sorted by the estimated resync size,
+ * so that small catch-ups are admitted first.
+ */
+static void recovery_queue(struct md_monitor *md_dev)
 {
-	struct mdadm_exec *thr = ctx;
-	struct timespec tmo;
-	struct timeval start_time, end_time, diff;
-	struct list_head active_list;
-	struct md_monitor *md_dev, *tmp;
+	struct md_monitor *tmp;
+	unsigned long size = md_recovery_estimate(md_dev);
+
+	md_mutex_lock(&pending_lock, LOCK_PENDING);
+	if (md_dev->recovery_state != RECOVERY_IDLE) {
+		md_mutex_unlock(&pending_lock);
+		info("%s: recovery already %s", md_dev->dev_name,
+		     md_dev->recovery_state == RECOVERY_QUEUED ?
+		     "queued" : "running");
+		return;
+	}
+	md_dev->recovery_size = size;
+	md_dev->recovery_state = RECOVERY_QUEUED;
+	list_for_each_entry(tmp, &recovery_list, recovery) {
+		if (tmp->recovery_state == RECOVERY_QUEUED &&
+		    tmp->recovery_size > size)
+			break;
+	}
+	list_add_tail(&md_dev->recovery, &tmp->recovery);
+	md_mutex_unlock(&pending_lock);
+	md_publish_md(md_dev);
+	info("%s: recovery queued, estimated size %lu KiB",
+	     md_dev->dev_name, size);
+}
 
-	while (thr->running) {
-		INIT_LIST_HEAD(&active_list);
-		pthread_mutex_lock(&pending_lock);
-		if (list_empty(&pending_list)) {
-			int rc;
+static int md_recovery_done(struct md_monitor *md_dev)
+{
+	struct udev_device *md_device;
+	char value[64];
+	int rc;
+
+	md_device = md_monitor_device(md_dev);
+	if (!md_device)
+		return 1;
+	rc = md_sysfs_get(md_device, "sync_action", value, sizeof(value));
+	if (rc >= 0 && strcmp(value, "idle")) {
+		udev_device_unref(md_device);
+		return 0;
+	}
+	if (rc >= 0)
+		rc = md_sysfs_get(md_device, "degraded", value, sizeof(value));
+	udev_device_unref(md_device);
+	if (rc > 0 && strcmp(value, "0")) {
+		/* md might not have started the recovery yet */
+		if ((unsigned long)(time(NULL) - md_dev->recovery_start) *
+		    1000 < monitor_timeout)
+			return 0;
+		warn("%s: array still degraded, assume recovery failed",
+		     md_dev->dev_name);
+	}
+	return 1;
+}
+
+/*
+ * Admission control for array recovery.
+ * Retire finished recoveries and start queued ones
+ * until 'max_recovery' arrays are recovering.
+ */
+/*
+ * The running recoveries are checked without pending_lock held,
+ * as the failover path takes it, too.
+ */
+static void recovery_check(void)
+{
+	struct md_monitor *md_dev, *tmp, **md_devs = NULL;
+	int i, nr_md = 0, rc;
+
+	md_mutex_lock(&pending_lock, LOCK_PENDING);
+	if (recovery_running > 0)
+		md_devs = calloc(recovery_running, sizeof(*md_devs));
+	list_for_each_entry(md_dev, &recovery_list, recovery) {
+		if (!md_devs || nr_md == recovery_running)
+			break;
+		if (md_dev->recovery_state == RECOVERY_RUNNING)
+			md_devs[nr_md++] = md_monitor_get(md_dev);
+	}
+	md_mutex_unlock(&pending_lock);
+
+	for (i = 0; i < nr_md; i++) {
+		if (md_recovery_done(md_devs[i]))
+			continue;
+		md_monitor_put(md_devs[i]);
+		md_devs[i] = NULL;
+	}
 
-			info("md_exec: no requests, waiting %ld seconds",
-			     failfast_timeout);
-			if (gettimeofday(&start_time, NULL)) {
-				err("md_exec: failed to get time: %m");
-				pthread_mutex_unlock(&pending_lock);
+	md_mutex_lock(&pending_lock, LOCK_PENDING);
+	for (i = 0; i < nr_md; i++) {
+		md_dev = md_devs[i];
+		if (!md_dev)
+			continue;
+		/* Removed or restarted meanwhile */
+		if (md_dev->recovery_state == RECOVERY_RUNNING) {
+			info("%s: recovery finished after %lu secs",
+			     md_dev->dev_name, (unsigned long)
+			     (time(NULL) - md_dev->recovery_start));
+			list_del_init(&md_dev->recovery);
+			md_dev->recovery_state = RECOVERY_IDLE;
+			recovery_running--;
+			md_publish_md(md_dev);
+		}
+		md_monitor_put(md_dev);
+	}
+	free(md_devs);
+	while (!max_recovery || recovery_running < max_recovery) {
+		md_dev = NULL;
+		list_for_each_entry(tmp, &recovery_list, recovery) {
+			if (tmp->recovery_state == RECOVERY_QUEUED) {
+				md_dev = tmp;
 				break;
 			}
-			tmo.tv_sec = start_time.tv_sec + failfast_timeout;
-			tmo.tv_nsec = 0;
-			rc = pthread_cond_timedwait(&pending_cond,
-						    &pending_lock,
-						    &tmo);
-			if (rc < 0) {
-				pthread_mutex_unlock(&pending_lock);
-				if (rc == ETIMEDOUT) {
+		}
+		if (!md_dev)
+			break;
+		md_dev->recovery_state = RECOVERY_RUNNING;
+		md_dev->recovery_start = time(NULL);
+		recovery_running++;
+		md_monitor_get(md_dev);
+		md_mutex_unlock(&pending_lock);
+
+		info("%s: start recovery (%d/%d running)", md_dev->dev_name,
+		     recovery_running, max_recovery);
+		md_alloc_enter();
+		rc = reset_md(md_dev);
+		md_alloc_exit();
+
+		md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
+		if (rc < 0 || md_dev->pending_status != UNKNOWN) {
+			info("%s: recovery not started, error %d",
+			     md_dev->dev_name, rc);
+			md_dev->pending_status = UNKNOWN;
+			md_dev->pending_side = 0;
+			rc = -EAGAIN;
+		}
+		md_mutex_unlock(&md_dev->status_lock);
+
+		md_mutex_lock(&pending_lock, LOCK_PENDING);
+		if (rc < 0 && md_dev->recovery_state == RECOVERY_RUNNING) {
+			list_del_init(&md_dev->recovery);
+			md_dev->recovery_state = RECOVERY_IDLE;
+			recovery_running--;
+		}
+		md_publish_md(md_dev);
+		md_monitor_put(md_dev);
+	}
+	md_mutex_unlock(&pending_lock);
+}
+
+static int display_recovery_status(struct cli_buf *reply)
+{
+	struct md_monitor *md_dev;
+	int rc, queued = 0;
+
+	md_mutex_lock(&pending_lock, LOCK_PENDING);
+	list_for_each_entry(md_dev, &recovery_list, recovery) {
+		if (md_dev->recovery_state == RECOVERY_QUEUED)
+			queued++;
+	}
+	rc = cli_printf(reply, "recovery: %d running (max %d), %d queued",
+			recovery_running, max_recovery, queued);
+	list_for_each_entry(md_dev, &recovery_list, recovery) {
+		if (rc < 0)
+			break;
+		if (md_dev->recovery_state == RECOVERY_RUNNING)
+			rc = cli_printf(reply, "\n%s: running for %lu secs, "
+					"estimated %lu KiB", md_dev->dev_name,
+					(unsigned long)(time(NULL) -
+							md_dev->recovery_start),
+					md_dev->recovery_size);
+		else
+			rc = cli_printf(reply, "\n%s: queued, estimated %lu KiB",
+					md_dev->dev_name,
+					md_dev->recovery_size);
+	}
+	md_mutex_unlock(&pending_lock);
+	return rc < 0 ? rc : 0;
+}
+
+static unsigned long sync_speed_limit_max(void)
+{
+	FILE *fp;
+	unsigned long speed = 200000;
+
+	fp = fopen("/proc/sys/dev/raid/speed_limit_max", "r");
+	if (fp) {
+		if (fscanf(fp, "%lu", &speed) != 1)
+			speed = 200000;
+		fclose(fp);
+	}
+	return speed;
+}
+
+static void sync_speed_reset(struct md_monitor *md_dev,
+			     struct udev_device *md_device)
+{
+	struct device_monitor *dev;
+
+	md_sysfs_set(md_device, "sync_speed_min", "system");
+	md_sysfs_set(md_device, "sync_speed_max", "system");
+	md_dev->sync_speed = 0;
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
+	list_for_each_entry(dev, &md_dev->children, siblings) {
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
+		dev->sync_probe = 0;
+		md_mutex_unlock(&dev->lock);
+	}
+	md_mutex_unlock(&md_dev->device_lock);
+}
+
+/*
+ * Closed-loop resync throttling.
+ * The probe latency of the in_sync devices is taken as a measure
+ * for the latency of the application I/O. The resync speed limit
+ * is halved if the latency exceeds 'sync_latency' and raised
+ * again in small steps once the latency is well below the target.
+ */
+static void sync_speed_update(struct md_monitor *md_dev,
+			      struct udev_device *md_device)
+{
+	struct device_monitor *dev;
+	uint64_t now;
+	unsigned long latency = 0, speed, speed_max;
+	int samples = 0;
+	char value[64];
+
+	if (md_sysfs_get(md_device, "sync_action",
+			 value, sizeof(value)) < 0)
+		return;
+	if (strcmp(value, "recover") && strcmp(value, "resync")) {
+		if (md_dev->sync_speed) {
+			info("%s: resync finished, reset speed limits",
+			     md_dev->dev_name);
+			sync_speed_reset(md_dev, md_device);
+		}
+		return;
+	}
+	now = md_trace_now();
+
+	/* Keep the path checkers on the source side running */
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
+	list_for_each_entry(dev, &md_dev->children, siblings) {
+		int start = 0;
+
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
+		if (dev->md_status != IN_SYNC) {
+			md_mutex_unlock(&dev->lock);
+			continue;
+		}
+		if (!dev->sync_probe) {
+			dev->sync_probe = 1;
+			start = !dev->running;
+		}
+		if (dev->aio_end_time &&
+		    (now - dev->aio_end_time) / 1000000 <=
+		    2 * checker_timeout + 1000) {
+			if (dev->aio_latency > latency)
+				latency = dev->aio_latency;
+			samples++;
+		}
+		md_mutex_unlock(&dev->lock);
+		if (start)
+			monitor_device(dev);
+	}
+	md_mutex_unlock(&md_dev->device_lock);
+
+	speed_max = sync_speed_limit_max();
+	if (!md_dev->sync_speed) {
+		md_dev->sync_speed = speed_max;
+		sprintf(value, "%lu", sync_speed_floor);
+		md_sysfs_set(md_device, "sync_speed_min", value);
+	}
+	if (!samples) {
+		dbg("%s: no probe results, keep resync limit %lu KiB/s",
+		    md_dev->dev_name, md_dev->sync_speed);
+		return;
+	}
+	speed = md_dev->sync_speed;
+	if (latency > sync_latency * 1000) {
+		speed /= 2;
+		if (speed < sync_speed_floor)
+			speed = sync_speed_floor;
+	} else if (latency < sync_latency * 500) {
+		speed += speed_max / 16;
+		if (speed > speed_max)
+			speed = speed_max;
+	}
+	if (speed == md_dev->sync_speed)
+		return;
+	info("%s: probe latency %lu usecs, resync limit %lu -> %lu KiB/s",
+	     md_dev->dev_name, latency, md_dev->sync_speed, speed);
+	md_dev->sync_speed = speed;
+	sprintf(value, "%lu", speed);
+	md_sysfs_set(md_device, "sync_speed_max", value);
+}
+
+/*
+ * The sysfs I/O must not be done with md_lock held,
+ * so only the array list is sampled under the lock.
+ * Each array and its udev device are pinned while
+ * being updated, as the array might be removed
+ * in the meantime.
+ */
+static void sync_speed_check(void)
+{
+	struct md_monitor *md_dev, **md_devs;
+	struct udev_device *md_device;
+	int i, nr_md = 0;
+
+	if (!sync_latency)
+		return;
+
+	md_mutex_lock(&md_lock, LOCK_MD_LIST);
+	list_for_each_entry(md_dev, &md_list, entry)
+		nr_md++;
+	md_devs = nr_md ? calloc(nr_md, sizeof(*md_devs)) : NULL;
+	nr_md = 0;
+	if (md_devs) {
+		list_for_each_entry(md_dev, &md_list, entry) {
+			if (md_dev->device)
+				md_devs[nr_md++] = md_monitor_get(md_dev);
+		}
+	}
+	md_mutex_unlock(&md_lock);
+
+	for (i = 0; i < nr_md; i++) {
+		md_dev = md_devs[i];
+		md_device = md_monitor_device(md_dev);
+		if (md_device) {
+			sync_speed_update(md_dev, md_device);
+			udev_device_unref(md_device);
+		}
+		md_monitor_put(md_dev);
+	}
+	free(md_devs);
+}
+
+static int display_sync_status(struct md_monitor *md_dev,
+			       struct cli_buf *reply)
+{
+	char action[64], value[64], limit[32];
+	unsigned long long done = 0, total = 0;
+	unsigned long speed = 0, eta = 0;
+	int rc;
+
+	if (md_get_attribute(md_dev, "sync_action",
+			     action, sizeof(action)) < 0)
+		return -ENODEV;
+	if (md_get_attribute(md_dev, "sync_completed",
+			     value, sizeof(value)) > 0 &&
+	    sscanf(value, "%llu / %llu", &done, &total) != 2)
+		total = 0;
+	if (!total) {
+		rc = cli_printf(reply, "%s: %s", md_dev->dev_name, action);
+		return rc < 0 ? rc : 0;
+	}
+
+	if (md_get_attribute(md_dev, "sync_speed",
+			     value, sizeof(value)) > 0)
+		speed = strtoul(value, NULL, 10);
+	/* sync_completed is in sectors, sync_speed in KiB/s */
+	if (speed && total > done)
+		eta = ((total - done) / 2) / speed;
+	if (md_dev->sync_speed)
+		sprintf(limit, "%luK/sec", md_dev->sync_speed);
+	else
+		strcpy(limit, "system");
+	rc = cli_printf(reply, "%s: %s %llu/%llu sectors (%llu.%llu%%) "
+			"speed %luK/sec limit %s eta %lu secs",
+			md_dev->dev_name, action, done, total,
+			done * 100 / total, (done * 1000 / total) % 10,
+			speed, limit, eta);
+	if (rc < 0)
+		return rc;
+	info("%s: sync status %s", md_dev->dev_name, reply->buf);
+	return 0;
+}
+
+#define WATCHDOG_INTERVAL 1
+#define WATCHDOG_SLACK 1000	/* msecs */
+#define WATCHDOG_MAX_FAIL 16
+
+/*
+ * Fail the mirror side of devices whose checker has been
+ * flagged by the watchdog, so that the watchdog itself never
+ * blocks on device or array locks. A device whose lock is
+ * busy is retried on the next round.
+ */
+static void watchdog_fail_check(void)
+{
+	struct device_monitor *dev, *fail_devs[WATCHDOG_MAX_FAIL];
+	int i, num = 0;
+
+	lock_device_list();
+	list_for_each_entry(dev, &device_list, entry) {
+		if (num == WATCHDOG_MAX_FAIL)
+			break;
+		if (!__atomic_load_n(&dev->fail_pending, __ATOMIC_RELAXED))
+			continue;
+		if (md_mutex_trylock(&dev->lock, LOCK_DEVICE))
+			continue;
+		dev->ref++;
+		md_mutex_unlock(&dev->lock);
+		fail_devs[num++] = dev;
+	}
+	unlock_device_list();
+
+	for (i = 0; i < num; i++) {
+		dev = fail_devs[i];
+		/* The checker might have resumed meanwhile */
+		if (__atomic_exchange_n(&dev->fail_pending, 0,
+					__ATOMIC_RELAXED) &&
+		    md_heartbeat_stalled(&dev->hb)) {
+			warn("%s: failing mirror side of stalled checker",
+			     dev->dev_name);
+			fail_mirror(dev, FAULTY);
+		}
+		device_monitor_put(dev);
+	}
+}
+
+static void *mdadm_exec_thread (void *ctx)
+{
+	struct mdadm_exec *thr = ctx;
+	struct timespec tmo;
+	uint64_t exec_start;
+	unsigned long exec_usecs;
+	struct list_head active_list;
+	struct md_monitor *md_dev, *tmp;
+
+	md_rusage_start(SUBSYS_EXEC);
+	while (thr->running) {
+		INIT_LIST_HEAD(&active_list);
+		md_heartbeat(&thr->hb, "recovery check", checker_timeout);
+		recovery_check();
+		sync_speed_check();
+		if (watchdog_fail)
+			watchdog_fail_check();
+		md_mutex_lock(&pending_lock, LOCK_PENDING);
+		if (list_empty(&pending_list)) {
+			unsigned long wait_timeout = failfast_timeout;
+			int rc;
+
+			/* Re-check running recoveries more often */
+			if (!list_empty(&recovery_list) || sync_latency)
+				wait_timeout = checker_timeout;
+			dbg("md_exec: no requests, waiting %lu msecs",
+			    wait_timeout);
+			md_cond_deadline(&tmo, wait_timeout);
+			md_rusage_account(0);
+			md_heartbeat(&thr->hb, "wait", wait_timeout);
+			rc = md_cond_timedwait(&pending_cond,
+					       &pending_lock,
+					       &tmo);
+			if (rc < 0) {
+				md_mutex_unlock(&pending_lock);
+				if (rc == ETIMEDOUT) {
 					dbg("md_exec: timeout");
 					continue;
 				} else {
@@ -2303,73 +3391,1969 @@ static void *mdadm_exec_thread (void *ctx)
 			}
 		}
 		list_splice_init(&pending_list, &active_list);
-		pthread_mutex_unlock(&pending_lock);
+		md_mutex_unlock(&pending_lock);
 		if (list_empty(&active_list))
 			continue;
 		list_for_each_entry_safe(md_dev, tmp, &active_list, pending) {
 			int do_fail = 0, rc = 0;
 
-			if (gettimeofday(&start_time, NULL) < 0)
-				start_time.tv_sec = 0;
+			exec_start = md_trace_now();
+			exec_requests++;
+			md_heartbeat(&thr->hb, "mdadm", max_io_timeout);
+			md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
+			list_del_init(&md_dev->pending);
+			MD_PROBE3(exec_start, md_dev->dev_name,
+				  md_dev->pending_status,
+				  md_dev->pending_side);
+			if (md_dev->pending_status != UNKNOWN)
+				md_trace_span(TRACE_QUEUE_WAIT,
+					      md_dev->trace_id,
+					      md_dev->pending_time, IN_SYNC,
+					      md_dev->pending_status,
+					      IO_UNKNOWN);
+			if (md_dev->pending_status == UNKNOWN) {
+				md_mutex_unlock(&md_dev->status_lock);
+				dbg("%s: task already completed",
+				    md_dev->dev_name);
+			} else if (md_dev->pending_status != IN_SYNC) {
+				md_mutex_unlock(&md_dev->status_lock);
+				do_fail = 1;
+				md_alloc_enter();
+				rc = fail_md(md_dev);
+				md_alloc_exit();
+			} else if (max_recovery) {
+				md_mutex_unlock(&md_dev->status_lock);
+				recovery_queue(md_dev);
+				continue;
+			} else {
+				md_mutex_unlock(&md_dev->status_lock);
+				md_alloc_enter();
+				rc = reset_md(md_dev);
+				md_alloc_exit();
+			}
+
+			exec_usecs = (md_trace_now() - exec_start) / 1000;
+			MD_PROBE4(exec_finish, md_dev->dev_name, do_fail, rc,
+				  exec_usecs);
+			md_rusage_account(1);
+			if (rc < 0) {
+				info("%s: mdadm returned %d",
+				     md_dev->dev_name, rc);
+			} else {
+				info("%s: all devices %s after "
+				     "%lu.%06lu secs", md_dev->dev_name,
+				     do_fail ? "failed" : "reset",
+				     exec_usecs / 1000000, exec_usecs % 1000000);
+			}
+		}
+	}
+	md_heartbeat_stop(&thr->hb);
+	md_rusage_stop();
+
+	return ((void *)0);
+}
+
+struct mdadm_exec *start_mdadm_exec(void)
+{
+	struct mdadm_exec *mdx;
+	int rc = 0;
+
+	info("Start mdadm exec thread");
+
+	mdx = malloc(sizeof(struct mdadm_exec));
+	memset(mdx, 0, sizeof(struct mdadm_exec));
+	mdx->running = 1;
+	rc = pthread_create(&mdx->thread, &cli_attr, mdadm_exec_thread, mdx);
+	if (rc) {
+		mdx->thread = 0;
+		mdx->running = 0;
+		err("Failed to start mdadm exec thread: %m");
+		free(mdx);
+		mdx = NULL;
+	}
+
+	return mdx;
+}
+
+/*
+ * Check a heartbeat against its deadline. Returns 1 if the
+ * thread has just stalled, -1 if it has resumed, and 0
+ * otherwise. 'age' is set to the time since the last heartbeat.
+ */
+static int md_heartbeat_check(struct md_heartbeat *hb, unsigned long now,
+			      unsigned long *age, const char **activity)
+{
+	unsigned long stamp, expect;
+	int stalled;
+
+	stamp = __atomic_load_n(&hb->stamp, __ATOMIC_ACQUIRE);
+	expect = __atomic_load_n(&hb->expect, __ATOMIC_RELAXED);
+	*activity = __atomic_load_n(&hb->activity, __ATOMIC_RELAXED);
+	*age = (stamp && now > stamp) ? now - stamp : 0;
+	stalled = stamp && *age > expect * watchdog_factor + WATCHDOG_SLACK;
+	if (stalled == md_heartbeat_stalled(hb))
+		return 0;
+	__atomic_store_n(&hb->stalled, stalled, __ATOMIC_RELAXED);
+	return stalled ? 1 : -1;
+}
+
+/*
+ * Only fail a mirror side for a checker stuck in I/O;
+ * a checker stuck elsewhere is not a sign of a failing path.
+ * "timeout reset" is excluded as it runs with dev->lock held.
+ */
+static int md_heartbeat_in_io(const char *activity)
+{
+	return activity && (!strcmp(activity, "probe") ||
+			    !strcmp(activity, "md state check"));
+}
+
+/*
+ * Flag checker and executor threads which missed their
+ * heartbeat by more than 'watchdog_factor' times the
+ * expected interval.
+ */
+static void *md_watchdog_thread(void *ctx)
+{
+	struct mdadm_exec *mdx = ctx;
+	struct device_monitor *dev;
+	const char *activity;
+	unsigned long now, age;
+	int num, changed;
+
+	while (1) {
+		sleep(WATCHDOG_INTERVAL);
+		/* Do not get cancelled with the device list locked */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		now = md_monotonic_msecs();
+		num = changed = 0;
+		lock_device_list();
+		list_for_each_entry(dev, &device_list, entry) {
+			switch (md_heartbeat_check(&dev->hb, now, &age,
+						   &activity)) {
+			case 1:
+				warn("%s: checker stalled for %lu.%03lu secs "
+				     "in %s", dev->dev_name, age / 1000,
+				     age % 1000, activity);
+				changed++;
+				if (!watchdog_fail ||
+				    !md_heartbeat_in_io(activity))
+					break;
+				/* Leave the locking to the executor */
+				__atomic_store_n(&dev->fail_pending, 1,
+						 __ATOMIC_RELAXED);
+				num++;
+				break;
+			case -1:
+				info("%s: checker resumed after %lu.%03lu secs",
+				     dev->dev_name, age / 1000, age % 1000);
+				__atomic_store_n(&dev->fail_pending, 0,
+						 __ATOMIC_RELAXED);
+				changed++;
+				break;
+			}
+		}
+		unlock_device_list();
+		if (mdx) {
+			switch (md_heartbeat_check(&mdx->hb, now, &age,
+						   &activity)) {
+			case 1:
+				warn("md_exec: stalled for %lu.%03lu secs in %s",
+				     age / 1000, age % 1000, activity);
+				break;
+			case -1:
+				info("md_exec: resumed");
+				break;
+			}
+		}
+		if (num) {
+			md_mutex_lock(&pending_lock, LOCK_PENDING);
+			pthread_cond_signal(&pending_cond);
+			md_mutex_unlock(&pending_lock);
+		}
+		if (changed)
+			md_status_changed();
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	return ((void *)0);
+}
+
+static void start_watchdog(struct mdadm_exec *mdx)
+{
+	int rc;
+
+	if (!watchdog_factor)
+		return;
+	info("Start watchdog thread, factor %d", watchdog_factor);
+	rc = pthread_create(&watchdog_thread, &cli_attr,
+			    md_watchdog_thread, mdx);
+	if (rc) {
+		err("Failed to start watchdog thread: %s", strerror(rc));
+		watchdog_thread = 0;
+	}
+}
+
+static void stop_watchdog(void)
+{
+	if (watchdog_thread) {
+		info("Stop watchdog thread");
+		pthread_cancel(watchdog_thread);
+		pthread_join(watchdog_thread, NULL);
+		watchdog_thread = 0;
+	}
+}
+
+#define SNAPSHOT_HOLDOFF 100	/* msecs */
+#define SNAPSHOT_MAX_AGE 4	/* times monitor_timeout */
+
+/*
+ * Collect the state of all arrays and their devices.
+ * Only the records are built under the locks; the
+ * file is written afterwards.
+ */
+static void md_snapshot_save(void)
+{
+	struct md_monitor *md_dev;
+	struct device_monitor *dev;
+	struct md_snapshot_array arec;
+	struct md_snapshot_dev drec;
+	int ioclass;
+
+	md_snapshot_begin();
+	md_mutex_lock(&md_lock, LOCK_MD_LIST);
+	list_for_each_entry(md_dev, &md_list, entry) {
+		md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
+		if (!md_dev->device) {
+			md_mutex_unlock(&md_dev->status_lock);
+			continue;
+		}
+		memset(&arec, 0, sizeof(arec));
+		snprintf(arec.name, MD_SNAPSHOT_NAMELEN, "%s",
+			 udev_device_get_sysname(md_dev->device));
+		arec.raid_disks = md_dev->raid_disks;
+		arec.layout = md_dev->layout;
+		arec.degraded = md_dev->degraded;
+		arec.pending_side = md_dev->pending_side;
+		arec.pending_status = md_dev->pending_status;
+		arec.failovers = md_dev->failovers;
+		arec.readds = md_dev->readds;
+		arec.degraded_secs = md_dev->degraded_secs;
+		arec.degraded_start = md_dev->degraded_start;
+		md_mutex_unlock(&md_dev->status_lock);
+		md_snapshot_add_array(&arec);
+
+		md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
+		list_for_each_entry(dev, &md_dev->children, siblings) {
+			memset(&drec, 0, sizeof(drec));
+			md_mutex_lock(&dev->lock, LOCK_DEVICE);
+			snprintf(drec.name, MD_SNAPSHOT_NAMELEN, "%.*s",
+				 MD_SNAPSHOT_NAMELEN - 1, dev->dev_name);
+			snprintf(drec.md_name, MD_SNAPSHOT_NAMELEN, "%s",
+				 arec.name);
+			drec.slot = dev->md_slot;
+			drec.side = dev->md_side;
+			drec.md_status = dev->md_status;
+			drec.io_status = dev->io_status;
+			drec.latency = dev->aio_latency;
+			drec.svctm = dev->svctm;
+			for (ioclass = 0; ioclass < IOPRIO_NR_CLASSES; ioclass++) {
+				drec.probe[ioclass].count =
+					dev->probe_stat[ioclass].count;
+				drec.probe[ioclass].sum =
+					dev->probe_stat[ioclass].sum;
+				drec.probe[ioclass].max =
+					dev->probe_stat[ioclass].max;
+			}
+			md_mutex_unlock(&dev->lock);
+			md_snapshot_add_dev(&drec);
+		}
+		md_mutex_unlock(&md_dev->device_lock);
+	}
+	md_mutex_unlock(&md_lock);
+	md_snapshot_write();
+}
+
+/*
+ * Write a snapshot shortly after each status change, so
+ * failovers are recorded, and every 'snapshot_interval'
+ * msecs to keep the latency baselines current.
+ * A final snapshot is written when the thread is stopped.
+ */
+static void *md_snapshot_thread(void *ctx)
+{
+	struct timespec tmo;
+	unsigned long gen, last_gen;
+	int running = 1;
+
+	md_mutex_lock(&status_gen_lock, LOCK_STATUS_GEN);
+	last_gen = status_gen;
+	md_mutex_unlock(&status_gen_lock);
+	while (running) {
+		md_cond_deadline(&tmo, snapshot_interval);
+		md_mutex_lock(&status_gen_lock, LOCK_STATUS_GEN);
+		while (status_gen == last_gen && snapshot_running) {
+			if (md_cond_timedwait(&status_gen_cond,
+					      &status_gen_lock,
+					      &tmo) == ETIMEDOUT)
+				break;
+		}
+		gen = status_gen;
+		running = snapshot_running;
+		md_mutex_unlock(&status_gen_lock);
+		if (gen != last_gen && running) {
+			/* Let a burst of state changes settle */
+			md_msecs_to_timespec(SNAPSHOT_HOLDOFF, &tmo);
+			nanosleep(&tmo, NULL);
+			md_mutex_lock(&status_gen_lock, LOCK_STATUS_GEN);
+			gen = status_gen;
+			md_mutex_unlock(&status_gen_lock);
+		}
+		last_gen = gen;
+		md_snapshot_save();
+	}
+	return ((void *)0);
+}
+
+/*
+ * Restore the state of an array from the snapshot of the
+ * previous instance. The checkers are running already, so
+ * each record is validated against the live MD state and
+ * only applied where no newer information is available:
+ * - devices need to be in the same slot and MD state,
+ * - a mirror side is only degraded if MD agrees,
+ * - a scheduled fail is only resumed if MD failed a
+ *   device on that side.
+ */
+static void md_snapshot_restore_md(struct md_monitor *md_dev)
+{
+	const struct md_snapshot_array *arec;
+	const struct md_snapshot_dev *drec;
+	struct device_monitor *dev;
+	enum md_rdev_status md_status;
+	const char *md_name;
+	char value[64];
+	int md_slot, side, ioclass, restored = 0;
+	int live_sync = 0, live_failed = 0, degraded = 0, pending = 0;
+
+	if (!md_dev->device)
+		return;
+	md_name = udev_device_get_sysname(md_dev->device);
+	arec = md_snapshot_find_array(md_name);
+	if (!arec) {
+		info("%s: not in snapshot", md_name);
+		return;
+	}
+	if (arec->raid_disks != md_dev->raid_disks ||
+	    arec->layout != md_dev->layout) {
+		warn("%s: array layout changed, snapshot ignored", md_name);
+		return;
+	}
+
+	md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
+	list_for_each_entry(dev, &md_dev->children, siblings) {
+		md_slot = -1;
+		md_status = md_rdev_check_state(dev, &md_slot);
+		if (md_status == UNKNOWN)
+			continue;
+		side = 1 << dev->md_side;
+		if (md_status == IN_SYNC)
+			live_sync |= side;
+		else if (md_status == FAULTY || md_status == TIMEOUT ||
+			 md_status == REMOVED)
+			live_failed |= side;
+		drec = md_snapshot_find_dev(dev->dev_name, md_name);
+		md_mutex_lock(&dev->lock, LOCK_DEVICE);
+		md_rdev_update_state(dev, md_status, md_slot);
+		if (!drec || drec->slot != md_slot ||
+		    drec->side != dev->md_side) {
+			md_mutex_unlock(&dev->lock);
+			continue;
+		}
+		/* Latency baselines, unless the checker has newer ones */
+		if (!dev->svctm)
+			dev->svctm = drec->svctm;
+		if (!dev->aio_latency)
+			dev->aio_latency = drec->latency;
+		for (ioclass = 0; ioclass < IOPRIO_NR_CLASSES; ioclass++) {
+			if (dev->probe_stat[ioclass].count)
+				continue;
+			dev->probe_stat[ioclass].count =
+				drec->probe[ioclass].count;
+			dev->probe_stat[ioclass].sum =
+				drec->probe[ioclass].sum;
+			dev->probe_stat[ioclass].max =
+				drec->probe[ioclass].max;
+		}
+		/* Failed devices need to prove themselves by a probe */
+		if (drec->md_status == md_status &&
+		    dev->io_status == IO_UNKNOWN &&
+		    ((drec->io_status == IO_OK && md_status == IN_SYNC) ||
+		     drec->io_status == IO_FAILED ||
+		     drec->io_status == IO_TIMEOUT)) {
+			dev->io_status = drec->io_status;
+			pthread_cond_signal(&dev->io_cond);
+			restored++;
+		}
+		md_publish_dev(dev);
+		md_mutex_unlock(&dev->lock);
+	}
+	md_mutex_unlock(&md_dev->device_lock);
+
+	if (arec->degraded &&
+	    md_get_attribute(md_dev, "degraded", value, sizeof(value)) > 0 &&
+	    strcmp(value, "0"))
+		degraded = arec->degraded & ~live_sync;
+	if (arec->degraded != degraded)
+		info("%s: degraded sides %x not confirmed by MD, using %x",
+		     md_name, arec->degraded, degraded);
+	if (arec->pending_status == FAULTY || arec->pending_status == TIMEOUT)
+		pending = arec->pending_side & live_failed & ~degraded;
+	else if (arec->pending_status != UNKNOWN)
+		info("%s: %s not resumed", md_name,
+		     md_rdev_print_state(arec->pending_status));
+
+	md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
+	md_dev->failovers += arec->failovers;
+	md_dev->readds += arec->readds;
+	md_dev->degraded_secs += arec->degraded_secs;
+	if (degraded && !md_dev->degraded) {
+		md_dev->degraded = degraded;
+		if (arec->degraded_start &&
+		    arec->degraded_start <= (uint64_t)time(NULL))
+			md_dev->degraded_start = arec->degraded_start;
+		md_degraded_update(md_dev);
+	}
+	if (pending && !md_dev->pending_status &&
+	    list_empty(&md_dev->pending)) {
+		info("%s: resume failing side %x", md_name, pending);
+		md_mutex_lock(&pending_lock, LOCK_PENDING);
+		md_dev->pending_status = arec->pending_status;
+		md_dev->pending_side = pending;
+		md_dev->pending_time = md_trace_now();
+		list_add(&md_dev->pending, &pending_list);
+		pthread_cond_signal(&pending_cond);
+		md_mutex_unlock(&pending_lock);
+	}
+	md_mutex_unlock(&md_dev->status_lock);
+	md_publish_md(md_dev);
+	md_status_changed();
+	info("%s: restored from snapshot, degraded %x, %d devices",
+	     md_name, degraded, restored);
+}
+
+static void md_snapshot_restore(void)
+{
+	struct md_monitor *md_dev;
+	unsigned long max_age;
+
+	/* Allow for a full interval without status changes */
+	max_age = SNAPSHOT_MAX_AGE * monitor_timeout + snapshot_interval;
+	if (md_snapshot_load((max_age + 999) / 1000) < 0)
+		return;
+	md_mutex_lock(&md_lock, LOCK_MD_LIST);
+	list_for_each_entry(md_dev, &md_list, entry)
+		md_snapshot_restore_md(md_dev);
+	md_mutex_unlock(&md_lock);
+	md_snapshot_release();
+}
+
+static void start_snapshot(void)
+{
+	int rc;
+
+	if (!snapshot_interval)
+		return;
+	md_snapshot_restore();
+	if (md_snapshot_init() < 0)
+		return;
+	info("Start snapshot thread, interval %lu msecs", snapshot_interval);
+	snapshot_running = 1;
+	rc = pthread_create(&snapshot_thread, &cli_attr,
+			    md_snapshot_thread, NULL);
+	if (rc) {
+		err("Failed to start snapshot thread: %s", strerror(rc));
+		snapshot_running = 0;
+		snapshot_thread = 0;
+		md_snapshot_exit();
+	}
+}
+
+static void stop_snapshot(void)
+{
+	if (!snapshot_thread)
+		return;
+	info("Stop snapshot thread");
+	md_mutex_lock(&status_gen_lock, LOCK_STATUS_GEN);
+	snapshot_running = 0;
+	pthread_cond_broadcast(&status_gen_cond);
+	md_mutex_unlock(&status_gen_lock);
+	pthread_join(snapshot_thread, NULL);
+	snapshot_thread = 0;
+	md_snapshot_exit();
+}
+
+#define POLL_TIMEOUT 10
+#define CLI_WORKERS 4
+#define CLI_MAX_CONN 64
+#define CLI_MAX_WAITERS 16
+#define CLI_WAIT_TIMEOUT 60
+#define CLI_MAX_SUBSCRIBERS 16
+#define CLI_SUB_QUEUE 256
+#define CLI_EVENT_LEN 128
+
+#define CLI_CMD_NOTIFY	0	/* handled inline */
+#define CLI_CMD_QUERY	1	/* handled by worker threads */
+#define CLI_CMD_WAIT	2	/* handled by a dedicated thread */
+#define CLI_CMD_SUBSCRIBE 3	/* keeps the connection open */
+#define CLI_CMD_EVENT	4	/* mdadm event, handled inline */
+
+#define CLI_RECENT 32
+
+struct cli_cmd_stat {
+	const char *name;
+	int type;
+	unsigned long count;
+	unsigned long errors;
+	unsigned long sum;
+	unsigned long max;
+};
+
+static struct cli_cmd_stat cli_cmd_stats[] = {
+	{ "ArrayStatus", CLI_CMD_QUERY },
+	{ "MirrorStatus", CLI_CMD_QUERY },
+	{ "MonitorStatus", CLI_CMD_QUERY },
+	{ "ProbeStatus", CLI_CMD_QUERY },
+	{ "SyncStatus", CLI_CMD_QUERY },
+	{ "RecoveryStatus", CLI_CMD_QUERY },
+	{ "DumpStatus", CLI_CMD_QUERY },
+	{ "DumpTrace", CLI_CMD_QUERY },
+	{ "TraceExport", CLI_CMD_QUERY },
+	{ "LockStatus", CLI_CMD_QUERY },
+	{ "CpuStatus", CLI_CMD_QUERY },
+	{ "AllocStatus", CLI_CMD_QUERY },
+	{ "WaitSync", CLI_CMD_WAIT },
+	{ "WaitState", CLI_CMD_WAIT },
+	{ "Subscribe", CLI_CMD_SUBSCRIBE },
+	{ "Help", CLI_CMD_NOTIFY },
+	{ "CliStatus", CLI_CMD_NOTIFY },
+	{ "ProbePriority", CLI_CMD_NOTIFY },
+	{ "Fail", CLI_CMD_EVENT },
+	{ "FailSpare", CLI_CMD_EVENT },
+	{ "SpareActive", CLI_CMD_EVENT },
+	{ "Remove", CLI_CMD_EVENT },
+	{ "RebuildStarted", CLI_CMD_EVENT },
+	{ "RebuildFinished", CLI_CMD_EVENT },
+	{ "DeviceDisappeared", CLI_CMD_EVENT },
+	{ "NewArray", CLI_CMD_EVENT },
+	{ "Shutdown", CLI_CMD_NOTIFY },
+	{ "Batch", CLI_CMD_NOTIFY },
+	{ "Unknown", CLI_CMD_NOTIFY },
+};
+
+static const char *cli_cmd_type[] = {
+	"notify", "query", "wait", "subscribe", "event"
+};
+#define CLI_NR_CMDS (int)(sizeof(cli_cmd_stats) / sizeof(cli_cmd_stats[0]))
+
+struct cli_request {
+	struct list_head entry;
+	struct cli_monitor *cli;
+	int fd;
+	struct sockaddr_un sun;
+	socklen_t addrlen;
+	struct cli_cmd_stat *stat;
+	struct timeval start;
+	struct cli_buf cmd;
+};
+
+/*
+ * Stream connections waiting for a request.
+ * The sockets are non-blocking; partially received frames
+ * are kept in 'in' and the payload of complete frames in 'cmd'.
+ */
+struct cli_conn {
+	int fd;
+	pid_t pid;
+	struct timeval start;
+	struct cli_buf in;
+	struct cli_buf cmd;
+};
+
+/*
+ * Most recent event for each array and event type, used to
+ * coalesce duplicate events. Only accessed from the CLI
+ * event loop.
+ */
+struct cli_recent {
+	char md[MD_NAMELEN];
+	char cmd[CLI_EVENT_LEN];
+	struct timeval stamp;
+	int status;
+};
+
+/*
+ * Status change subscribers.
+ * Each subscriber has a fixed-size ring of event records;
+ * if the consumer does not keep up the newest records
+ * are dropped, so the producers never block.
+ */
+struct cli_subscriber {
+	struct list_head entry;
+	int fd;
+	pid_t pid;
+	pthread_cond_t cond;
+	char ring[CLI_SUB_QUEUE][CLI_EVENT_LEN];
+	int head;
+	int count;
+	unsigned long sent;
+	unsigned long dropped;
+	unsigned long reported;
+};
+
+LIST_HEAD(cli_queue);
+/* Arrays unlinked by DeviceDisappeared, removed by the workers */
+LIST_HEAD(cli_remove_list);
+pthread_mutex_t cli_queue_lock;
+pthread_cond_t cli_queue_cond;
+pthread_mutex_t cli_stat_lock;
+static pthread_t cli_workers[CLI_WORKERS];
+static int cli_nr_workers;
+static int cli_queued;
+static int cli_busy;
+static int cli_nr_waiters;
+static struct cli_conn cli_conns[CLI_MAX_CONN];
+static int cli_nr_conns;
+LIST_HEAD(cli_subscribers);
+pthread_mutex_t cli_sub_lock;
+static int cli_nr_subscribers;
+static unsigned long cli_sub_sent;
+static unsigned long cli_sub_dropped;
+static struct cli_recent cli_recent[CLI_RECENT];
+static unsigned long cli_coalesced;
+
+static int display_cli_status(struct cli_buf *reply);
+static struct cli_cmd_stat *cli_lookup_cmd(const char *cmd);
+
+/*
+ * Remove an array which has already been unlinked from
+ * md_list, once all queries referencing it have finished.
+ */
+static void cli_remove_md(struct md_monitor *md_dev)
+{
+	md_rwlock_wrlock(&cli_query_lock, LOCK_CLI_QUERY);
+	remove_md(md_dev);
+	md_rwlock_unlock(&cli_query_lock);
+}
+
+/*
+ * Execute a CLI command.
+ * Any reply text is stored in 'reply'; returns 0
+ * on success or an errno value on failure.
+ */
+static int cli_handle_command(struct cli_monitor *cli, char *cmd,
+			      struct cli_buf *reply)
+{
+	struct md_monitor *md_dev = NULL;
+	struct device_monitor *dev = NULL;
+	char *event, *mdstr, *devstr, *devname;
+	int rc, status = 0;
+
+	cli_buf_reset(reply);
+	event = cmd;
+	if (!strncmp(event, "Shutdown", 8)) {
+		kill(monitor_pid, SIGTERM);
+		cli->running = 0;
+		return 0;
+	}
+	if (!strncmp(event, "Help", 4)) {
+		cli_printf(reply, "Possible commands:\n\tShutdown\n"
+			   "\tArrayStatus:/dev/mdX\n"
+			   "\tMirrorStatus:/dev/mdX\n"
+			   "\tMonitorStatus:/dev/mdX\n"
+			   "\tProbeStatus:/dev/mdX\n"
+			   "\tProbePriority:<class>\n"
+			   "\tRecoveryStatus\n"
+			   "\tDumpStatus\n"
+			   "\tDumpTrace\n"
+			   "\tTraceExport[:/dev/mdX]\n"
+			   "\tLockStatus\n"
+			   "\tCpuStatus\n"
+			   "\tAllocStatus\n"
+			   "\tCliStatus\n"
+			   "\tWaitSync:/dev/mdX[,secs]\n"
+			   "\tWaitState:/dev/mdX@/dev/dasdY[,secs]\n"
+			   "\tSubscribe\n"
+			   "\t<cmd>\\n<cmd>...\n"
+			   "\tSyncStatus:/dev/mdX\n"
+			   "\tRemove:/dev/mdX@/dev/dasdY");
+		return 0;
+	}
+	if (!strncmp(event, "ProbePriority:", 14)) {
+		int ioclass = dasd_ioprio_parse(event + 14);
+
+		if (ioclass < 0) {
+			warn("invalid probe priority '%s'", event + 14);
+			return EINVAL;
+		}
+		info("set probe priority to %s", dasd_ioprio_name(ioclass));
+		probe_ioprio = ioclass;
+		return 0;
+	}
+	if (!strncmp(event, "RecoveryStatus", 14)) {
+		rc = display_recovery_status(reply);
+		return rc < 0 ? -rc : 0;
+	}
+	if (!strncmp(event, "DumpStatus", 10)) {
+		rc = md_status_dump(reply);
+		return rc < 0 ? -rc : 0;
+	}
+	if (!strncmp(event, "DumpTrace", 9)) {
+		rc = md_trace_dump(MD_TRACE_FILE);
+		if (rc < 0) {
+			warn("cannot write trace to %s: %s",
+			     MD_TRACE_FILE, strerror(-rc));
+			return -rc;
+		}
+		cli_printf(reply, "%d events written to %s", rc,
+			   MD_TRACE_FILE);
+		return 0;
+	}
+	if (!strncmp(event, "TraceExport", 11)) {
+		const char *md_name = NULL;
+
+		if (event[11] == ':') {
+			md_name = event + 12;
+			if (!strncmp(md_name, "/dev/", 5))
+				md_name += 5;
+		}
+		rc = md_trace_export(reply, md_name);
+		return rc < 0 ? -rc : 0;
+	}
+	if (!strncmp(event, "LockStatus", 10)) {
+		rc = md_mutex_status(reply);
+		return rc < 0 ? -rc : 0;
+	}
+	if (!strncmp(event, "CpuStatus", 9)) {
+		rc = md_rusage_status(reply);
+		return rc < 0 ? -rc : 0;
+	}
+	if (!strncmp(event, "AllocStatus", 11)) {
+		rc = md_alloc_status(reply);
+		return rc < 0 ? -rc : 0;
+	}
+	if (!strncmp(event, "CliStatus", 9)) {
+		rc = display_cli_status(reply);
+		return rc < 0 ? -rc : 0;
+	}
+	mdstr = strchr(cmd, ':');
+	if (!mdstr || strlen(mdstr) < 2) {
+		warn("invalid message '%s'", cmd);
+		return ENOMSG;
+	}
+	*mdstr = '\0';
+	mdstr++;
+	devstr = strchr(mdstr, '@');
+	if (devstr) {
+		if (strlen(devstr) > 1) {
+			*devstr = '\0';
+			devstr++;
+		} else if (strlen(devstr)) {
+			*devstr = '\0';
+			devstr = NULL;
+		}
+	}
+	info("CLI event '%s' md %s device '%s'",
+	     event, mdstr, devstr ? devstr : "<NULL>");
+
+	md_dev = lookup_md_alias(mdstr);
+	if (!md_dev && strcmp(event, "NewArray")) {
+		info("%s: skipping event, array not monitored", mdstr);
+		return ENODEV;
+	}
+	if (!strcmp(event, "RebuildStarted")) {
+		info("%s: Rebuild started", md_dev->dev_name);
+		md_dev->in_recovery = 1;
+		md_publish_md(md_dev);
+		discover_md_components(md_dev);
+		return 0;
+	}
+	if (!strcmp(event, "RebuildFinished")) {
+		info("%s: Rebuild finished", md_dev->dev_name);
+		md_dev->in_recovery = 0;
+		md_publish_md(md_dev);
+		/* Admit the next queued recovery */
+		md_mutex_lock(&pending_lock, LOCK_PENDING);
+		pthread_cond_signal(&pending_cond);
+		md_mutex_unlock(&pending_lock);
+		md_status_changed();
+		return 0;
+	}
+	if (!strcmp(event, "DeviceDisappeared")) {
+		struct md_monitor *tmp;
+
+		/*
+		 * The device might have been
+		 * removed by the time we get here.
+		 * So double-check.
+		 */
+		md_mutex_lock(&md_lock, LOCK_MD_LIST);
+		md_dev = NULL;
+		list_for_each_entry(tmp, &md_list, entry) {
+			const char *tmpname;
+
+			if (!strcmp(tmp->dev_name, mdstr)) {
+				md_dev = tmp;
+				break;
+			}
+			tmpname = udev_device_get_sysname(tmp->device);
+			if (tmpname && !strcmp(tmpname, mdstr)) {
+				md_dev = tmp;
+				break;
+			}
+		}
+		if (md_dev)
+			list_del_init(&md_dev->entry);
+		md_mutex_unlock(&md_lock);
+		if (md_dev) {
+			info("%s: array stopped", md_dev->dev_name);
+			if (!cli_nr_workers) {
+				cli_remove_md(md_dev);
+				return 0;
+			}
+			/* Do not stall the event loop on running queries */
+			md_mutex_lock(&cli_queue_lock, LOCK_CLI);
+			list_add_tail(&md_dev->entry, &cli_remove_list);
+			pthread_cond_signal(&cli_queue_cond);
+			md_mutex_unlock(&cli_queue_lock);
+		} else {
+			info("%s: array already stopped, ignoring",
+			     mdstr);
+		}
+		return 0;
+	}
+	if (!strcmp(event, "NewArray")) {
+		/* No useful information */
+		return 0;
+	}
+	if (!strcmp(event, "ArrayStatus")) {
+		rc = display_md(md_dev, reply);
+		return rc < 0 ? -rc : 0;
+	}
+	if (!strcmp(event, "MirrorStatus")) {
+		info("%s: display mirror status for %d devices",
+		     mdstr, md_dev->raid_disks);
+		rc = display_md_status(md_dev, reply);
+		return rc < 0 ? -rc : 0;
+	}
+	if (!strcmp(event, "MonitorStatus")) {
+		info("%s: display monitor status for %d devices",
+		     mdstr, md_dev->raid_disks);
+		rc = display_io_status(md_dev, reply);
+		return rc < 0 ? -rc : 0;
+	}
+	if (!strcmp(event, "ProbeStatus")) {
+		rc = display_probe_status(md_dev, reply);
+		return rc < 0 ? -rc : 0;
+	}
+	if (!strcmp(event, "SyncStatus")) {
+		rc = display_sync_status(md_dev, reply);
+		return rc < 0 ? -rc : 0;
+	}
+	if (devstr) {
+		devname = strrchr(devstr, '/');
+		if (devname)
+			devname++;
+		else
+			devname = devstr;
+	} else {
+		devname = NULL;
+	}
+	dev = lookup_md_component(md_dev, devname);
+	if (!strcmp(event, "FailSpare") ||
+	    !strcmp(event, "Fail")) {
+		if (dev) {
+			if (fail_md_components(md_dev, dev))
+				cli_coalesced++;
+		} else {
+			info("%s: No device for event '%s'",
+			     mdstr, event);
+			status = ENODEV;
+		}
+	} else if (!strcmp(event, "Remove")) {
+		if (dev) {
+			remove_md_component(md_dev, dev);
+			md_mutex_lock(&md_dev->device_lock, LOCK_MD_DEVICE);
+			list_del_init(&dev->siblings);
+			md_mutex_unlock(&md_dev->device_lock);
+			remove_component(dev);
+		} else {
+			info("%s: No device for event '%s'",
+			     mdstr, event);
+			status = ENODEV;
+		}
+	} else if (!strcmp(event, "SpareActive")) {
+		if (dev)
+			sync_md_component(md_dev, dev);
+		else
+			discover_md_components(md_dev);
+	} else {
+		info("%s: Unhandled event '%s'", mdstr, event);
+		status = EINVAL;
+	}
+	return status;
+}
+
+/*
+ * Handle an mdadm event, skipping it if it is identical to the
+ * previous event of the same type for the same array and arrived
+ * within 'coalesce_msecs'. 'Fail' events for different components
+ * are coalesced by fail_md_components().
+ */
+static int cli_handle_event(struct cli_monitor *cli, char *cmd,
+			    struct cli_buf *reply)
+{
+	struct cli_recent *recent = NULL, *oldest = &cli_recent[0];
+	struct timeval now, diff;
+	const char *mdstr;
+	size_t mdlen, evlen;
+	int i, status;
+
+	mdstr = strchr(cmd, ':');
+	if (!coalesce_msecs || !mdstr || strlen(cmd) >= CLI_EVENT_LEN)
+		return cli_handle_command(cli, cmd, reply);
+	mdstr++;
+	evlen = mdstr - cmd;	/* including the ':' */
+	mdlen = strcspn(mdstr, "@");
+	if (!mdlen || mdlen >= MD_NAMELEN)
+		return cli_handle_command(cli, cmd, reply);
+
+	gettimeofday(&now, NULL);
+	for (i = 0; i < CLI_RECENT; i++) {
+		if (strlen(cli_recent[i].md) == mdlen &&
+		    !strncmp(cli_recent[i].md, mdstr, mdlen) &&
+		    !strncmp(cli_recent[i].cmd, cmd, evlen)) {
+			recent = &cli_recent[i];
+			break;
+		}
+		if (timercmp(&cli_recent[i].stamp, &oldest->stamp, <))
+			oldest = &cli_recent[i];
+	}
+	if (recent && !strcmp(recent->cmd, cmd)) {
+		timersub(&now, &recent->stamp, &diff);
+		if (diff.tv_sec * 1000 + diff.tv_usec / 1000 < coalesce_msecs) {
+			dbg("coalescing CLI event '%s'", cmd);
+			cli_buf_reset(reply);
+			cli_coalesced++;
+			return recent->status;
+		}
+	}
+	if (!recent) {
+		recent = oldest;
+		memcpy(recent->md, mdstr, mdlen);
+		recent->md[mdlen] = '\0';
+	}
+	strcpy(recent->cmd, cmd);
+	/* cli_handle_command() modifies the command string */
+	status = cli_handle_command(cli, cmd, reply);
+	gettimeofday(&recent->stamp, NULL);
+	recent->status = status;
+	return status;
+}
+
+/*
+ * Execute a newline-separated list of commands.
+ * Only commands which are handled inline are accepted;
+ * the reply lists the failed commands and the output
+ * of the successful ones.
+ */
+static int cli_handle_batch(struct cli_monitor *cli, char *cmd,
+			    struct cli_buf *reply)
+{
+	struct cli_buf line_reply = { NULL };
+	struct cli_cmd_stat *stat;
+	char *line, *next;
+	int rc, status = 0, nr_cmds = 0;
+
+	cli_buf_reset(reply);
+	for (line = cmd; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (!strlen(line))
+			continue;
+		nr_cmds++;
+		stat = cli_lookup_cmd(line);
+		if (stat->type == CLI_CMD_EVENT) {
+			rc = cli_handle_event(cli, line, &line_reply);
+		} else if (stat->type == CLI_CMD_NOTIFY &&
+			   strcmp(stat->name, "Batch")) {
+			rc = cli_handle_command(cli, line, &line_reply);
+		} else {
+			warn("command '%s' not allowed in batch", stat->name);
+			rc = EINVAL;
+		}
+		if (rc) {
+			if (!status)
+				status = rc;
+			cli_printf(reply, "%s: %s\n", stat->name, strerror(rc));
+		} else if (line_reply.len) {
+			cli_printf(reply, "%s\n", line_reply.buf);
+		}
+	}
+	cli_buf_free(&line_reply);
+	info("CLI batch with %d commands finished", nr_cmds);
+	return status;
+}
+
+static struct cli_cmd_stat *cli_lookup_cmd(const char *cmd)
+{
+	size_t len = strcspn(cmd, ":");
+	int i;
+
+	for (i = 0; i < CLI_NR_CMDS - 1; i++) {
+		if (strlen(cli_cmd_stats[i].name) == len &&
+		    !strncmp(cmd, cli_cmd_stats[i].name, len))
+			break;
+	}
+	return &cli_cmd_stats[i];
+}
+
+static struct cli_request *cli_request_new(int fd)
+{
+	struct cli_request *req;
+
+	req = malloc(sizeof(struct cli_request));
+	if (!req) {
+		warn("out of memory allocating cli request");
+		return NULL;
+	}
+	memset(req, 0, sizeof(struct cli_request));
+	INIT_LIST_HEAD(&req->entry);
+	req->fd = fd;
+	gettimeofday(&req->start, NULL);
+	return req;
+}
+
+static void cli_request_free(struct cli_request *req)
+{
+	if (req->fd >= 0)
+		close(req->fd);
+	cli_buf_free(&req->cmd);
+	free(req);
+}
+
+/*
+ * Account the command latency, measured from reception to reply.
+ */
+static void cli_request_account(struct cli_request *req, int status)
+{
+	struct cli_cmd_stat *stat = req->stat;
+	struct timeval end_time, diff;
+	unsigned long usecs;
+
+	gettimeofday(&end_time, NULL);
+	timersub(&end_time, &req->start, &diff);
+	usecs = diff.tv_sec * 1000000 + diff.tv_usec;
+	md_mutex_lock(&cli_stat_lock, LOCK_CLI);
+	stat->count++;
+	if (status)
+		stat->errors++;
+	stat->sum += usecs;
+	if (usecs > stat->max)
+		stat->max = usecs;
+	md_mutex_unlock(&cli_stat_lock);
+	dbg("CLI command '%s' finished in %lu usecs", stat->name, usecs);
+}
+
+/*
+ * Send the reply and account the command latency.
+ */
+static void cli_request_done(struct cli_monitor *cli, struct cli_request *req,
+			     struct cli_buf *reply, int status)
+{
+	struct cli_cmd_stat *stat = req->stat;
+
+	if (req->fd >= 0) {
+		if (cli_send_reply(req->fd, reply, status) < 0)
+			warn("failed to send cli reply for '%s'", stat->name);
+	} else {
+		/*
+		 * Legacy datagram protocol:
+		 * an empty reply signals success, a single byte
+		 * is an error code, anything else is the reply text.
+		 */
+		const char *msg = reply->buf;
+		size_t len = reply->len;
+		char errbuf;
+
+		if (!status && len >= CLI_BUFLEN) {
+			warn("CLI reply too large for datagram, %lu bytes",
+			     (unsigned long)len);
+			status = EMSGSIZE;
+		}
+		if (status) {
+			errbuf = status;
+			msg = &errbuf;
+			len = 1;
+		}
+		if (sendto(cli->sock, msg, len, 0,
+			   (struct sockaddr *)&req->sun, req->addrlen) < 0)
+			err("sendmsg failed: %m");
+	}
+	cli_request_account(req, status);
+	md_rusage_account(1);
+}
+
+static void cli_unlock_cleanup(void *ctx)
+{
+	md_mutex_unlock(ctx);
+}
+
+static void cli_query_cleanup(void *ctx)
+{
+	md_rwlock_unlock(&cli_query_lock);
+	cli_request_free(ctx);
+}
+
+static void cli_buf_cleanup(void *ctx)
+{
+	cli_buf_free(ctx);
+}
+
+/*
+ * Worker threads for query commands, which might
+ * block on ioctls or on the path checkers.
+ * They also remove stopped arrays, as the removal
+ * has to wait for the queries to finish.
+ */
+static void *cli_worker_thread(void *ctx)
+{
+	struct cli_monitor *cli = ctx;
+	struct cli_buf reply = { NULL };
+	struct cli_request *req;
+	struct md_monitor *md_dev;
+	int status;
+
+	md_rusage_start(SUBSYS_CLI);
+	pthread_cleanup_push(cli_buf_cleanup, &reply);
+	while (1) {
+		req = NULL;
+		md_dev = NULL;
+		md_mutex_lock(&cli_queue_lock, LOCK_CLI);
+		pthread_cleanup_push(cli_unlock_cleanup, &cli_queue_lock);
+		while (list_empty(&cli_queue) && list_empty(&cli_remove_list))
+			md_cond_wait(&cli_queue_cond, &cli_queue_lock);
+		if (!list_empty(&cli_remove_list)) {
+			md_dev = list_entry(cli_remove_list.next,
+					    struct md_monitor, entry);
+			list_del_init(&md_dev->entry);
+		} else {
+			req = list_entry(cli_queue.next,
+					 struct cli_request, entry);
+			list_del_init(&req->entry);
+			cli_queued--;
+		}
+		cli_busy++;
+		pthread_cleanup_pop(1);
+
+		if (md_dev) {
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			cli_remove_md(md_dev);
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		} else {
+			md_rwlock_rdlock(&cli_query_lock, LOCK_CLI_QUERY);
+			pthread_cleanup_push(cli_query_cleanup, req);
+			status = cli_handle_command(cli, req->cmd.buf, &reply);
+			cli_request_done(cli, req, &reply, status);
+			pthread_cleanup_pop(1);
+		}
+
+		md_mutex_lock(&cli_queue_lock, LOCK_CLI);
+		cli_busy--;
+		md_mutex_unlock(&cli_queue_lock);
+	}
+	pthread_cleanup_pop(1);
+	return ((void *)0);
+}
+
+/*
+ * Wait conditions; return 1 if the condition holds,
+ * 0 if not, or a negative error.
+ */
+static int cli_check_sync(const char *mdstr, struct cli_buf *reply)
+{
+	struct md_monitor *md_dev;
+	char action[64];
+	int i, rc;
+
+	md_dev = lookup_md_alias(mdstr);
+	if (!md_dev)
+		return 0;
+	cli_buf_reset(reply);
+	rc = display_md_status(md_dev, reply);
+	if (rc < 0)
+		return rc;
+	if (!reply->len)
+		return 0;
+	for (i = 0; i < reply->len; i++) {
+		if (reply->buf[i] != 'A')
+			return 0;
+	}
+	if (md_get_attribute(md_dev, "sync_action",
+			     action, sizeof(action)) > 0 &&
+	    strcmp(action, "idle"))
+		return 0;
+	return 1;
+}
+
+static int cli_check_state(const char *mdstr, const char *devname,
+			   struct cli_buf *reply)
+{
+	struct md_monitor *md_dev;
+	struct device_monitor *dev;
+	enum device_io_status io_status;
+	int rc;
+
+	md_dev = lookup_md_alias(mdstr);
+	if (!md_dev)
+		return 0;
+	dev = lookup_md_component(md_dev, devname);
+	if (!dev)
+		return 0;
+	md_mutex_lock(&dev->lock, LOCK_DEVICE);
+	io_status = dev->io_status;
+	md_mutex_unlock(&dev->lock);
+	if (io_status == IO_UNKNOWN)
+		return 0;
+	cli_buf_reset(reply);
+	rc = cli_printf(reply, "%s: %s", dev->dev_name,
+			device_io_print_state(io_status));
+	return rc < 0 ? rc : 1;
+}
+
+/*
+ * Wait commands are executed in a dedicated thread each.
+ * The condition is re-evaluated whenever the status generation
+ * changes, and every 'failfast_timeout' msecs to catch
+ * changes in MD which are not signalled to us.
+ */
+static void *cli_wait_thread(void *ctx)
+{
+	struct cli_request *req = ctx;
+	struct cli_buf reply = { NULL };
+	char *mdstr, *devstr = NULL, *p;
+	struct timespec tmo;
+	unsigned long now, deadline, gen;
+	int rc = 0, timeout = CLI_WAIT_TIMEOUT;
+
+	mdstr = strchr(req->cmd.buf, ':');
+	if (!mdstr || strlen(mdstr) < 2) {
+		warn("invalid message '%s'", req->cmd.buf);
+		rc = -ENOMSG;
+		goto out;
+	}
+	mdstr++;
+	p = strrchr(mdstr, ',');
+	if (p) {
+		*p = '\0';
+		timeout = strtoul(p + 1, NULL, 10);
+		if (timeout < 1) {
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	if (!strcmp(req->stat->name, "WaitState")) {
+		devstr = strchr(mdstr, '@');
+		if (!devstr || strlen(devstr) < 2) {
+			warn("invalid message '%s'", req->cmd.buf);
+			rc = -EINVAL;
+			goto out;
+		}
+		*devstr = '\0';
+		devstr++;
+		p = strrchr(devstr, '/');
+		if (p)
+			devstr = p + 1;
+	}
+	info("CLI event '%s' md %s device '%s' timeout %d secs",
+	     req->stat->name, mdstr, devstr ? devstr : "<NULL>", timeout);
+
+	deadline = md_monotonic_msecs() + timeout * 1000UL;
+	while (1) {
+		md_mutex_lock(&status_gen_lock, LOCK_STATUS_GEN);
+		gen = status_gen;
+		md_mutex_unlock(&status_gen_lock);
+
+		md_rwlock_rdlock(&cli_query_lock, LOCK_CLI_QUERY);
+		if (devstr)
+			rc = cli_check_state(mdstr, devstr, &reply);
+		else
+			rc = cli_check_sync(mdstr, &reply);
+		md_rwlock_unlock(&cli_query_lock);
+		if (rc)
+			break;
+		now = md_monotonic_msecs();
+		if (now >= deadline) {
+			rc = -ETIMEDOUT;
+			break;
+		}
+		md_cond_deadline(&tmo, deadline - now < failfast_timeout ?
+				 deadline - now : failfast_timeout);
+		md_mutex_lock(&status_gen_lock, LOCK_STATUS_GEN);
+		while (status_gen == gen) {
+			if (md_cond_timedwait(&status_gen_cond,
+					      &status_gen_lock,
+					      &tmo) == ETIMEDOUT)
+				break;
+		}
+		md_mutex_unlock(&status_gen_lock);
+	}
+ out:
+	if (rc < 0)
+		cli_buf_reset(&reply);
+	cli_request_done(req->cli, req, &reply, rc < 0 ? -rc : 0);
+	cli_request_free(req);
+	cli_buf_free(&reply);
+	md_mutex_lock(&cli_queue_lock, LOCK_CLI);
+	cli_nr_waiters--;
+	md_mutex_unlock(&cli_queue_lock);
+	return ((void *)0);
+}
+
+/*
+ * Queue a status transition record to all subscribers.
+ * Lock order: cli_sub_lock nests inside all other locks.
+ */
+static void md_event_notify(const char *source, const char *md_name,
+			    const char *dev_name, enum md_rdev_status old_status,
+			    enum md_rdev_status new_status,
+			    enum device_io_status io_status)
+{
+	struct cli_subscriber *sub;
+	struct timeval now;
+	int slot;
+
+	md_mutex_lock(&cli_sub_lock, LOCK_CLI);
+	if (list_empty(&cli_subscribers)) {
+		md_mutex_unlock(&cli_sub_lock);
+		return;
+	}
+	gettimeofday(&now, NULL);
+	list_for_each_entry(sub, &cli_subscribers, entry) {
+		if (sub->count == CLI_SUB_QUEUE) {
+			sub->dropped++;
+			cli_sub_dropped++;
+			continue;
+		}
+		slot = (sub->head + sub->count) % CLI_SUB_QUEUE;
+		snprintf(sub->ring[slot], CLI_EVENT_LEN,
+			 "%lu.%06lu %s %s %s %s %s %c\n",
+			 (unsigned long)now.tv_sec,
+			 (unsigned long)now.tv_usec, source,
+			 md_name ? md_name : "-", dev_name ? dev_name : "-",
+			 md_rdev_print_state(old_status),
+			 md_rdev_print_state(new_status),
+			 device_io_print_state_short(io_status));
+		sub->count++;
+		pthread_cond_signal(&sub->cond);
+	}
+	md_mutex_unlock(&cli_sub_lock);
+}
+
+/* Check whether the subscriber closed the connection */
+static int cli_sub_disconnected(int fd)
+{
+	char c;
+	ssize_t ret;
+
+	ret = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (!ret)
+		return 1;
+	if (ret < 0 && errno != EAGAIN && errno != EINTR)
+		return 1;
+	return 0;
+}
+
+/*
+ * Forward event records to a subscriber, one frame per batch.
+ * Sending might block on a slow consumer, so it is
+ * done without holding cli_sub_lock.
+ */
+static void *cli_subscriber_thread(void *ctx)
+{
+	struct cli_subscriber *sub = ctx;
+	struct cli_buf events = { NULL };
+	struct timeval now;
+	struct timespec tmo;
+	sigset_t set;
+	int rc = 0;
+
+	/* Block SIGPIPE */
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	info("pid %d subscribed to status events", sub->pid);
+	md_mutex_lock(&cli_sub_lock, LOCK_CLI);
+	while (!rc) {
+		if (!sub->count && sub->dropped == sub->reported) {
+			gettimeofday(&now, NULL);
+			tmo.tv_sec = now.tv_sec + POLL_TIMEOUT;
+			tmo.tv_nsec = now.tv_usec * 1000;
+			rc = md_cond_timedwait(&sub->cond, &cli_sub_lock,
+					       &tmo);
+			if (rc == ETIMEDOUT) {
+				md_mutex_unlock(&cli_sub_lock);
+				rc = cli_sub_disconnected(sub->fd);
+				md_mutex_lock(&cli_sub_lock, LOCK_CLI);
+			} else
+				rc = 0;
+			continue;
+		}
+		cli_buf_reset(&events);
+		if (sub->dropped != sub->reported) {
+			gettimeofday(&now, NULL);
+			cli_printf(&events, "%lu.%06lu dropped %lu events\n",
+				   (unsigned long)now.tv_sec,
+				   (unsigned long)now.tv_usec,
+				   sub->dropped - sub->reported);
+			sub->reported = sub->dropped;
+		}
+		while (sub->count) {
+			cli_printf(&events, "%s", sub->ring[sub->head]);
+			sub->head = (sub->head + 1) % CLI_SUB_QUEUE;
+			sub->count--;
+			sub->sent++;
+			cli_sub_sent++;
+		}
+		md_mutex_unlock(&cli_sub_lock);
+		if (cli_send_frame(sub->fd, events.buf, events.len,
+				   CLI_FRAME_MORE, 0) < 0)
+			rc = 1;
+		md_mutex_lock(&cli_sub_lock, LOCK_CLI);
+	}
+	list_del_init(&sub->entry);
+	cli_nr_subscribers--;
+	md_mutex_unlock(&cli_sub_lock);
+	info("pid %d unsubscribed, %lu events sent, %lu dropped",
+	     sub->pid, sub->sent, sub->dropped);
+	close(sub->fd);
+	pthread_cond_destroy(&sub->cond);
+	free(sub);
+	cli_buf_free(&events);
+	return ((void *)0);
+}
+
+/*
+ * Convert a stream connection into a subscriber.
+ * Returns 0 on success or an errno value.
+ */
+static int cli_subscribe(struct cli_request *req, pid_t pid)
+{
+	struct cli_subscriber *sub;
+	struct timeval tmo;
+	pthread_t thread;
+
+	if (req->fd < 0) {
+		warn("Subscribe is not supported on the datagram socket");
+		return EOPNOTSUPP;
+	}
+	sub = malloc(sizeof(struct cli_subscriber));
+	if (!sub) {
+		warn("out of memory allocating cli subscriber");
+		return ENOMEM;
+	}
+	memset(sub, 0, sizeof(struct cli_subscriber));
+	INIT_LIST_HEAD(&sub->entry);
+	pthread_cond_init(&sub->cond, NULL);
+	sub->fd = req->fd;
+	sub->pid = pid;
+	/* Do not wait forever for consumers which stopped reading */
+	tmo.tv_sec = POLL_TIMEOUT;
+	tmo.tv_usec = 0;
+	if (setsockopt(sub->fd, SOL_SOCKET, SO_SNDTIMEO,
+		       &tmo, sizeof(tmo)) < 0)
+		warn("cannot set cli send timeout: %m");
+
+	md_mutex_lock(&cli_sub_lock, LOCK_CLI);
+	if (cli_nr_subscribers >= CLI_MAX_SUBSCRIBERS) {
+		md_mutex_unlock(&cli_sub_lock);
+		warn("too many CLI subscribers");
+		pthread_cond_destroy(&sub->cond);
+		free(sub);
+		return EBUSY;
+	}
+	list_add_tail(&sub->entry, &cli_subscribers);
+	cli_nr_subscribers++;
+	md_mutex_unlock(&cli_sub_lock);
+	if (pthread_create(&thread, &monitor_attr,
+			   cli_subscriber_thread, sub)) {
+		warn("failed to start cli subscriber thread: %m");
+		md_mutex_lock(&cli_sub_lock, LOCK_CLI);
+		list_del_init(&sub->entry);
+		cli_nr_subscribers--;
+		md_mutex_unlock(&cli_sub_lock);
+		pthread_cond_destroy(&sub->cond);
+		free(sub);
+		return EAGAIN;
+	}
+	/* The connection is owned by the subscriber thread now */
+	req->fd = -1;
+	return 0;
+}
+
+/*
+ * State-changing notifications are handled inline so that
+ * they are never queued behind slow queries.
+ */
+static void cli_dispatch(struct cli_monitor *cli, struct cli_request *req,
+			 struct cli_buf *reply, pid_t pid)
+{
+	int status;
+
+	if (strchr(req->cmd.buf, '\n')) {
+		req->stat = cli_lookup_cmd("Batch");
+		req->cli = cli;
+		status = cli_handle_batch(cli, req->cmd.buf, reply);
+		cli_request_done(cli, req, reply, status);
+		cli_request_free(req);
+		return;
+	}
+	req->stat = cli_lookup_cmd(req->cmd.buf);
+	req->cli = cli;
+	if (req->stat->type == CLI_CMD_SUBSCRIBE) {
+		status = cli_subscribe(req, pid);
+		if (status)
+			goto fail;
+		cli_request_account(req, 0);
+		cli_request_free(req);
+		return;
+	}
+	if (req->stat->type == CLI_CMD_WAIT) {
+		pthread_t thread;
+
+		md_mutex_lock(&cli_queue_lock, LOCK_CLI);
+		if (cli_nr_waiters >= CLI_MAX_WAITERS) {
+			md_mutex_unlock(&cli_queue_lock);
+			warn("too many waiting CLI requests");
+			status = EBUSY;
+			goto fail;
+		}
+		cli_nr_waiters++;
+		md_mutex_unlock(&cli_queue_lock);
+		if (pthread_create(&thread, &monitor_attr,
+				   cli_wait_thread, req)) {
+			warn("failed to start cli wait thread: %m");
+			md_mutex_lock(&cli_queue_lock, LOCK_CLI);
+			cli_nr_waiters--;
+			md_mutex_unlock(&cli_queue_lock);
+			status = EAGAIN;
+			goto fail;
+		}
+		return;
+	}
+	if (req->stat->type == CLI_CMD_EVENT) {
+		status = cli_handle_event(cli, req->cmd.buf, reply);
+		cli_request_done(cli, req, reply, status);
+		cli_request_free(req);
+		return;
+	}
+	if (req->stat->type == CLI_CMD_NOTIFY || !cli_nr_workers) {
+		status = cli_handle_command(cli, req->cmd.buf, reply);
+		cli_request_done(cli, req, reply, status);
+		cli_request_free(req);
+		return;
+	}
+	md_mutex_lock(&cli_queue_lock, LOCK_CLI);
+	list_add_tail(&req->entry, &cli_queue);
+	cli_queued++;
+	pthread_cond_signal(&cli_queue_cond);
+	md_mutex_unlock(&cli_queue_lock);
+	return;
+ fail:
+	cli_buf_reset(reply);
+	cli_request_done(cli, req, reply, status);
+	cli_request_free(req);
+}
+
+static void cli_handle_dgram(struct cli_monitor *cli, struct cli_buf *reply)
+{
+	struct cli_request *req;
+	struct msghdr smsg;
+	struct iovec iov;
+	char cred_msg[CMSG_SPACE(sizeof(struct ucred))];
+	struct cmsghdr *cmsg;
+	struct ucred *cred;
+	static char buf[CLI_BUFLEN];
+	struct sockaddr_un sun;
+	socklen_t addrlen;
+	ssize_t buflen;
+
+	memset(buf, 0x00, sizeof(buf));
+	iov.iov_base = buf;
+	iov.iov_len = CLI_BUFLEN - 1;
+	memset(&sun, 0x00, sizeof(struct sockaddr_un));
+	addrlen = sizeof(struct sockaddr_un);
+	memset(&smsg, 0x00, sizeof(struct msghdr));
+	smsg.msg_name = &sun;
+	smsg.msg_namelen = addrlen;
+	smsg.msg_iov = &iov;
+	smsg.msg_iovlen = 1;
+	smsg.msg_control = cred_msg;
+	smsg.msg_controllen = sizeof(cred_msg);
+
+	buflen = recvmsg(cli->sock, &smsg, 0);
+
+	if (buflen < 0) {
+		if (errno != EINTR)
+			err("error receiving cli message: %m");
+		return;
+	}
+	cmsg = CMSG_FIRSTHDR(&smsg);
+	if (cmsg == NULL) {
+		warn("no cli credentials, ignore message");
+		return;
+	}
+	if (cmsg->cmsg_type != SCM_CREDENTIALS) {
+		warn("invalid cli credentials %d/%d, ignore message",
+		     cmsg->cmsg_type, cmsg->cmsg_level);
+		return;
+	}
+	cred = (struct ucred *)CMSG_DATA(cmsg);
+	if (cred->uid != 0) {
+		warn("sender uid=%d, ignore message", cred->uid);
+		return;
+	}
+	info("received %d/%d bytes from %s", buflen, sizeof(buf),
+	     &sun.sun_path[1]);
+
+	req = cli_request_new(-1);
+	if (!req)
+		return;
+	memcpy(&req->sun, &sun, sizeof(sun));
+	req->addrlen = smsg.msg_namelen;
+	if (cli_printf(&req->cmd, "%s", buf) < 0) {
+		cli_request_free(req);
+		return;
+	}
+	cli_dispatch(cli, req, reply, cred->pid);
+}
+
+static void cli_accept(struct cli_monitor *cli)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int fd;
+
+	fd = accept4(cli->stream_sock, NULL, NULL,
+		     SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			warn("cannot accept cli connection: %m");
+		return;
+	}
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		warn("no cli credentials, ignore connection: %m");
+		close(fd);
+		return;
+	}
+	if (cred.uid != 0) {
+		warn("sender uid=%d, ignore connection", cred.uid);
+		close(fd);
+		return;
+	}
+	memset(&cli_conns[cli_nr_conns], 0, sizeof(struct cli_conn));
+	cli_conns[cli_nr_conns].fd = fd;
+	cli_conns[cli_nr_conns].pid = cred.pid;
+	gettimeofday(&cli_conns[cli_nr_conns].start, NULL);
+	cli_nr_conns++;
+}
+
+static void cli_conn_remove(int idx, int do_close)
+{
+	if (do_close)
+		close(cli_conns[idx].fd);
+	cli_buf_free(&cli_conns[idx].in);
+	cli_buf_free(&cli_conns[idx].cmd);
+	cli_nr_conns--;
+	cli_conns[idx] = cli_conns[cli_nr_conns];
+}
+
+/*
+ * Stream protocol:
+ * one request per connection, the reply is sent
+ * as a sequence of length-prefixed frames.
+ * Only the data which is available is read here; the
+ * request is dispatched once it has been received completely,
+ * and stalled connections are dropped by cli_expire_conns().
+ * Oversized requests are rejected with EMSGSIZE.
+ */
+static void cli_handle_stream(struct cli_monitor *cli, int idx,
+			      struct cli_buf *reply)
+{
+	struct cli_conn *conn = &cli_conns[idx];
+	struct cli_request *req;
+	pid_t pid;
+	int rc, flags;
+
+	rc = cli_recv_frames(conn->fd, &conn->in, &conn->cmd);
+	if (rc == 0)
+		return;
+	if (rc == -EMSGSIZE) {
+		cli_buf_reset(&conn->cmd);
+		cli_send_reply(conn->fd, &conn->cmd, EMSGSIZE);
+	}
+	if (rc < 0 || !conn->cmd.len) {
+		warn("failed to receive cli message from pid %d: %s",
+		     conn->pid, strerror(rc < 0 ? -rc : ENOMSG));
+		cli_conn_remove(idx, 1);
+		return;
+	}
+	/* The reply is written synchronously by the workers */
+	flags = fcntl(conn->fd, F_GETFL);
+	if (flags < 0 || fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		warn("cannot reset cli connection of pid %d: %m", conn->pid);
+		cli_conn_remove(idx, 1);
+		return;
+	}
+	req = cli_request_new(conn->fd);
+	if (!req) {
+		cli_conn_remove(idx, 1);
+		return;
+	}
+	req->start = conn->start;
+	req->cmd = conn->cmd;
+	memset(&conn->cmd, 0, sizeof(conn->cmd));
+	info("received %lu bytes from pid %d",
+	     (unsigned long)req->cmd.len, conn->pid);
+	pid = conn->pid;
+	cli_conn_remove(idx, 0);
+	cli_dispatch(cli, req, reply, pid);
+}
 
-			pthread_mutex_lock(&md_dev->status_lock);
-			list_del_init(&md_dev->pending);
-			if (md_dev->pending_status == UNKNOWN) {
-				pthread_mutex_unlock(&md_dev->status_lock);
-				dbg("%s: task already completed",
-				    md_dev->dev_name);
-			} else if (md_dev->pending_status != IN_SYNC) {
-				pthread_mutex_unlock(&md_dev->status_lock);
-				do_fail = 1;
-				rc = fail_md(md_dev);
-			} else {
-				pthread_mutex_unlock(&md_dev->status_lock);
-				rc = reset_md(md_dev);
-			}
+/* Drop connections which did not send a request in time */
+static void cli_expire_conns(void)
+{
+	struct timeval now, diff;
+	int i;
 
-			if (rc < 0) {
-				info("%s: mdadm returned %d",
-				     md_dev->dev_name, rc);
-			} else {
-				if (start_time.tv_sec &&
-				    gettimeofday(&end_time, NULL) == 0) {
-					timersub(&end_time, &start_time, &diff);
-					info("%s: all devices %s after "
-					     "%lu.%06lu secs", md_dev->dev_name,
-					     do_fail ? "failed" : "reset",
-					     diff.tv_sec, diff.tv_usec);
-				} else {
-					info("%s: all devices %s",
-					     md_dev->dev_name,
-					     do_fail ? "failed" : "reset");
-				}
-			}
-		}
+	gettimeofday(&now, NULL);
+	for (i = cli_nr_conns - 1; i >= 0; i--) {
+		timersub(&now, &cli_conns[i].start, &diff);
+		if (diff.tv_sec < POLL_TIMEOUT)
+			continue;
+		warn("timeout waiting for cli message from pid %d",
+		     cli_conns[i].pid);
+		cli_conn_remove(i, 1);
 	}
+}
 
-	return ((void *)0);
+static int display_cli_status(struct cli_buf *reply)
+{
+	struct cli_cmd_stat *stat;
+	int i, rc, queued, busy, waiting, subscribers;
+	unsigned long sent, dropped;
+
+	md_mutex_lock(&cli_queue_lock, LOCK_CLI);
+	queued = cli_queued;
+	busy = cli_busy;
+	waiting = cli_nr_waiters;
+	md_mutex_unlock(&cli_queue_lock);
+	md_mutex_lock(&cli_sub_lock, LOCK_CLI);
+	subscribers = cli_nr_subscribers;
+	sent = cli_sub_sent;
+	dropped = cli_sub_dropped;
+	md_mutex_unlock(&cli_sub_lock);
+	rc = cli_printf(reply, "cli: %d workers, %d busy, %d queued, "
+			"%d waiting", cli_nr_workers, busy, queued, waiting);
+	if (rc >= 0)
+		rc = cli_printf(reply, "\nevents: %d subscribers, "
+				"%lu sent, %lu dropped",
+				subscribers, sent, dropped);
+	if (rc >= 0)
+		rc = cli_printf(reply, "\ncoalesce: %lu msecs, %lu events "
+				"coalesced", coalesce_msecs, cli_coalesced);
+	md_mutex_lock(&cli_stat_lock, LOCK_CLI);
+	for (i = 0; i < CLI_NR_CMDS; i++) {
+		stat = &cli_cmd_stats[i];
+		if (!stat->count || rc < 0)
+			continue;
+		rc = cli_printf(reply, "\n%s: %s count %lu errors %lu "
+				"avg %lu max %lu usec", stat->name,
+				cli_cmd_type[stat->type],
+				stat->count, stat->errors,
+				stat->sum / stat->count, stat->max);
+	}
+	md_mutex_unlock(&cli_stat_lock);
+	return rc < 0 ? rc : 0;
 }
 
-struct mdadm_exec *start_mdadm_exec(void)
+/*
+ * Format the per-array metrics.
+ * Called with md_lock held.
+ */
+static int md_metrics_arrays(struct cli_buf *reply)
 {
-	struct mdadm_exec *mdx;
-	int rc = 0;
+	struct md_monitor *md_dev;
+	const char *md_name;
+	unsigned long secs;
+	int rc;
 
-	info("Start mdadm exec thread");
+	rc = md_metrics_header(reply, "md_monitor_array_failovers_total",
+			       MD_METRICS_COUNTER,
+			       "Mirror sides failed by md_monitor.");
+	list_for_each_entry(md_dev, &md_list, entry) {
+		md_name = udev_device_get_sysname(md_dev->device);
+		if (!md_name || rc < 0)
+			continue;
+		rc = cli_printf(reply, "md_monitor_array_failovers_total"
+				"{array=\"%s\"} %lu\n", md_name,
+				md_dev->failovers);
+	}
+	if (rc >= 0)
+		rc = md_metrics_header(reply, "md_monitor_array_readds_total",
+				       MD_METRICS_COUNTER,
+				       "Mirror sides re-added by md_monitor.");
+	list_for_each_entry(md_dev, &md_list, entry) {
+		md_name = udev_device_get_sysname(md_dev->device);
+		if (!md_name || rc < 0)
+			continue;
+		rc = cli_printf(reply, "md_monitor_array_readds_total"
+				"{array=\"%s\"} %lu\n", md_name,
+				md_dev->readds);
+	}
+	if (rc >= 0)
+		rc = md_metrics_header(reply,
+				       "md_monitor_array_degraded_seconds_total",
+				       MD_METRICS_COUNTER,
+				       "Time the array has been degraded.");
+	list_for_each_entry(md_dev, &md_list, entry) {
+		md_name = udev_device_get_sysname(md_dev->device);
+		if (!md_name || rc < 0)
+			continue;
+		md_mutex_lock(&md_dev->status_lock, LOCK_MD_STATUS);
+		secs = md_dev->degraded_secs;
+		if (md_dev->degraded_start)
+			secs += time(NULL) - md_dev->degraded_start;
+		md_mutex_unlock(&md_dev->status_lock);
+		rc = cli_printf(reply, "md_monitor_array_degraded_seconds_total"
+				"{array=\"%s\"} %lu\n", md_name, secs);
+	}
+	if (rc >= 0)
+		rc = md_metrics_header(reply, "md_monitor_array_degraded",
+				       MD_METRICS_GAUGE,
+				       "Mask of failed mirror sides.");
+	list_for_each_entry(md_dev, &md_list, entry) {
+		md_name = udev_device_get_sysname(md_dev->device);
+		if (!md_name || rc < 0)
+			continue;
+		rc = cli_printf(reply, "md_monitor_array_degraded"
+				"{array=\"%s\"} %d\n", md_name,
+				md_dev->degraded);
+	}
+	return rc;
+}
 
-	mdx = malloc(sizeof(struct mdadm_exec));
-	memset(mdx, 0, sizeof(struct mdadm_exec));
-	mdx->running = 1;
-	rc = pthread_create(&mdx->thread, &cli_attr, mdadm_exec_thread, mdx);
-	if (rc) {
-		mdx->thread = 0;
-		mdx->running = 0;
-		err("Failed to start mdadm exec thread: %m");
-		free(mdx);
-		mdx = NULL;
+/*
+ * Format the CLI command metrics.
+ * Called with cli_stat_lock held.
+ */
+static int md_metrics_cli(struct cli_buf *reply)
+{
+	struct cli_cmd_stat *stat;
+	int i, rc;
+
+	rc = md_metrics_header(reply, "md_monitor_cli_commands_total",
+			       MD_METRICS_COUNTER, "CLI commands received.");
+	for (i = 0; i < CLI_NR_CMDS && rc >= 0; i++) {
+		stat = &cli_cmd_stats[i];
+		rc = cli_printf(reply, "md_monitor_cli_commands_total"
+				"{command=\"%s\",type=\"%s\"} %lu\n",
+				stat->name, cli_cmd_type[stat->type],
+				stat->count);
+	}
+	if (rc >= 0)
+		rc = md_metrics_header(reply, "md_monitor_cli_errors_total",
+				       MD_METRICS_COUNTER,
+				       "CLI commands which failed.");
+	for (i = 0; i < CLI_NR_CMDS && rc >= 0; i++) {
+		stat = &cli_cmd_stats[i];
+		rc = cli_printf(reply, "md_monitor_cli_errors_total"
+				"{command=\"%s\"} %lu\n",
+				stat->name, stat->errors);
+	}
+	if (rc >= 0)
+		rc = md_metrics_header(reply,
+				       "md_monitor_cli_duration_seconds_total",
+				       MD_METRICS_COUNTER,
+				       "Time spent handling CLI commands.");
+	for (i = 0; i < CLI_NR_CMDS && rc >= 0; i++) {
+		stat = &cli_cmd_stats[i];
+		rc = cli_printf(reply, "md_monitor_cli_duration_seconds_total"
+				"{command=\"%s\"} %lu.%06lu\n", stat->name,
+				stat->sum / 1000000, stat->sum % 1000000);
 	}
+	return rc;
+}
 
-	return mdx;
+int md_metrics_collect(struct cli_buf *reply)
+{
+	struct md_monitor *md_dev;
+	struct list_head *pos;
+	unsigned long depth = 0, queued = 0;
+	int rc;
+
+	md_mutex_lock(&pending_lock, LOCK_PENDING);
+	list_for_each(pos, &pending_list)
+		depth++;
+	list_for_each_entry(md_dev, &recovery_list, recovery) {
+		if (md_dev->recovery_state == RECOVERY_QUEUED)
+			queued++;
+	}
+	md_mutex_unlock(&pending_lock);
+
+	rc = md_metrics_print(reply);
+	if (rc >= 0)
+		rc = md_metrics_header(reply, "md_monitor_exec_queue_depth",
+				       MD_METRICS_GAUGE,
+				       "Arrays waiting for the mdadm executor.");
+	if (rc >= 0)
+		rc = cli_printf(reply, "md_monitor_exec_queue_depth %lu\n",
+				depth);
+	if (rc >= 0)
+		rc = md_metrics_header(reply, "md_monitor_exec_requests_total",
+				       MD_METRICS_COUNTER,
+				       "Requests handled by the mdadm executor.");
+	if (rc >= 0)
+		rc = cli_printf(reply, "md_monitor_exec_requests_total %lu\n",
+				exec_requests);
+	if (rc >= 0)
+		rc = md_metrics_header(reply, "md_monitor_recovery_queued",
+				       MD_METRICS_GAUGE,
+				       "Recoveries waiting for admission.");
+	if (rc >= 0)
+		rc = cli_printf(reply, "md_monitor_recovery_queued %lu\n",
+				queued);
+	if (rc >= 0) {
+		md_mutex_lock(&md_lock, LOCK_MD_LIST);
+		rc = md_metrics_arrays(reply);
+		md_mutex_unlock(&md_lock);
+	}
+	if (rc >= 0) {
+		md_mutex_lock(&cli_stat_lock, LOCK_CLI);
+		rc = md_metrics_cli(reply);
+		md_mutex_unlock(&cli_stat_lock);
+	}
+	if (rc >= 0)
+		rc = md_metrics_header(reply,
+				       "md_monitor_cli_events_coalesced_total",
+				       MD_METRICS_COUNTER,
+				       "Duplicate array events skipped.");
+	if (rc >= 0)
+		rc = cli_printf(reply,
+				"md_monitor_cli_events_coalesced_total %lu\n",
+				cli_coalesced);
+	return rc < 0 ? rc : 0;
 }
 
 void cli_monitor_cleanup(void *ctx)
@@ -2380,6 +5364,33 @@ void cli_monitor_cleanup(void *ctx)
 		close(cli->sock);
 		cli->sock = 0;
 	}
+	if (cli->stream_sock >= 0) {
+		close(cli->stream_sock);
+		cli->stream_sock = -1;
+	}
+	while (cli_nr_workers > 0) {
+		cli_nr_workers--;
+		pthread_cancel(cli_workers[cli_nr_workers]);
+		pthread_join(cli_workers[cli_nr_workers], NULL);
+	}
+	while (!list_empty(&cli_queue)) {
+		struct cli_request *req;
+
+		req = list_entry(cli_queue.next, struct cli_request, entry);
+		list_del_init(&req->entry);
+		cli_request_free(req);
+	}
+	cli_queued = 0;
+	while (!list_empty(&cli_remove_list)) {
+		struct md_monitor *md_dev;
+
+		md_dev = list_entry(cli_remove_list.next,
+				    struct md_monitor, entry);
+		list_del_init(&md_dev->entry);
+		cli_remove_md(md_dev);
+	}
+	while (cli_nr_conns > 0)
+		cli_conn_remove(cli_nr_conns - 1, 1);
 	cli->thread = 0;
 	cli->running = 0;
 }
@@ -2387,280 +5398,64 @@ void cli_monitor_cleanup(void *ctx)
 void *cli_monitor_thread(void *ctx)
 {
 	struct cli_monitor *cli = ctx;
-	struct md_monitor *md_dev = NULL;
-	struct device_monitor *dev = NULL;
+	struct cli_buf reply = { NULL };
+	struct pollfd pfd[CLI_MAX_CONN + 2];
+	struct timespec tmo;
 	sigset_t mask;
+	int i;
 
 	cli->running = 1;
+	md_rusage_start(SUBSYS_CLI);
 	pthread_cleanup_push(cli_monitor_cleanup, cli);
+	pthread_cleanup_push(cli_buf_cleanup, &reply);
 	sigemptyset(&mask);
 	if (pthread_sigmask(SIG_BLOCK, NULL, &mask)) {
 		info("failed to get current signal mask, err %d", errno);
 		goto out;
 	}
+	for (i = 0; i < CLI_WORKERS; i++) {
+		if (pthread_create(&cli_workers[i], &cli_attr,
+				   cli_worker_thread, cli)) {
+			warn("failed to start cli worker: %m");
+			break;
+		}
+		cli_nr_workers++;
+	}
 	while (cli->running) {
 		int fdcount;
-		fd_set readfds;
-		struct msghdr smsg;
-		struct iovec iov;
-		char cred_msg[CMSG_SPACE(sizeof(struct ucred))];
-		struct cmsghdr *cmsg;
-		struct ucred *cred;
-		static char buf[CLI_BUFLEN];
-		struct sockaddr_un sun;
-		socklen_t addrlen;
-		ssize_t buflen;
-		char *event, *mdstr, *devstr, *devname;
 
-		FD_ZERO(&readfds);
-		FD_SET(cli->sock, &readfds);
-		fdcount = pselect(cli->sock + 1, &readfds,
-				  NULL, NULL, NULL, &mask);
+		pfd[0].fd = cli->sock;
+		pfd[0].events = POLLIN;
+		/* Stop accepting connections when the table is full */
+		pfd[1].fd = cli_nr_conns < CLI_MAX_CONN ? cli->stream_sock : -1;
+		pfd[1].events = POLLIN;
+		for (i = 0; i < cli_nr_conns; i++) {
+			pfd[i + 2].fd = cli_conns[i].fd;
+			pfd[i + 2].events = POLLIN;
+		}
+		tmo.tv_sec = 1;
+		tmo.tv_nsec = 0;
+		fdcount = ppoll(pfd, cli_nr_conns + 2,
+				cli_nr_conns ? &tmo : NULL, &mask);
 		if (fdcount < 0) {
 			if (errno != EINTR)
 				warn("error receiving message");
 			continue;
 		}
-		memset(buf, 0x00, sizeof(buf));
-		iov.iov_base = buf;
-		iov.iov_len = CLI_BUFLEN;
-		memset(&sun, 0x00, sizeof(struct sockaddr_un));
-		addrlen = sizeof(struct sockaddr_un);
-		memset(&smsg, 0x00, sizeof(struct msghdr));
-		smsg.msg_name = &sun;
-		smsg.msg_namelen = addrlen;
-		smsg.msg_iov = &iov;
-		smsg.msg_iovlen = 1;
-		smsg.msg_control = cred_msg;
-		smsg.msg_controllen = sizeof(cred_msg);
-
-		buflen = recvmsg(cli->sock, &smsg, 0);
-
-		if (buflen < 0) {
-			if (errno != EINTR)
-				err("error receiving cli message: %m");
-			continue;
-		}
-		cmsg = CMSG_FIRSTHDR(&smsg);
-		if (cmsg == NULL) {
-			warn("no cli credentials, ignore message");
-			continue;
-		}
-		if (cmsg->cmsg_type != SCM_CREDENTIALS) {
-			warn("invalid cli credentials %d/%d, ignore message",
-			     cmsg->cmsg_type, cmsg->cmsg_level);
-			continue;
-		}
-		cred = (struct ucred *)CMSG_DATA(cmsg);
-		if (cred->uid != 0) {
-			warn("sender uid=%d, ignore message", cred->uid);
-			continue;
-		}
-		info("received %d/%d bytes from %s", buflen, sizeof(buf),
-		     &sun.sun_path[1]);
-
-		event = buf;
-		if (!strncmp(event, "Shutdown", 8)) {
-			kill(monitor_pid, SIGTERM);
-			cli->running = 0;
-			buf[0] = 0;
-			iov.iov_len = 0;
-			goto send_msg;
-		}
-		if (!strncmp(event, "Help", 4)) {
-			iov.iov_len = sprintf(buf,
-					      "Possible commands:\n\tShutdown\n"
-					      "\tArrayStatus:/dev/mdX\n"
-					      "\tMirrorStatus:/dev/mdX\n"
-					      "\tMonitorStatus:/dev/mdX\n"
-					      "\tRemove:/dev/mdX@/dev/dasdY");
-			goto send_msg;
-		}
-		mdstr = strchr(buf, ':');
-		if (!mdstr || strlen(mdstr) < 2) {
-			warn("invalid message '%s' len %d", buf, buflen);
-			buf[0] = ENOMSG;
-			iov.iov_len = 1;
-			goto send_msg;
-		}
-		*mdstr = '\0';
-		mdstr++;
-		devstr = strchr(mdstr, '@');
-		if (devstr) {
-			if (strlen(devstr) > 1) {
-				*devstr = '\0';
-				devstr++;
-			} else if (strlen(devstr)) {
-				*devstr = '\0';
-				devstr = NULL;
-			}
-		}
-		info("CLI event '%s' md %s device '%s'",
-		     event, mdstr, devstr ? devstr : "<NULL>");
-
-		md_dev = lookup_md_alias(mdstr);
-		if (!md_dev && strcmp(event, "NewArray")) {
-			info("%s: skipping event, array not monitored", mdstr);
-			buf[0] = ENODEV;
-			iov.iov_len = 1;
-			goto send_msg;
-		}
-		if (!strcmp(event, "RebuildStarted")) {
-			info("%s: Rebuild started", md_dev->dev_name);
-			md_dev->in_recovery = 1;
-			discover_md_components(md_dev);
-			buf[0] = 0;
-			iov.iov_len = 0;
-			goto send_msg;
-		}
-		if (!strcmp(event, "RebuildFinished")) {
-			info("%s: Rebuild finished", md_dev->dev_name);
-			md_dev->in_recovery = 0;
-			buf[0] = 0;
-			iov.iov_len = 0;
-			goto send_msg;
-		}
-		if (!strcmp(event, "DeviceDisappeared")) {
-			struct md_monitor *tmp;
-
-			/*
-			 * The device might have been
-			 * removed by the time we get here.
-			 * So double-check.
-			 */
-			pthread_mutex_lock(&md_lock);
-			md_dev = NULL;
-			list_for_each_entry(tmp, &md_list, entry) {
-				const char *tmpname;
-
-				if (!strcmp(tmp->dev_name, mdstr)) {
-					md_dev = tmp;
-					break;
-				}
-				tmpname = udev_device_get_sysname(tmp->device);
-				if (tmpname && !strcmp(tmpname, mdstr)) {
-					md_dev = tmp;
-					break;
-				}
-			}
-			if (md_dev)
-				list_del_init(&md_dev->entry);
-			pthread_mutex_unlock(&md_lock);
-			if (md_dev) {
-				info("%s: array stopped", md_dev->dev_name);
-				remove_md(md_dev);
-			} else {
-				info("%s: array already stopped, ignoring",
-				     mdstr);
-			}
-			buf[0] = 0;
-			iov.iov_len = 0;
-			goto send_msg;
-		}
-		if (!strcmp(event, "NewArray")) {
-			/* No useful information */
-			buf[0] = 0;
-			iov.iov_len = 0;
-			goto send_msg;
-		}
-		if (!strcmp(event, "ArrayStatus")) {
-			buflen = display_md(md_dev, buf);
-			if (buflen < 0) {
-				iov.iov_len = 1;
-				buf[0] = -buflen;
-			} else {
-				iov.iov_len = buflen;
-			}
-			goto send_msg;
-		}
-		if (!strcmp(event, "MirrorStatus")) {
-			info("%s: display mirror status for %d devices, len %d",
-			     mdstr, md_dev->raid_disks, buflen);
-			memset(buf, 0x00, CLI_BUFLEN);
-			event = NULL;
-			mdstr = NULL;
-			devstr = NULL;
-			buflen = display_md_status(md_dev, buf, CLI_BUFLEN);
-			if (buflen < 0) {
-				iov.iov_len = 1;
-				buf[0] = -buflen;
-			} else {
-				iov.iov_len = buflen;
-			}
-			goto send_msg;
-		}
-		if (!strcmp(event, "MonitorStatus")) {
-			info("%s: display monitor status for %d devices, len %d",
-			     mdstr, md_dev->raid_disks, buflen);
-			memset(buf, 0x00, sizeof(buf));
-			event = NULL;
-			mdstr = NULL;
-			devstr = NULL;
-			buflen = display_io_status(md_dev, buf, CLI_BUFLEN);
-			if (buflen < 0) {
-				iov.iov_len = 1;
-				buf[0] = -buflen;
-			} else {
-				iov.iov_len = buflen;
-			}
-			goto send_msg;
-		}
-		if (devstr) {
-			devname = strrchr(devstr, '/');
-			if (devname)
-				devname++;
-			else
-				devname = devstr;
-		} else {
-			devname = NULL;
-		}
-		dev = lookup_md_component(md_dev, devname);
-		if (!strcmp(event, "FailSpare") ||
-		    !strcmp(event, "Fail")) {
-			if (dev) {
-				fail_md_component(md_dev, dev);
-				buf[0] = 0;
-				iov.iov_len = 0;
-			} else {
-				info("%s: No device for event '%s'",
-				     mdstr, event);
-				buf[0] = ENODEV;
-				iov.iov_len = 1;
-			}
-		} else if (!strcmp(event, "Remove")) {
-			if (dev) {
-				remove_md_component(md_dev, dev);
-				pthread_mutex_lock(&md_dev->device_lock);
-				list_del_init(&dev->siblings);
-				pthread_mutex_unlock(&md_dev->device_lock);
-				remove_component(dev);
-				buf[0] = 0;
-				iov.iov_len = 0;
-			} else {
-				info("%s: No device for event '%s'",
-				     mdstr, event);
-				buf[0] = ENODEV;
-				iov.iov_len = 1;
-			}
-		} else if (!strcmp(event, "SpareActive")) {
-			if (dev)
-				sync_md_component(md_dev, dev);
-			else
-				discover_md_components(md_dev);
-			buf[0] = 0;
-			iov.iov_len = 0;
-		} else {
-			info("%s: Unhandled event '%s'", mdstr, event);
-			buf[0] = EINVAL;
-			iov.iov_len = 1;
+		for (i = cli_nr_conns - 1; i >= 0; i--) {
+			if (pfd[i + 2].revents)
+				cli_handle_stream(cli, i, &reply);
 		}
-	send_msg:
-		if (sendmsg(cli->sock, &smsg, 0) < 0)
-			err("sendmsg failed: %m");
+		if (pfd[0].revents & POLLIN)
+			cli_handle_dgram(cli, &reply);
+		if (pfd[1].revents & POLLIN)
+			cli_accept(cli);
+		cli_expire_conns();
 	}
  out:
 	info("shutdown cli monitor");
 	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
 	return ((void *)0);
 }
 
@@ -2676,10 +5471,11 @@ struct cli_monitor *monitor_cli(void)
 
 	cli = malloc(sizeof(struct cli_monitor));
 	memset(cli, 0, sizeof(struct cli_monitor));
+	cli->stream_sock = -1;
 
 	memset(&sun, 0x00, sizeof(struct sockaddr_un));
 	sun.sun_family = AF_LOCAL;
-	strcpy(&sun.sun_path[1], "/org/kernel/md/md_monitor");
+	strcpy(&sun.sun_path[1], CLI_SOCKET_NAME);
 	addrlen = offsetof(struct sockaddr_un, sun_path) +
 		strlen(sun.sun_path + 1) + 1;
 	cli->sock = socket(AF_LOCAL, SOCK_DGRAM, 0);
@@ -2702,10 +5498,28 @@ struct cli_monitor *monitor_cli(void)
 		return NULL;
 	}
 
+	memset(&sun, 0x00, sizeof(struct sockaddr_un));
+	sun.sun_family = AF_LOCAL;
+	strcpy(&sun.sun_path[1], CLI_STREAM_NAME);
+	addrlen = offsetof(struct sockaddr_un, sun_path) +
+		strlen(sun.sun_path + 1) + 1;
+	cli->stream_sock = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (cli->stream_sock < 0) {
+		warn("cannot open cli stream socket: %m");
+	} else if (bind(cli->stream_sock,
+			(struct sockaddr *) &sun, addrlen) < 0 ||
+		   listen(cli->stream_sock, 16) < 0) {
+		warn("cannot listen on cli stream socket: %m");
+		close(cli->stream_sock);
+		cli->stream_sock = -1;
+	}
+
 	rc = pthread_create(&cli->thread, &cli_attr, cli_monitor_thread, cli);
 	if (rc) {
 		cli->thread = 0;
 		close(cli->sock);
+		if (cli->stream_sock >= 0)
+			close(cli->stream_sock);
 		err("Failed to start cli monitor: %m");
 		free(cli);
 		cli = NULL;
@@ -2714,9 +5528,89 @@ struct cli_monitor *monitor_cli(void)
 	return cli;
 }
 
-#define POLL_TIMEOUT 10
+/*
+ * Time to wait for a reply; wait commands
+ * block until their timeout expires.
+ */
+static int cli_reply_timeout(const char *cmd)
+{
+	const char *p;
+	int timeout = CLI_WAIT_TIMEOUT;
+
+	if (!strncmp(cmd, "Subscribe", 9))
+		return -1;
+	if (strncmp(cmd, "Wait", 4))
+		return POLL_TIMEOUT;
+	p = strrchr(cmd, ',');
+	if (p)
+		timeout = strtoul(p + 1, NULL, 10);
+	return timeout + POLL_TIMEOUT;
+}
 
-int cli_command(char *cmd)
+/*
+ * Send a command via the stream protocol.
+ * Returns -1 if the daemon could not be contacted,
+ * otherwise the status of the command.
+ */
+static int cli_command_stream(char *cmd)
+{
+	struct sockaddr_un sun;
+	socklen_t addrlen;
+	struct cli_buf req, reply = { NULL };
+	int cli_sock, rc, flags = 0, status = 0;
+	int timeout = cli_reply_timeout(cmd);
+
+	cli_sock = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (cli_sock < 0)
+		return -1;
+	memset(&sun, 0x00, sizeof(struct sockaddr_un));
+	sun.sun_family = AF_LOCAL;
+	strcpy(&sun.sun_path[1], CLI_STREAM_NAME);
+	addrlen = offsetof(struct sockaddr_un, sun_path) +
+		strlen(sun.sun_path + 1) + 1;
+	if (connect(cli_sock, (struct sockaddr *) &sun, addrlen) < 0) {
+		dbg("connect to cli stream socket failed: %m");
+		close(cli_sock);
+		return -1;
+	}
+	/* Split into frames, batches might exceed CLI_FRAME_MAX */
+	req.buf = cmd;
+	req.len = req.size = strlen(cmd) + 1;
+	if (cli_send_reply(cli_sock, &req, 0) < 0) {
+		err("sending CLI message failed: %m");
+		close(cli_sock);
+		return EIO;
+	}
+	do {
+		rc = cli_recv_frame(cli_sock, &reply, &flags, &status,
+				    timeout < 0 ? -1 : timeout * 1000);
+		if (rc >= 0 && timeout < 0 && reply.len) {
+			/* Subscriptions: print events as they arrive */
+			fputs(reply.buf, stdout);
+			fflush(stdout);
+			cli_buf_reset(&reply);
+		}
+		if (rc >= 0 && reply.len > CLI_REPLY_MAX)
+			rc = -EMSGSIZE;
+	} while (rc >= 0 && (flags & CLI_FRAME_MORE));
+	close(cli_sock);
+
+	if (rc < 0) {
+		if (rc == -ETIMEDOUT)
+			err("timeout receiving CLI reply");
+		else
+			err("receiving CLI reply failed: %s", strerror(-rc));
+		status = -rc;
+	} else if (status) {
+		err("CLI message '%s' failed: %s", cmd, strerror(status));
+	} else if (reply.len) {
+		printf("%s\n", reply.buf);
+	}
+	cli_buf_free(&reply);
+	return status;
+}
+
+static int cli_command_dgram(char *cmd)
 {
 	struct sockaddr_un sun, local;
 	socklen_t addrlen;
@@ -2738,7 +5632,7 @@ int cli_command(char *cmd)
 	}
 	memset(&local, 0x00, sizeof(struct sockaddr_un));
 	local.sun_family = AF_LOCAL;
-	sprintf(&local.sun_path[1], "/org/kernel/md/md_monitor/%d", getpid());
+	sprintf(&local.sun_path[1], CLI_SOCKET_NAME "/%d", getpid());
 	addrlen = offsetof(struct sockaddr_un, sun_path) +
 		strlen(local.sun_path + 1) + 1;
 	if (bind(cli_sock, (struct sockaddr *) &local, addrlen) < 0) {
@@ -2754,7 +5648,7 @@ int cli_command(char *cmd)
 	}
 	memset(&sun, 0x00, sizeof(struct sockaddr_un));
 	sun.sun_family = AF_LOCAL;
-	strcpy(&sun.sun_path[1], "/org/kernel/md/md_monitor");
+	strcpy(&sun.sun_path[1], CLI_SOCKET_NAME);
 	addrlen = offsetof(struct sockaddr_un, sun_path) +
 		strlen(sun.sun_path + 1) + 1;
 	memset(&iov, 0, sizeof(iov));
@@ -2796,7 +5690,10 @@ int cli_command(char *cmd)
 
 		FD_ZERO(&readfds);
 		FD_SET(cli_sock, &readfds);
-		tmo.tv_sec = POLL_TIMEOUT;
+		tmo.tv_sec = cli_reply_timeout(cmd);
+		/* Subscriptions are rejected on the datagram socket */
+		if (tmo.tv_sec < 0)
+			tmo.tv_sec = POLL_TIMEOUT;
 		tmo.tv_usec = 0;
 		fdcount = select(cli_sock + 1, &readfds, NULL, NULL, &tmo);
 		if (fdcount < 0) {
@@ -2845,6 +5742,94 @@ int cli_command(char *cmd)
 	return status;
 }
 
+int cli_command(char *cmd)
+{
+	int status;
+
+	status = cli_command_stream(cmd);
+	if (status >= 0)
+		return status;
+	/* Daemon does not support the stream protocol */
+	dbg("falling back to datagram protocol");
+	return cli_command_dgram(cmd);
+}
+
+/*
+ * Send a batch over the datagram protocol, split into
+ * messages of at most CLI_BUFLEN bytes.
+ */
+static int cli_command_batch_dgram(char *batch)
+{
+	char buf[CLI_BUFLEN], *line, *next;
+	size_t len = 0, linelen;
+	int rc, status = 0;
+
+	for (line = batch; *line; line = next) {
+		next = strchr(line, '\n');
+		*next++ = '\0';
+		linelen = strlen(line);
+		if (len && len + linelen + 2 > CLI_BUFLEN) {
+			rc = cli_command_dgram(buf);
+			if (rc && !status)
+				status = rc;
+			len = 0;
+		}
+		len += snprintf(buf + len, CLI_BUFLEN - len, "%s\n", line);
+	}
+	if (len) {
+		rc = cli_command_dgram(buf);
+		if (rc && !status)
+			status = rc;
+	}
+	return status;
+}
+
+/*
+ * Read commands from stdin, one per line, and send them
+ * as one newline-separated request.
+ */
+int cli_command_batch(void)
+{
+	struct cli_buf batch = { NULL };
+	char line[CLI_BUFLEN];
+	size_t linelen;
+	int rc, status = 0;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		linelen = strcspn(line, "\n");
+		line[linelen] = '\0';
+		if (!linelen)
+			continue;
+		if (linelen + 2 > CLI_BUFLEN) {
+			err("command too long, skipping");
+			status = EMSGSIZE;
+			continue;
+		}
+		if (cli_printf(&batch, "%s\n", line) < 0) {
+			err("cannot allocate batch");
+			cli_buf_free(&batch);
+			return ENOMEM;
+		}
+	}
+	if (batch.len >= CLI_REQUEST_MAX) {
+		err("batch of %lu bytes too large",
+		    (unsigned long)batch.len);
+		rc = EMSGSIZE;
+	} else if (batch.len) {
+		rc = cli_command_stream(batch.buf);
+		if (rc < 0) {
+			/* Daemon does not support the stream protocol */
+			dbg("falling back to datagram protocol");
+			rc = cli_command_batch_dgram(batch.buf);
+		}
+	} else
+		rc = 0;
+	if (rc && !status)
+		status = rc;
+	cli_buf_free(&batch);
+	return status;
+}
+
 void
 setup_thread_attr(pthread_attr_t *attr, size_t stacksize, int detached)
 {
@@ -2924,20 +5909,68 @@ pid_t daemonize(void)
 	return pid;
 }
 
+/*
+ * Parse a timeout given in seconds, or in milliseconds
+ * with an 'ms' suffix, eg '2', '2s' or '250ms'.
+ * Returns the timeout in msecs, or 0 if invalid.
+ */
+static unsigned long md_parse_msecs(const char *arg)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 10);
+	if (errno || end == arg || *arg == '-')
+		return 0;
+	if (!strcmp(end, "ms"))
+		return val;
+	if ((*end && strcmp(end, "s")) || val > ULONG_MAX / 1000)
+		return 0;
+	return val * 1000;
+}
+
+/*
+ * Parse a non-negative integer, rejecting trailing
+ * characters and values above INT_MAX.
+ */
+static int md_parse_int(const char *arg, int *val)
+{
+	long num;
+	char *end;
+
+	errno = 0;
+	num = strtol(arg, &end, 10);
+	if (errno || end == arg || *end || num < 0 || num > INT_MAX)
+		return -EINVAL;
+	*val = num;
+	return 0;
+}
+
 void usage(void)
 {
 	err("Usage: md_monitor [--daemonize|-d] [--logfile=<file>|-f <file>]"
-	    "[--expires=<num>|-e <num>] [--retries=<num>|-r <num>]"
-	    "[--command=<cmd>|-c <cmd>] [--daemonize|-d] "
-	    "[--expires=<num>|-e <num>] [--logfile=<file>|-l <file>] "
+	    "[--expires=<time>|-e <time>] [--retries=<num>|-r <num>]"
+	    "[--command=<cmd>|-c <cmd>] [--batch|-b] [--daemonize|-d] "
+	    "[--expires=<time>|-e <time>] [--logfile=<file>|-l <file>] "
 	    "[--process-limit=<num>|-P <num>] [--open-file-limit=<num>|-O <num>] "
 	    "[--log-priority=<prio>|-p <prio>] [--retries=<num>|-r <num>] "
 	    "[--fail-mirror|-m] [--fail-disk|-o] "
 	    "[--syslog|-s] [--verbose|-v] [--version|-V] "
-	    "[--check-in-sync|y] [--check-timeout=<secs>|-t <secs>] [--help|-h]\n"
+	    "[--check-in-sync|y] [--check-timeout=<time>|-t <time>] "
+	    "[--max-recovery=<num>|-R <num>] "
+	    "[--sync-latency=<msecs>|-L <msecs>] [--passive-check|-a] "
+	    "[--hung-timeout=<time>|-H <time>] "
+	    "[--max-io-timeout=<time>|-T <time>] "
+	    "[--probe-priority=<class>|-i <class>] "
+	    "[--coalesce=<msecs>|-C <msecs>] "
+	    "[--metrics-port=<port>|-M <port>] "
+	    "[--watchdog=<factor>|-w <factor>] [--watchdog-fail|-W] "
+	    "[--mlock|-k] [--snapshot=<time>|-S <time>] [--help|-h]\n"
 	    "  --command=<cmd>                send command <cmd> to daemon\n"
+	    "  --batch                        send commands read from stdin\n"
 	    "  --daemonize                    start monitor in background\n"
-	    "  --expires=<num>                set failfast_expires to <num>\n"
+	    "  --expires=<time>               set failfast_expires to <time>\n"
 	    "  --logfile=<file>               use <file> for logging\n"
 	    "  --process-limit=<num>          max number of processes\n"
 	    "  --open-file-limit=<num>        max number of open files; default is 4096\n"
@@ -2946,11 +5979,33 @@ void usage(void)
 	    "  --fail-mirror                  fail entire mirror side\n"
 	    "  --fail-disk                    fail affected disk only\n"
 	    "  --syslog                       use syslog for logging\n"
-	    "  --check-timeout=<secs>         run path checker every <secs> seconds\n"
+	    "  --check-timeout=<time>         run path checker every <time>\n"
 	    "  --check-in-sync                run path checker for in_sync devices\n"
+	    "  --max-recovery=<num>           recover at most <num> arrays at once\n"
+	    "  --sync-latency=<msecs>         throttle resync to keep probe latency\n"
+	    "                                 below <msecs> milliseconds\n"
+	    "  --passive-check                skip probes on devices completing I/O\n"
+	    "  --hung-timeout=<time>          flag devices with in-flight I/O but\n"
+	    "                                 no completions after <time>\n"
+	    "  --max-io-timeout=<time>        extend the probe timeout for queued\n"
+	    "                                 I/O up to <time>\n"
+	    "  --probe-priority=<class>       I/O priority class for probes,\n"
+	    "                                 'rt', 'be', 'idle', or 'none'\n"
+	    "  --coalesce=<msecs>             skip identical array events within\n"
+	    "                                 <msecs> milliseconds; default 100\n"
+	    "  --metrics-port=<port>          also serve metrics on loopback\n"
+	    "                                 TCP port <port>\n"
+	    "  --watchdog=<factor>            flag checkers which missed their\n"
+	    "                                 heartbeat by <factor> times\n"
+	    "  --watchdog-fail                fail the mirror side of checkers\n"
+	    "                                 stalled in I/O\n"
+	    "  --mlock                        lock the daemon into memory\n"
+	    "  --snapshot=<time>              save the monitor state every <time>\n"
+	    "                                 and restore it on startup\n"
 	    "  --verbose                      increase logging priority\n"
 	    "  --version                      print md_monitor version number\n"
-	    "  --help\n");
+	    "  --help\n"
+	    "<time> is in seconds, or in milliseconds with an 'ms' suffix\n");
 }
 
 int main(int argc, char *argv[])
@@ -2968,26 +6023,40 @@ int main(int argc, char *argv[])
 	unsigned long max_proc, max_files = 4096;
 	struct rlimit cur;
 	char *command_to_send = NULL;
+	int batch_mode = 0;
 	char *logfile = NULL;
 	struct pollfd readfd;
 	int monitor_fd;
 	int rc = 0;
 
 	static const struct option options[] = {
+		{ "passive-check", no_argument, NULL, 'a' },
+		{ "batch", no_argument, NULL, 'b' },
 		{ "command", required_argument, NULL, 'c' },
+		{ "coalesce", required_argument, NULL, 'C' },
 		{ "daemonize", no_argument, NULL, 'd' },
 		{ "expires", required_argument, NULL, 'e' },
 		{ "logfile", required_argument, NULL, 'f' },
 		{ "fail-mirror", no_argument, NULL, 'm' },
+		{ "metrics-port", required_argument, NULL, 'M' },
+		{ "hung-timeout", required_argument, NULL, 'H' },
+		{ "max-io-timeout", required_argument, NULL, 'T' },
+		{ "probe-priority", required_argument, NULL, 'i' },
 		{ "open-file-limit", required_argument, NULL, 'O' },
 		{ "fail-disk", no_argument, NULL, 'o' },
 		{ "process-limit", required_argument, NULL, 'P' },
 		{ "log-priority", required_argument, NULL, 'p' },
+		{ "sync-latency", required_argument, NULL, 'L' },
 		{ "retries", required_argument, NULL, 'r' },
+		{ "max-recovery", required_argument, NULL, 'R' },
 		{ "syslog", no_argument, NULL, 's' },
 		{ "check-timeout", required_argument, NULL, 't' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "check-in-sync", no_argument, NULL, 'y' },
+		{ "watchdog", required_argument, NULL, 'w' },
+		{ "watchdog-fail", no_argument, NULL, 'W' },
+		{ "mlock", no_argument, NULL, 'k' },
+		{ "snapshot", required_argument, NULL, 'S' },
 		{ "help", no_argument, NULL, 'h' },
 		{ "version", no_argument, NULL, 'V' },
 		{}
@@ -3000,22 +6069,36 @@ int main(int argc, char *argv[])
 	logfd = stdout;
 
 	while (1) {
-		option = getopt_long(argc, argv, "c:de:f:mO:o:p:P:r:st:vyhV",
+		option = getopt_long(argc, argv, "abc:C:de:f:H:i:kL:mM:O:o:p:P:r:R:sS:t:T:vw:WyhV",
 				     options, NULL);
 		if (option == -1) {
 			break;
 		}
 
 		switch (option) {
+		case 'a':
+			passive_check = 1;
+			break;
+		case 'b':
+			batch_mode = 1;
+			break;
 		case 'c':
 			command_to_send = optarg;
 			break;
+		case 'C':
+			coalesce_msecs = strtoul(optarg, NULL, 10);
+			if (coalesce_msecs == ULONG_MAX) {
+				err("Invalid coalesce setting '%s'",
+				    optarg);
+				exit(1);
+			}
+			break;
 		case 'd':
 			daemonize_monitor = 1;
 			break;
 		case 'e':
-			failfast_timeout = strtoul(optarg, NULL, 10);
-			if (failfast_timeout < 1) {
+			failfast_timeout = md_parse_msecs(optarg);
+			if (!failfast_timeout) {
 				err("Invalid expires setting '%s'",
 				    optarg);
 				exit(1);
@@ -3024,6 +6107,38 @@ int main(int argc, char *argv[])
 		case 'f':
 			logfile = optarg;
 			break;
+		case 'H':
+			hung_timeout = md_parse_msecs(optarg);
+			if (!hung_timeout) {
+				err("Invalid hung-timeout setting '%s'",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'T':
+			max_io_timeout = md_parse_msecs(optarg);
+			if (!max_io_timeout) {
+				err("Invalid max-io-timeout setting '%s'",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'i':
+			probe_ioprio = dasd_ioprio_parse(optarg);
+			if (probe_ioprio < 0) {
+				err("Invalid probe-priority setting '%s'",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'L':
+			sync_latency = strtoul(optarg, NULL, 10);
+			if (sync_latency == ULONG_MAX) {
+				err("Invalid sync-latency setting '%s'",
+				    optarg);
+				exit(1);
+			}
+			break;
 		case 'P':
 			max_proc = strtoul(optarg, NULL, 10);
 			if (max_proc < 1) {
@@ -3058,6 +6173,27 @@ int main(int argc, char *argv[])
 		case 'm':
 			fail_mirror_side = 1;
 			break;
+		case 'M':
+			metrics_port = strtoul(optarg, NULL, 10);
+			if (metrics_port < 1 || metrics_port > 65535) {
+				err("Invalid metrics-port setting '%s'",
+				    optarg);
+				exit(1);
+			}
+			break;
+		case 'w':
+			watchdog_factor = strtoul(optarg, NULL, 10);
+			if (watchdog_factor < 1) {
+				err("Invalid watchdog factor '%s'", optarg);
+				exit(1);
+			}
+			break;
+		case 'W':
+			watchdog_fail = 1;
+			break;
+		case 'k':
+			mlock_monitor = 1;
+			break;
 		case 'O':
 			max_files = strtoul(optarg, NULL, 10);
 			if (max_files < 1) {
@@ -3085,13 +6221,27 @@ int main(int argc, char *argv[])
 				exit(1);
 			}
 			break;
+		case 'R':
+			if (md_parse_int(optarg, &max_recovery) < 0) {
+				err("Invalid max-recovery setting '%s'",
+				    optarg);
+				exit(1);
+			}
+			break;
 		case 's':
 			use_syslog = 1;
 			break;
+		case 'S':
+			snapshot_interval = md_parse_msecs(optarg);
+			if (!snapshot_interval) {
+				err("Invalid snapshot interval '%s'",
+				    optarg);
+				exit(1);
+			}
+			break;
 		case 't':
-			checker_timeout = strtoul(optarg, NULL, 10);
-			if (checker_timeout < 1 &&
-			    checker_timeout == ULONG_MAX) {
+			checker_timeout = md_parse_msecs(optarg);
+			if (!checker_timeout) {
 				err("Invalid checker timeout '%s'",
 				    optarg);
 				exit(1);
@@ -3122,12 +6272,22 @@ int main(int argc, char *argv[])
 	if (command_to_send) {
 		return cli_command(command_to_send);
 	}
+	if (batch_mode)
+		return cli_command_batch();
 
 	if (daemonize_monitor)
 		daemonize();
 
 	monitor_pid = getpid();
 	monitor_timeout = failfast_timeout * (failfast_retries + 1);
+	/* Flag hung devices well before the failfast timeout fires */
+	if (!hung_timeout) {
+		hung_timeout = checker_timeout * 2;
+		if (hung_timeout >= failfast_timeout)
+			hung_timeout = failfast_timeout / 2;
+	}
+	if (max_io_timeout < monitor_timeout)
+		max_io_timeout = monitor_timeout;
 
 	if (use_syslog) {
 		sprintf(logname, "md_monitor[%d]", monitor_pid);
@@ -3157,7 +6317,17 @@ int main(int argc, char *argv[])
 	pthread_mutex_init(&md_lock, NULL);
 	pthread_mutex_init(&device_lock, NULL);
 	pthread_mutex_init(&pending_lock, NULL);
-	pthread_cond_init(&pending_cond, NULL);
+	md_cond_init(&pending_cond);
+	pthread_mutex_init(&cli_queue_lock, NULL);
+	pthread_cond_init(&cli_queue_cond, NULL);
+	pthread_mutex_init(&cli_stat_lock, NULL);
+	md_rwlock_init(&cli_query_lock);
+	pthread_mutex_init(&status_gen_lock, NULL);
+	md_cond_init(&status_gen_cond);
+	pthread_mutex_init(&cli_sub_lock, NULL);
+	md_status_init();
+	md_trace_init();
+	md_rusage_init();
 
 	/* set signal handlers */
 	memset(&act, 0x00, sizeof(struct sigaction));
@@ -3208,6 +6378,10 @@ int main(int argc, char *argv[])
 		err("Cannot modify open files limit: %m");
 	}
 
+	start_log_ring(logfd, use_syslog);
+	if (mlock_monitor)
+		md_alloc_lock();
+
 	info("startup");
 	cli = monitor_cli();
 	if (!cli)
@@ -3219,12 +6393,18 @@ int main(int argc, char *argv[])
 	if (start_mpath_check(checker_timeout) < 0)
 		goto out;
 
+	start_metrics(metrics_port);
+	start_watchdog(mdx);
+
 	/* Discover existing devices */
 	discover_devices(udev);
 
 	/* Discover existing MD arrays */
 	discover_md(udev);
 
+	/* Resume from the state of the previous instance */
+	start_snapshot();
+
 	udev_monitor = udev_monitor_new_from_netlink(udev, "udev");
 	if (udev_monitor == NULL) {
 		err("unable to create netlink socket");
@@ -3249,6 +6429,7 @@ int main(int argc, char *argv[])
 	}
 	monitor_fd = udev_monitor_get_fd(udev_monitor);
 	info("waiting for events");
+	md_rusage_start(SUBSYS_UEVENT);
 	while (!udev_exit) {
 		int fdcount;
 		struct timespec tmo;
@@ -3274,20 +6455,25 @@ int main(int argc, char *argv[])
 			device = udev_monitor_receive_device(udev_monitor);
 			if (device == NULL)
 				continue;
+			md_metrics_uevent();
 			print_device(device);
 			handle_event(device);
 			udev_device_unref(device);
+			md_rusage_account(1);
 		}
 	}
 
 out:
 	info("shutting down");
-	pthread_mutex_lock(&md_lock);
+	md_rusage_stop();
+	stop_watchdog();
+	stop_snapshot();
+	md_mutex_lock(&md_lock, LOCK_MD_LIST);
 	list_for_each_entry_safe(found_md, tmp_md, &md_list, entry) {
 		list_del_init(&found_md->entry);
 		remove_md(found_md);
 	}
-	pthread_mutex_unlock(&md_lock);
+	md_mutex_unlock(&md_lock);
 
 	lock_device_list();
 	list_for_each_entry_safe(found_dev, tmp_dev, &device_list, entry) {
@@ -3307,6 +6493,8 @@ out:
 	free(cli);
 
 	stop_mpath_check();
+	stop_metrics();
+	md_status_exit();
 
 	if (mdx && mdx->thread) {
 		pthread_cancel(mdx->thread);
@@ -3329,6 +6517,7 @@ out:
 		     sum_time.tv_sec / num_time, usec / num_time);
 	}
 	info("shutdown, rc %d", rc);
+	stop_log_ring();
 	if (use_syslog)
 		closelog();
 	return rc;
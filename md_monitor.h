@@ -46,22 +46,54 @@ enum device_io_status {
 	IO_RESERVED
 };
 
+enum md_recovery_state {
+	RECOVERY_IDLE,		/* no recovery scheduled */
+	RECOVERY_QUEUED,	/* 're-add' waiting for admission */
+	RECOVERY_RUNNING,	/* 're-add' sent, array is resyncing */
+};
+
+/*
+ * Progress of a checker or executor thread. Updated
+ * without locks, so the watchdog never blocks on a
+ * stalled thread.
+ */
+struct md_heartbeat {
+	unsigned long stamp;	/* CLOCK_MONOTONIC msecs, 0 if idle */
+	unsigned long expect;	/* msecs until the next heartbeat is due */
+	const char *activity;
+	int stalled;
+};
+
 struct mdadm_exec {
 	int running;
 	pthread_t thread;
+	struct md_heartbeat hb;
 };
 
-#define CLI_BUFLEN 4096
 #define MD_NAMELEN 256
 
+/*
+ * All checker, retry and executor timeouts are
+ * carried in msecs; convert for sigtimedwait()
+ * and io_getevents().
+ */
+static inline void md_msecs_to_timespec(unsigned long msecs,
+					struct timespec *ts)
+{
+	ts->tv_sec = msecs / 1000;
+	ts->tv_nsec = (msecs % 1000) * 1000000;
+}
+
 struct cli_monitor {
 	int running;
 	int sock;
+	int stream_sock;
 	pthread_t thread;
 };
 
 struct md_monitor {
 	char dev_name[MD_NAMELEN];
+	char dev_path[MD_NAMELEN + 5];	/* /dev/<sysname> */
 	struct list_head entry;
 	struct list_head children;
 	pthread_mutex_t device_lock;
@@ -76,6 +108,32 @@ struct md_monitor {
 	int in_recovery;
 	int degraded;
 	int in_discovery;
+	struct list_head recovery;
+	enum md_recovery_state recovery_state;
+	unsigned long recovery_size;
+	time_t recovery_start;
+	unsigned long sync_speed;
+	unsigned long failovers;
+	unsigned long readds;
+	unsigned long degraded_secs;
+	time_t degraded_start;
+	int trace_id;
+	int status_idx;		/* status table slot */
+	int ref;
+	uint64_t pending_time;
+	unsigned long fail_pass;	/* last 'Fail' pass, CLI event loop only */
+};
+
+#define IOPRIO_CLASS_NONE	0
+#define IOPRIO_CLASS_RT		1
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_NR_CLASSES	4
+
+struct probe_stat {
+	unsigned long count;
+	unsigned long sum;
+	unsigned long max;
 };
 
 struct device_monitor {
@@ -90,7 +148,13 @@ struct device_monitor {
 	pthread_cond_t io_cond;
 	enum md_rdev_status md_status;
 	enum device_io_status io_status;
+	enum md_rdev_status event_status;
+	enum device_io_status event_io;
+	enum md_rdev_status log_status;
+	enum device_io_status log_io;
 	int ref;
+	int trace_id;
+	int status_idx;		/* status table slot */
 	int md_index;
 	int md_slot;
 	int md_slot_saved;
@@ -98,7 +162,33 @@ struct device_monitor {
 	int fd;
 	int running;
 	int aio_active;
-	struct timeval aio_start_time;
+	int sync_probe;
+	enum device_io_status probe_status;	/* last probe actually issued */
+	int fail_pending;	/* stalled checker, failed by the executor */
+	uint64_t aio_start_time;	/* CLOCK_MONOTONIC nsecs */
+	uint64_t aio_end_time;
+	uint64_t trace_start;
+	unsigned long aio_latency;
+	struct md_heartbeat hb;
+	unsigned long cpu_usecs;	/* checker thread CPU time */
+	unsigned long cpu_probes;
+	unsigned long probe_ios;
+	unsigned long probes_skipped;
+	unsigned long stat_ios;
+	unsigned long stat_inflight;
+	uint64_t stat_time;		/* CLOCK_MONOTONIC nsecs */
+	int stat_hung;
+	unsigned long svc_ios;
+	unsigned long svc_ticks;
+	unsigned long svctm;
+	unsigned long submit_ios;
+	unsigned long submit_inflight;
+	unsigned long qdelay;
+	unsigned long aio_timeout;	/* msecs */
+	int ioprio;
+	int aio_ioprio;
+	int ioprio_noflag;
+	struct probe_stat probe_stat[IOPRIO_NR_CLASSES];
 	struct iocb io;
 	io_context_t ioctx;
 	int blksize;
@@ -115,6 +205,9 @@ extern enum md_rdev_status
 device_monitor_update(struct device_monitor *dev,
 		      enum device_io_status io_status,
 		      enum md_rdev_status new_status);
+extern void md_log_state(struct device_monitor *dev,
+			 enum md_rdev_status md_status,
+			 enum device_io_status io_status);
 extern char *md_rdev_print_state(enum md_rdev_status state);
 extern char *device_io_print_state(enum device_io_status state);
 
@@ -0,0 +1,440 @@
+/*
+ * md_mutex.c
+ *
+ * Instrumented mutexes and rwlocks
+ *
+ * Records wait and hold times per lock class and the
+ * contention per call site. Uncontended locks are taken
+ * with a trylock, so the only overhead is reading the
+ * clock on acquire and release.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "md_debug.h"
+#include "cli_util.h"
+#include "md_mutex.h"
+
+struct md_lock_stat {
+	unsigned long acquired;
+	unsigned long contended;
+	unsigned long trylock_failed;
+	unsigned long wait_sum;
+	unsigned long wait_max;
+	unsigned long hold_sum;
+	unsigned long hold_max;
+	unsigned long wait_hist[MD_LOCK_BUCKETS];
+	unsigned long hold_hist[MD_LOCK_BUCKETS];
+};
+
+struct md_lock_held {
+	void *lock;
+	enum md_lock_class class;
+	unsigned long start;
+};
+
+static const char *lock_class_name[LOCK_CLASS_MAX] = {
+	"device_list", "md_list", "pending", "md_status",
+	"md_device", "device", "cli", "status_gen", "status_table",
+	"cli_query", "trace_name",
+};
+
+static struct md_lock_stat lock_stats[LOCK_CLASS_MAX];
+static struct md_lock_site *lock_sites[MD_LOCK_SITES];
+static unsigned int lock_nr_sites;
+
+/*
+ * Locks held beyond MD_LOCK_DEPTH are not tracked,
+ * only counted in 'lock_overflow'.
+ */
+static __thread struct md_lock_held lock_held[MD_LOCK_DEPTH];
+static __thread int lock_depth;
+static __thread int lock_overflow;
+static int lock_overflow_warned;
+
+static unsigned long md_mutex_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int md_mutex_bucket(unsigned long usecs)
+{
+	int bucket = 0;
+
+	while (usecs && bucket < MD_LOCK_BUCKETS - 1) {
+		usecs >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void md_mutex_max(unsigned long *max, unsigned long val)
+{
+	unsigned long old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while (val > old &&
+	       !__atomic_compare_exchange_n(max, &old, val, 1,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED))
+		;
+}
+
+static void md_mutex_account(unsigned long *sum, unsigned long *max,
+			     unsigned long *hist, unsigned long usecs)
+{
+	__atomic_fetch_add(sum, usecs, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist[md_mutex_bucket(usecs)], 1,
+			   __ATOMIC_RELAXED);
+	md_mutex_max(max, usecs);
+}
+
+static void md_mutex_push(void *lock, enum md_lock_class class,
+			  unsigned long start)
+{
+	if (lock_depth == MD_LOCK_DEPTH) {
+		if (!__atomic_exchange_n(&lock_overflow_warned, 1,
+					 __ATOMIC_RELAXED))
+			warn("more than %d locks held, hold times "
+			     "not accounted", MD_LOCK_DEPTH);
+		lock_overflow++;
+		return;
+	}
+	lock_held[lock_depth].lock = lock;
+	lock_held[lock_depth].class = class;
+	lock_held[lock_depth].start = start;
+	lock_depth++;
+}
+
+static struct md_lock_held *md_mutex_find(void *lock)
+{
+	int i = lock_depth;
+
+	while (i--) {
+		if (lock_held[i].lock == lock)
+			return &lock_held[i];
+	}
+	return NULL;
+}
+
+static void md_mutex_release(struct md_lock_held *held, unsigned long now)
+{
+	struct md_lock_stat *stat = &lock_stats[held->class];
+
+	md_mutex_account(&stat->hold_sum, &stat->hold_max, stat->hold_hist,
+			 now > held->start ? now - held->start : 0);
+}
+
+static void md_mutex_register(struct md_lock_site *site)
+{
+	unsigned int idx;
+
+	if (__atomic_exchange_n(&site->registered, 1, __ATOMIC_RELAXED))
+		return;
+	idx = __atomic_fetch_add(&lock_nr_sites, 1, __ATOMIC_RELAXED);
+	if (idx < MD_LOCK_SITES)
+		__atomic_store_n(&lock_sites[idx], site, __ATOMIC_RELEASE);
+}
+
+static void md_mutex_acquired(void *lock, enum md_lock_class class,
+			      unsigned long now, unsigned long wait)
+{
+	struct md_lock_stat *stat = &lock_stats[class];
+
+	__atomic_fetch_add(&stat->acquired, 1, __ATOMIC_RELAXED);
+	md_mutex_account(&stat->wait_sum, &stat->wait_max, stat->wait_hist,
+			 wait);
+	md_mutex_push(lock, class, now);
+}
+
+/* Account a contended acquisition which started waiting at 'start' */
+static void md_mutex_contended(void *lock, struct md_lock_site *site,
+			       unsigned long start)
+{
+	struct md_lock_stat *stat = &lock_stats[site->class];
+	unsigned long now = md_mutex_now(), wait;
+
+	wait = now > start ? now - start : 0;
+	__atomic_fetch_add(&stat->contended, 1, __ATOMIC_RELAXED);
+	md_mutex_register(site);
+	__atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&site->wait_sum, wait, __ATOMIC_RELAXED);
+	md_mutex_max(&site->wait_max, wait);
+	md_mutex_acquired(lock, site->class, now, wait);
+}
+
+static void md_mutex_drop(void *lock)
+{
+	struct md_lock_held *held = md_mutex_find(lock);
+
+	if (held) {
+		md_mutex_release(held, md_mutex_now());
+		/* Locks are not necessarily released in order */
+		memmove(held, held + 1, (lock_depth -
+			(held - lock_held) - 1) * sizeof(*held));
+		lock_depth--;
+	} else if (lock_overflow > 0)
+		lock_overflow--;
+}
+
+void md_mutex_lock_site(pthread_mutex_t *mutex, struct md_lock_site *site)
+{
+	unsigned long start;
+
+	if (pthread_mutex_trylock(mutex) == 0) {
+		md_mutex_acquired(mutex, site->class, md_mutex_now(), 0);
+		return;
+	}
+	start = md_mutex_now();
+	pthread_mutex_lock(mutex);
+	md_mutex_contended(mutex, site, start);
+}
+
+/*
+ * Returns 0 if the mutex has been acquired, or EBUSY.
+ * Failed attempts are counted per lock class.
+ */
+int md_mutex_trylock(pthread_mutex_t *mutex, enum md_lock_class class)
+{
+	int rc;
+
+	rc = pthread_mutex_trylock(mutex);
+	if (rc) {
+		__atomic_fetch_add(&lock_stats[class].trylock_failed, 1,
+				   __ATOMIC_RELAXED);
+		return rc;
+	}
+	md_mutex_acquired(mutex, class, md_mutex_now(), 0);
+	return 0;
+}
+
+void md_mutex_unlock(pthread_mutex_t *mutex)
+{
+	md_mutex_drop(mutex);
+	pthread_mutex_unlock(mutex);
+}
+
+/*
+ * Writers are preferred, so a steady stream of readers
+ * cannot starve them. Readers must not recurse.
+ */
+int md_rwlock_init(pthread_rwlock_t *rwlock)
+{
+	pthread_rwlockattr_t attr;
+	int rc;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	rc = pthread_rwlock_init(rwlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	return rc;
+}
+
+void md_rwlock_lock_site(pthread_rwlock_t *rwlock, int write,
+			 struct md_lock_site *site)
+{
+	unsigned long start;
+	int rc;
+
+	rc = write ? pthread_rwlock_trywrlock(rwlock) :
+		pthread_rwlock_tryrdlock(rwlock);
+	if (rc == 0) {
+		md_mutex_acquired(rwlock, site->class, md_mutex_now(), 0);
+		return;
+	}
+	start = md_mutex_now();
+	if (write)
+		pthread_rwlock_wrlock(rwlock);
+	else
+		pthread_rwlock_rdlock(rwlock);
+	md_mutex_contended(rwlock, site, start);
+}
+
+void md_rwlock_unlock(pthread_rwlock_t *rwlock)
+{
+	md_mutex_drop(rwlock);
+	pthread_rwlock_unlock(rwlock);
+}
+
+/*
+ * Conditions are timed against CLOCK_MONOTONIC, so a
+ * timeout is not affected by changes to the system time.
+ */
+int md_cond_init(pthread_cond_t *cond)
+{
+	pthread_condattr_t attr;
+	int rc;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	rc = pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return rc;
+}
+
+/* Absolute timeout 'msecs' from now for a condition from md_cond_init() */
+void md_cond_deadline(struct timespec *tmo, unsigned long msecs)
+{
+	clock_gettime(CLOCK_MONOTONIC, tmo);
+	tmo->tv_sec += msecs / 1000;
+	tmo->tv_nsec += (msecs % 1000) * 1000000;
+	if (tmo->tv_nsec >= 1000000000) {
+		tmo->tv_sec++;
+		tmo->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Waiting on a condition releases the mutex,
+ * so the wait is not accounted as hold time.
+ */
+int md_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+	struct md_lock_held *held = md_mutex_find(mutex);
+	int rc;
+
+	if (held)
+		md_mutex_release(held, md_mutex_now());
+	rc = pthread_cond_wait(cond, mutex);
+	if (held)
+		held->start = md_mutex_now();
+	return rc;
+}
+
+int md_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+		      const struct timespec *tmo)
+{
+	struct md_lock_held *held = md_mutex_find(mutex);
+	int rc;
+
+	if (held)
+		md_mutex_release(held, md_mutex_now());
+	rc = pthread_cond_timedwait(cond, mutex, tmo);
+	if (held)
+		held->start = md_mutex_now();
+	return rc;
+}
+
+static int md_mutex_print_hist(struct cli_buf *reply, const char *name,
+			       const unsigned long *hist)
+{
+	unsigned long count;
+	int i, rc;
+
+	rc = cli_printf(reply, "\n  %s:", name);
+	for (i = 0; i < MD_LOCK_BUCKETS && rc >= 0; i++) {
+		count = __atomic_load_n(&hist[i], __ATOMIC_RELAXED);
+		if (!count)
+			continue;
+		if (i == MD_LOCK_BUCKETS - 1)
+			rc = cli_printf(reply, " >=%lu:%lu",
+					1UL << (i - 1), count);
+		else
+			rc = cli_printf(reply, " <%lu:%lu", 1UL << i, count);
+	}
+	return rc;
+}
+
+static int md_mutex_site_cmp(const void *a, const void *b)
+{
+	const struct md_lock_site *s1 = a, *s2 = b;
+
+	if (s1->wait_sum > s2->wait_sum)
+		return -1;
+	return s1->wait_sum < s2->wait_sum;
+}
+
+/*
+ * Display the statistics for each lock class and the
+ * call sites with the highest total wait time.
+ * Histogram buckets are in usecs.
+ */
+int md_mutex_status(struct cli_buf *reply)
+{
+	struct md_lock_site sites[MD_LOCK_SITES], *site;
+	struct md_lock_stat *stat;
+	unsigned long acquired, contended, failed;
+	unsigned int nr_sites, i, num = 0;
+	int rc = 0;
+
+	for (i = 0; i < LOCK_CLASS_MAX && rc >= 0; i++) {
+		stat = &lock_stats[i];
+		acquired = __atomic_load_n(&stat->acquired, __ATOMIC_RELAXED);
+		contended = __atomic_load_n(&stat->contended,
+					    __ATOMIC_RELAXED);
+		failed = __atomic_load_n(&stat->trylock_failed,
+					 __ATOMIC_RELAXED);
+		if (!acquired && !failed)
+			continue;
+		if (!acquired) {
+			rc = cli_printf(reply, "%s%s: trylock failed %lu",
+					reply->len ? "\n" : "",
+					lock_class_name[i], failed);
+			continue;
+		}
+		rc = cli_printf(reply, "%s%s: acquired %lu contended %lu "
+				"wait avg %lu max %lu usec "
+				"hold avg %lu max %lu usec",
+				reply->len ? "\n" : "", lock_class_name[i],
+				acquired, contended,
+				stat->wait_sum / acquired, stat->wait_max,
+				stat->hold_sum / acquired, stat->hold_max);
+		if (rc >= 0 && failed)
+			rc = cli_printf(reply, " trylock failed %lu", failed);
+		if (rc >= 0 && contended)
+			rc = md_mutex_print_hist(reply, "wait",
+						 stat->wait_hist);
+		if (rc >= 0)
+			rc = md_mutex_print_hist(reply, "hold",
+						 stat->hold_hist);
+	}
+
+	nr_sites = __atomic_load_n(&lock_nr_sites, __ATOMIC_RELAXED);
+	if (nr_sites > MD_LOCK_SITES)
+		nr_sites = MD_LOCK_SITES;
+	/* Sort a copy, the counters might change meanwhile */
+	for (i = 0; i < nr_sites; i++) {
+		site = __atomic_load_n(&lock_sites[i], __ATOMIC_ACQUIRE);
+		if (site)
+			sites[num++] = *site;
+	}
+	qsort(sites, num, sizeof(sites[0]), md_mutex_site_cmp);
+	if (num && rc >= 0)
+		rc = cli_printf(reply, "%stop contended sites:",
+				reply->len ? "\n" : "");
+	for (i = 0; i < num && i < MD_LOCK_TOP && rc >= 0; i++) {
+		rc = cli_printf(reply, "\n  %s:%d %s contended %lu "
+				"wait total %lu max %lu usec",
+				sites[i].func, sites[i].line,
+				lock_class_name[sites[i].class],
+				sites[i].contended, sites[i].wait_sum,
+				sites[i].wait_max);
+	}
+	return rc < 0 ? rc : 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * md_mutex.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MD_MUTEX_H
+#define _MD_MUTEX_H
+
+#include <pthread.h>
+#include <time.h>
+
+enum md_lock_class {
+	LOCK_DEVICE_LIST,	/* device_lock */
+	LOCK_MD_LIST,		/* md_lock */
+	LOCK_PENDING,		/* pending_lock */
+	LOCK_MD_STATUS,		/* md_monitor.status_lock */
+	LOCK_MD_DEVICE,		/* md_monitor.device_lock */
+	LOCK_DEVICE,		/* device_monitor.lock */
+	LOCK_CLI,		/* cli_queue_lock, cli_sub_lock, cli_stat_lock */
+	LOCK_STATUS_GEN,	/* status_gen_lock */
+	LOCK_STATUS_TABLE,	/* md_status_lock */
+	LOCK_CLI_QUERY,		/* cli_query_lock */
+	LOCK_TRACE_NAME,	/* trace_name_lock */
+	LOCK_CLASS_MAX,
+};
+
+#define MD_LOCK_BUCKETS	21	/* log2 usecs, the last one is open */
+#define MD_LOCK_SITES	256
+#define MD_LOCK_DEPTH	8
+#define MD_LOCK_TOP	10
+
+/*
+ * Each call site has its own static descriptor; it is
+ * added to the site table on its first contention.
+ */
+struct md_lock_site {
+	const char *func;
+	int line;
+	int registered;
+	enum md_lock_class class;
+	unsigned long contended;
+	unsigned long wait_sum;
+	unsigned long wait_max;
+};
+
+#define md_mutex_lock(m, c) do {					\
+		static struct md_lock_site __site = {			\
+			.func = __func__, .line = __LINE__, .class = (c), \
+		};							\
+		md_mutex_lock_site((m), &__site);			\
+	} while (0)
+
+#define md_rwlock_rdlock(l, c) do {					\
+		static struct md_lock_site __site = {			\
+			.func = __func__, .line = __LINE__, .class = (c), \
+		};							\
+		md_rwlock_lock_site((l), 0, &__site);			\
+	} while (0)
+
+#define md_rwlock_wrlock(l, c) do {					\
+		static struct md_lock_site __site = {			\
+			.func = __func__, .line = __LINE__, .class = (c), \
+		};							\
+		md_rwlock_lock_site((l), 1, &__site);			\
+	} while (0)
+
+struct cli_buf;
+
+extern void md_mutex_lock_site(pthread_mutex_t *mutex,
+			       struct md_lock_site *site);
+extern int md_mutex_trylock(pthread_mutex_t *mutex,
+			    enum md_lock_class class);
+extern void md_mutex_unlock(pthread_mutex_t *mutex);
+extern int md_rwlock_init(pthread_rwlock_t *rwlock);
+extern void md_rwlock_lock_site(pthread_rwlock_t *rwlock, int write,
+				struct md_lock_site *site);
+extern void md_rwlock_unlock(pthread_rwlock_t *rwlock);
+extern int md_cond_init(pthread_cond_t *cond);
+extern void md_cond_deadline(struct timespec *tmo, unsigned long msecs);
+extern int md_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+extern int md_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+			     const struct timespec *tmo);
+extern int md_mutex_status(struct cli_buf *reply);
+
+#endif /* _MD_MUTEX_H */
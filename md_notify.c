@@ -0,0 +1,176 @@
+/*
+ * md_notify.c
+ *
+ * Send mdadm events to md_monitor
+ *
+ * This is a stripped-down version of 'md_monitor --command'
+ * for use from the mdadm PROGRAM hook. It only depends on
+ * libc, so it starts quickly even during event storms.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "md_debug.h"
+#include "cli_util.h"
+
+#define NOTIFY_TIMEOUT 10
+
+void log_fn(int priority, const char *format, ...)
+{
+	va_list ap;
+
+	if (priority > LOG_WARNING)
+		return;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+}
+
+void usage(void)
+{
+	err("Usage: md_notify <event> <md> [<dev>]\n"
+	    "       md_notify <event>:<md>[@<dev>]");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un sun, local;
+	socklen_t addrlen;
+	struct msghdr smsg;
+	char cred_msg[CMSG_SPACE(sizeof(struct ucred))];
+	struct cmsghdr *cmsg;
+	struct ucred *cred;
+	struct iovec iov;
+	struct pollfd pfd;
+	char cmd[CLI_BUFLEN], buf[CLI_BUFLEN];
+	int cli_sock, feature_on = 1, len, rc;
+	ssize_t buflen;
+
+	if (argc == 2)
+		len = snprintf(cmd, sizeof(cmd), "%s", argv[1]);
+	else if (argc == 3)
+		len = snprintf(cmd, sizeof(cmd), "%s:%s", argv[1], argv[2]);
+	else if (argc == 4)
+		len = snprintf(cmd, sizeof(cmd), "%s:%s@%s",
+			       argv[1], argv[2], argv[3]);
+	else {
+		usage();
+		return EINVAL;
+	}
+	if (len >= sizeof(cmd)) {
+		err("command too long");
+		return EMSGSIZE;
+	}
+
+	cli_sock = socket(AF_LOCAL, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (cli_sock < 0) {
+		err("cannot open cli socket: %m");
+		return 3;
+	}
+	memset(&local, 0x00, sizeof(struct sockaddr_un));
+	local.sun_family = AF_LOCAL;
+	sprintf(&local.sun_path[1], CLI_SOCKET_NAME "/%d", getpid());
+	addrlen = offsetof(struct sockaddr_un, sun_path) +
+		strlen(local.sun_path + 1) + 1;
+	if (bind(cli_sock, (struct sockaddr *) &local, addrlen) < 0) {
+		err("bind to local cli address failed: %m");
+		close(cli_sock);
+		return 4;
+	}
+	if (setsockopt(cli_sock, SOL_SOCKET, SO_PASSCRED,
+		       &feature_on, sizeof(feature_on)) < 0) {
+		err("enabling credential passing failed: %m");
+		close(cli_sock);
+		return 6;
+	}
+	memset(&sun, 0x00, sizeof(struct sockaddr_un));
+	sun.sun_family = AF_LOCAL;
+	strcpy(&sun.sun_path[1], CLI_SOCKET_NAME);
+	addrlen = offsetof(struct sockaddr_un, sun_path) +
+		strlen(sun.sun_path + 1) + 1;
+
+	iov.iov_base = cmd;
+	iov.iov_len = len + 1;
+	memset(&smsg, 0x00, sizeof(struct msghdr));
+	smsg.msg_name = &sun;
+	smsg.msg_namelen = addrlen;
+	smsg.msg_iov = &iov;
+	smsg.msg_iovlen = 1;
+	smsg.msg_control = cred_msg;
+	smsg.msg_controllen = sizeof(cred_msg);
+	memset(cred_msg, 0, sizeof(cred_msg));
+
+	cmsg = CMSG_FIRSTHDR(&smsg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_CREDENTIALS;
+
+	cred = (struct ucred *)CMSG_DATA(cmsg);
+	cred->pid = getpid();
+	cred->uid = getuid();
+	cred->gid = getgid();
+
+	if (sendmsg(cli_sock, &smsg, 0) < 0) {
+		if (errno == ECONNREFUSED)
+			err("sendmsg failed, md_monitor is not running");
+		else
+			err("sendmsg failed: %m");
+		close(cli_sock);
+		return 5;
+	}
+
+	pfd.fd = cli_sock;
+	pfd.events = POLLIN;
+	do {
+		rc = poll(&pfd, 1, NOTIFY_TIMEOUT * 1000);
+	} while (rc < 0 && errno == EINTR);
+	if (rc <= 0) {
+		if (!rc)
+			errno = ETIMEDOUT;
+		err("no reply from md_monitor: %m");
+		close(cli_sock);
+		return errno;
+	}
+	buflen = recv(cli_sock, buf, sizeof(buf) - 1, 0);
+	close(cli_sock);
+	if (buflen < 0) {
+		err("recv failed: %m");
+		return errno;
+	}
+	if (buflen == 1) {
+		/* Status message */
+		err("CLI message '%s' failed: %s", cmd, strerror(buf[0]));
+		return buf[0];
+	}
+	if (buflen > 1) {
+		buf[buflen] = '\0';
+		printf("%s\n", buf);
+	}
+	return 0;
+}
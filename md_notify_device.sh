@@ -6,5 +6,9 @@ EVENT=$1
 MD=$2
 DEV=$3
 
-/sbin/md_monitor -c "${EVENT}:${MD}@${DEV}"
+# md_notify avoids the startup cost of the full md_monitor binary
+if [ -x /sbin/md_notify ] ; then
+    exec /sbin/md_notify "${EVENT}" "${MD}" "${DEV}"
+fi
 
+/sbin/md_monitor -c "${EVENT}:${MD}@${DEV}"
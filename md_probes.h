@@ -0,0 +1,59 @@
+/*
+ * md_probes.h
+ *
+ * Static tracepoints for md_monitor
+ *
+ * With HAVE_SDT the probes are compiled as USDT probes in
+ * the 'md_monitor' provider; they are a single nop until a
+ * tracer attaches, eg
+ *
+ *   bpftrace -e 'usdt:/sbin/md_monitor:md_monitor:probe_complete
+ *	{ @[str(arg0)] = hist(arg2); }'
+ *
+ * Without HAVE_SDT the probes compile to nothing.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MD_PROBES_H
+#define _MD_PROBES_H
+
+/*
+ * Probes and their arguments:
+ *
+ * probe_submit(dev, inflight, timeout msecs)
+ * probe_complete(dev, io_status, latency usecs)
+ * state_change(dev, old md_status, new md_status, io_status)
+ * fail_mirror(dev, md, md_status, reason)
+ * reset_mirror(dev, md, devices ready, reason)
+ * exec_start(md, pending_status, pending_side)
+ * exec_finish(md, 1 if failing or 0 if resetting, rc, usecs)
+ *
+ * Names are passed as strings, states as enum values.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define MD_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(md_monitor, name, a1, a2, a3)
+#define MD_PROBE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(md_monitor, name, a1, a2, a3, a4)
+#else
+#define MD_PROBE3(name, a1, a2, a3) do { } while (0)
+#define MD_PROBE4(name, a1, a2, a3, a4) do { } while (0)
+#endif
+
+#endif /* _MD_PROBES_H */
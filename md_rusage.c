@@ -0,0 +1,279 @@
+/*
+ * md_rusage.c
+ *
+ * Per-subsystem resource accounting
+ *
+ * Each thread is assigned to a subsystem and samples its own
+ * getrusage(RUSAGE_THREAD) once per unit of work, eg once per
+ * probe for a path checker. The difference to the previous
+ * sample is added to the subsystem totals, together with the
+ * number of system calls issued on the hot paths.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "md_debug.h"
+#include "cli_util.h"
+#include "md_rusage.h"
+
+struct md_rusage_stat {
+	unsigned long threads;
+	unsigned long ops;
+	unsigned long utime;	/* usecs */
+	unsigned long stime;	/* usecs */
+	unsigned long nvcsw;
+	unsigned long nivcsw;
+	unsigned long minflt;
+	unsigned long syscalls[MD_SYS_MAX];
+};
+
+static const char *subsys_name[SUBSYS_MAX] = {
+	"checker", "exec", "cli", "uevent", "mpath",
+};
+
+static const char *syscall_name[MD_SYS_MAX] = {
+	"open", "read", "ioctl", "close", "sigaction", "sigmask",
+	"io_submit", "io_getevents",
+};
+
+static struct md_rusage_stat rusage_stats[SUBSYS_MAX];
+
+/* Process usage at startup, set before any thread is started */
+static struct rusage rusage_start_self;
+static unsigned long rusage_start_time;
+
+static __thread int rusage_subsys = -1;
+static __thread struct rusage rusage_prev;
+
+static unsigned long md_rusage_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static unsigned long md_rusage_usecs(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000UL + tv->tv_usec;
+}
+
+static unsigned long md_rusage_delta(long new, long old)
+{
+	return new > old ? new - old : 0;
+}
+
+void md_rusage_init(void)
+{
+	getrusage(RUSAGE_SELF, &rusage_start_self);
+	rusage_start_time = md_rusage_now();
+}
+
+/*
+ * Assign the calling thread to 'subsys'. Only resources
+ * used after this call are accounted.
+ */
+void md_rusage_start(enum md_subsys subsys)
+{
+	if (getrusage(RUSAGE_THREAD, &rusage_prev) < 0) {
+		dbg("getrusage failed: %m");
+		return;
+	}
+	rusage_subsys = subsys;
+	__atomic_fetch_add(&rusage_stats[subsys].threads, 1,
+			   __ATOMIC_RELAXED);
+}
+
+void md_rusage_stop(void)
+{
+	if (rusage_subsys < 0)
+		return;
+	md_rusage_account(0);
+	__atomic_fetch_sub(&rusage_stats[rusage_subsys].threads, 1,
+			   __ATOMIC_RELAXED);
+	rusage_subsys = -1;
+}
+
+/*
+ * Account the resources used by the calling thread since
+ * the previous call, and 'ops' completed units of work.
+ * Returns the CPU time used in usecs.
+ */
+unsigned long md_rusage_account(unsigned long ops)
+{
+	struct md_rusage_stat *stat;
+	struct rusage ru;
+	unsigned long utime, stime;
+
+	if (rusage_subsys < 0 || getrusage(RUSAGE_THREAD, &ru) < 0)
+		return 0;
+	stat = &rusage_stats[rusage_subsys];
+	utime = md_rusage_delta(md_rusage_usecs(&ru.ru_utime),
+				md_rusage_usecs(&rusage_prev.ru_utime));
+	stime = md_rusage_delta(md_rusage_usecs(&ru.ru_stime),
+				md_rusage_usecs(&rusage_prev.ru_stime));
+	__atomic_fetch_add(&stat->ops, ops, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stat->utime, utime, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stat->stime, stime, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stat->nvcsw,
+			   md_rusage_delta(ru.ru_nvcsw, rusage_prev.ru_nvcsw),
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stat->nivcsw,
+			   md_rusage_delta(ru.ru_nivcsw, rusage_prev.ru_nivcsw),
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stat->minflt,
+			   md_rusage_delta(ru.ru_minflt, rusage_prev.ru_minflt),
+			   __ATOMIC_RELAXED);
+	rusage_prev = ru;
+	return utime + stime;
+}
+
+void md_rusage_syscall(enum md_syscall call)
+{
+	if (rusage_subsys < 0)
+		return;
+	__atomic_fetch_add(&rusage_stats[rusage_subsys].syscalls[call], 1,
+			   __ATOMIC_RELAXED);
+}
+
+static void md_rusage_read(struct md_rusage_stat *dst,
+			   struct md_rusage_stat *src)
+{
+	int i;
+
+	dst->threads = __atomic_load_n(&src->threads, __ATOMIC_RELAXED);
+	dst->ops = __atomic_load_n(&src->ops, __ATOMIC_RELAXED);
+	dst->utime = __atomic_load_n(&src->utime, __ATOMIC_RELAXED);
+	dst->stime = __atomic_load_n(&src->stime, __ATOMIC_RELAXED);
+	dst->nvcsw = __atomic_load_n(&src->nvcsw, __ATOMIC_RELAXED);
+	dst->nivcsw = __atomic_load_n(&src->nivcsw, __ATOMIC_RELAXED);
+	dst->minflt = __atomic_load_n(&src->minflt, __ATOMIC_RELAXED);
+	for (i = 0; i < MD_SYS_MAX; i++)
+		dst->syscalls[i] = __atomic_load_n(&src->syscalls[i],
+						   __ATOMIC_RELAXED);
+}
+
+/* 'val' divided by 'div', in hundredths */
+static unsigned long md_rusage_ratio(unsigned long val, unsigned long div,
+				     unsigned long scale)
+{
+	return div ? (unsigned long long)val * scale * 100 / div : 0;
+}
+
+static int md_rusage_print_ratio(struct cli_buf *reply, const char *fmt,
+				 unsigned long ratio)
+{
+	return cli_printf(reply, fmt, ratio / 100, ratio % 100);
+}
+
+/*
+ * Display the resource usage of each subsystem since startup,
+ * per unit of work and per second. CPU usage is given in percent
+ * of one CPU. The counters are cumulative and the reply carries
+ * a CLOCK_MONOTONIC timestamp, so clients can compute the usage
+ * over any interval from two replies without affecting each other.
+ */
+int md_rusage_status(struct cli_buf *reply)
+{
+	struct md_rusage_stat stat;
+	struct rusage self;
+	unsigned long now, elapsed, cpu, self_cpu, acct_cpu = 0;
+	int i, j, rc, header;
+
+	now = md_rusage_now();
+	elapsed = now > rusage_start_time ? now - rusage_start_time : 1;
+	rc = cli_printf(reply, "%stimestamp %lu.%06lu elapsed %lu.%03lu secs",
+			reply->len ? "\n" : "", now / 1000000, now % 1000000,
+			elapsed / 1000000, (elapsed % 1000000) / 1000);
+	for (i = 0; i < SUBSYS_MAX && rc >= 0; i++) {
+		md_rusage_read(&stat, &rusage_stats[i]);
+		cpu = stat.utime + stat.stime;
+		acct_cpu += cpu;
+		rc = cli_printf(reply, "\n%s: threads %lu ops %lu",
+				subsys_name[i], stat.threads, stat.ops);
+		if (rc >= 0)
+			rc = md_rusage_print_ratio(reply, " (%lu.%02lu/s)",
+				md_rusage_ratio(stat.ops, elapsed, 1000000));
+		if (rc >= 0)
+			rc = md_rusage_print_ratio(reply, " cpu %lu.%02lu%%",
+				md_rusage_ratio(cpu, elapsed, 100));
+		if (rc >= 0)
+			rc = cli_printf(reply, " user %lu sys %lu usec",
+					stat.utime, stat.stime);
+		if (rc >= 0)
+			rc = cli_printf(reply, "\n  total: csw %lu ivcsw %lu "
+					"minflt %lu", stat.nvcsw, stat.nivcsw,
+					stat.minflt);
+		if (rc < 0 || !stat.ops)
+			continue;
+		rc = md_rusage_print_ratio(reply,
+				"\n  per op: cpu %lu.%02lu usec",
+				md_rusage_ratio(cpu, stat.ops, 1));
+		if (rc >= 0)
+			rc = md_rusage_print_ratio(reply, " csw %lu.%02lu",
+				md_rusage_ratio(stat.nvcsw, stat.ops, 1));
+		if (rc >= 0)
+			rc = md_rusage_print_ratio(reply, " ivcsw %lu.%02lu",
+				md_rusage_ratio(stat.nivcsw, stat.ops, 1));
+		if (rc >= 0)
+			rc = md_rusage_print_ratio(reply, " minflt %lu.%02lu",
+				md_rusage_ratio(stat.minflt, stat.ops, 1));
+		header = 0;
+		for (j = 0; j < MD_SYS_MAX && rc >= 0; j++) {
+			if (!stat.syscalls[j])
+				continue;
+			if (!header++)
+				rc = cli_printf(reply, "\n  syscalls:");
+			if (rc >= 0)
+				rc = cli_printf(reply, " %s %lu",
+						syscall_name[j],
+						stat.syscalls[j]);
+			if (rc >= 0)
+				rc = md_rusage_print_ratio(reply,
+					" %lu.%02lu/op",
+					md_rusage_ratio(stat.syscalls[j],
+							stat.ops, 1));
+			if (rc >= 0)
+				rc = md_rusage_print_ratio(reply,
+					" %lu.%02lu/s",
+					md_rusage_ratio(stat.syscalls[j],
+							elapsed, 1000000));
+		}
+	}
+	/* The remainder is used by threads without a subsystem */
+	if (rc >= 0 && getrusage(RUSAGE_SELF, &self) == 0) {
+		self_cpu = md_rusage_delta(md_rusage_usecs(&self.ru_utime),
+				md_rusage_usecs(&rusage_start_self.ru_utime)) +
+			md_rusage_delta(md_rusage_usecs(&self.ru_stime),
+				md_rusage_usecs(&rusage_start_self.ru_stime));
+		rc = md_rusage_print_ratio(reply, "\nprocess: cpu %lu.%02lu%%",
+				md_rusage_ratio(self_cpu, elapsed, 100));
+		if (rc >= 0)
+			rc = cli_printf(reply, " %lu usec, unaccounted %lu usec",
+					self_cpu, self_cpu > acct_cpu ?
+					self_cpu - acct_cpu : 0);
+	}
+	return rc < 0 ? rc : 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * md_rusage.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MD_RUSAGE_H
+#define _MD_RUSAGE_H
+
+enum md_subsys {
+	SUBSYS_CHECKER,		/* path checker threads */
+	SUBSYS_EXEC,		/* mdadm executor */
+	SUBSYS_CLI,		/* CLI listener and workers */
+	SUBSYS_UEVENT,		/* udev event loop */
+	SUBSYS_MPATH,		/* multipath status poller */
+	SUBSYS_MAX,
+};
+
+enum md_syscall {
+	MD_SYS_OPEN,
+	MD_SYS_READ,
+	MD_SYS_IOCTL,
+	MD_SYS_CLOSE,
+	MD_SYS_SIGACTION,
+	MD_SYS_SIGMASK,
+	MD_SYS_IO_SUBMIT,
+	MD_SYS_IO_GETEVENTS,
+	MD_SYS_MAX,
+};
+
+struct cli_buf;
+
+extern void md_rusage_init(void);
+extern void md_rusage_start(enum md_subsys subsys);
+extern void md_rusage_stop(void);
+extern unsigned long md_rusage_account(unsigned long ops);
+extern void md_rusage_syscall(enum md_syscall call);
+extern int md_rusage_status(struct cli_buf *reply);
+
+#endif /* _MD_RUSAGE_H */
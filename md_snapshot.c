@@ -0,0 +1,342 @@
+/*
+ * md_snapshot.c
+ *
+ * Persistent state snapshot for warm restarts
+ *
+ * The array and device state is written to MD_SNAPSHOT_FILE
+ * periodically and whenever it changes. On startup the
+ * snapshot of the previous instance is loaded, so the
+ * monitor does not need to wait for the first probe of
+ * every device before making decisions.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "md_debug.h"
+#include "md_snapshot.h"
+
+#define MD_SNAPSHOT_DIR "/run/md_monitor"
+
+/*
+ * The records are collected into a preallocated buffer
+ * by the snapshot thread only, so no locking is needed.
+ */
+static struct md_snapshot_header *snap_hdr;
+static struct md_snapshot_array *snap_arrays;
+static struct md_snapshot_dev *snap_devs;
+static uint32_t snap_seq;
+static int snap_full_warned;
+
+/* Snapshot of the previous instance, only used during startup */
+static struct md_snapshot_header *saved_hdr;
+static struct md_snapshot_array *saved_arrays;
+static struct md_snapshot_dev *saved_devs;
+
+/* FNV-1a */
+static uint32_t md_snapshot_checksum(uint32_t hash, const void *buf,
+				     size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static uint32_t md_snapshot_sum_records(const struct md_snapshot_array *arrays,
+					uint32_t nr_arrays,
+					const struct md_snapshot_dev *devs,
+					uint32_t nr_devices)
+{
+	uint32_t hash = 2166136261U;
+
+	hash = md_snapshot_checksum(hash, arrays, nr_arrays * sizeof(*arrays));
+	return md_snapshot_checksum(hash, devs, nr_devices * sizeof(*devs));
+}
+
+int md_snapshot_init(void)
+{
+	int rc;
+
+	snap_hdr = calloc(1, sizeof(*snap_hdr));
+	snap_arrays = calloc(MD_SNAPSHOT_MAX_ARRAYS, sizeof(*snap_arrays));
+	snap_devs = calloc(MD_SNAPSHOT_MAX_DEVICES, sizeof(*snap_devs));
+	if (!snap_hdr || !snap_arrays || !snap_devs) {
+		err("cannot allocate snapshot buffer");
+		md_snapshot_exit();
+		return -ENOMEM;
+	}
+	if (mkdir(MD_SNAPSHOT_DIR, 0755) < 0 && errno != EEXIST) {
+		rc = -errno;
+		warn("cannot create %s: %m", MD_SNAPSHOT_DIR);
+		md_snapshot_exit();
+		return rc;
+	}
+	return 0;
+}
+
+void md_snapshot_exit(void)
+{
+	free(snap_hdr);
+	free(snap_arrays);
+	free(snap_devs);
+	snap_hdr = NULL;
+	snap_arrays = NULL;
+	snap_devs = NULL;
+}
+
+void md_snapshot_begin(void)
+{
+	if (!snap_hdr)
+		return;
+	memset(snap_hdr, 0, sizeof(*snap_hdr));
+}
+
+void md_snapshot_add_array(const struct md_snapshot_array *rec)
+{
+	if (!snap_hdr)
+		return;
+	if (snap_hdr->nr_arrays == MD_SNAPSHOT_MAX_ARRAYS) {
+		if (!snap_full_warned++)
+			warn("%s: snapshot full, array not saved", rec->name);
+		return;
+	}
+	snap_arrays[snap_hdr->nr_arrays++] = *rec;
+}
+
+void md_snapshot_add_dev(const struct md_snapshot_dev *rec)
+{
+	if (!snap_hdr)
+		return;
+	if (snap_hdr->nr_devices == MD_SNAPSHOT_MAX_DEVICES) {
+		if (!snap_full_warned++)
+			warn("%s: snapshot full, device not saved", rec->name);
+		return;
+	}
+	snap_devs[snap_hdr->nr_devices++] = *rec;
+}
+
+/*
+ * Write the collected records. The data is synced before
+ * the rename, so a crash leaves either the previous or
+ * the new snapshot, but never a partial one.
+ */
+int md_snapshot_write(void)
+{
+	struct iovec iov[3];
+	char tmpname[64];
+	ssize_t len, ret;
+	int fd, rc = 0;
+
+	if (!snap_hdr)
+		return -ENOMEM;
+	snap_hdr->magic = MD_SNAPSHOT_MAGIC;
+	snap_hdr->version = MD_SNAPSHOT_VERSION;
+	snap_hdr->header_size = sizeof(struct md_snapshot_header);
+	snap_hdr->array_size = sizeof(struct md_snapshot_array);
+	snap_hdr->dev_size = sizeof(struct md_snapshot_dev);
+	snap_hdr->pid = getpid();
+	snap_hdr->seq = ++snap_seq;
+	snap_hdr->time = time(NULL);
+	snap_hdr->checksum = md_snapshot_sum_records(snap_arrays,
+						     snap_hdr->nr_arrays,
+						     snap_devs,
+						     snap_hdr->nr_devices);
+	iov[0].iov_base = snap_hdr;
+	iov[0].iov_len = sizeof(*snap_hdr);
+	iov[1].iov_base = snap_arrays;
+	iov[1].iov_len = snap_hdr->nr_arrays * sizeof(*snap_arrays);
+	iov[2].iov_base = snap_devs;
+	iov[2].iov_len = snap_hdr->nr_devices * sizeof(*snap_devs);
+	len = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", MD_SNAPSHOT_FILE,
+		 getpid());
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		rc = -errno;
+		warn("cannot create %s: %m", tmpname);
+		return rc;
+	}
+	ret = writev(fd, iov, 3);
+	if (ret != len) {
+		rc = ret < 0 ? -errno : -EIO;
+		warn("cannot write %s: %s", tmpname, strerror(-rc));
+	} else if (fsync(fd) < 0) {
+		rc = -errno;
+		warn("cannot sync %s: %m", tmpname);
+	}
+	close(fd);
+	if (!rc && rename(tmpname, MD_SNAPSHOT_FILE) < 0) {
+		rc = -errno;
+		warn("cannot rename %s: %m", tmpname);
+	}
+	if (rc)
+		unlink(tmpname);
+	else
+		dbg("snapshot %u: %u arrays, %u devices", snap_hdr->seq,
+		    snap_hdr->nr_arrays, snap_hdr->nr_devices);
+	return rc;
+}
+
+static int md_snapshot_valid(const struct md_snapshot_header *hdr,
+			     size_t size)
+{
+	const struct md_snapshot_array *arrays;
+	const struct md_snapshot_dev *devs;
+
+	if (size < sizeof(*hdr) || hdr->magic != MD_SNAPSHOT_MAGIC ||
+	    hdr->version != MD_SNAPSHOT_VERSION ||
+	    hdr->header_size != sizeof(struct md_snapshot_header) ||
+	    hdr->array_size != sizeof(struct md_snapshot_array) ||
+	    hdr->dev_size != sizeof(struct md_snapshot_dev))
+		return 0;
+	if (hdr->nr_arrays > MD_SNAPSHOT_MAX_ARRAYS ||
+	    hdr->nr_devices > MD_SNAPSHOT_MAX_DEVICES)
+		return 0;
+	if (size != sizeof(*hdr) + hdr->nr_arrays * sizeof(*arrays) +
+	    hdr->nr_devices * sizeof(*devs))
+		return 0;
+	arrays = (const struct md_snapshot_array *)(hdr + 1);
+	devs = (const struct md_snapshot_dev *)(arrays + hdr->nr_arrays);
+	return hdr->checksum == md_snapshot_sum_records(arrays,
+							hdr->nr_arrays, devs,
+							hdr->nr_devices);
+}
+
+/*
+ * Load the snapshot of the previous instance, unless it is
+ * older than 'max_age' secs. Only the file format is checked
+ * here; the records need to be validated against the live
+ * MD state.
+ */
+int md_snapshot_load(unsigned long max_age)
+{
+	struct md_snapshot_header *hdr;
+	struct stat st;
+	char *buf;
+	ssize_t ret;
+	size_t len = 0;
+	time_t now;
+	int fd, rc = 0;
+
+	fd = open(MD_SNAPSHOT_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		rc = -errno;
+		if (rc == -ENOENT)
+			info("no snapshot found");
+		else
+			warn("cannot open %s: %m", MD_SNAPSHOT_FILE);
+		return rc;
+	}
+	if (fstat(fd, &st) < 0) {
+		rc = -errno;
+		warn("cannot stat %s: %m", MD_SNAPSHOT_FILE);
+		close(fd);
+		return rc;
+	}
+	if (st.st_size < (off_t)sizeof(struct md_snapshot_header) ||
+	    st.st_size > (off_t)(sizeof(struct md_snapshot_header) +
+		MD_SNAPSHOT_MAX_ARRAYS * sizeof(struct md_snapshot_array) +
+		MD_SNAPSHOT_MAX_DEVICES * sizeof(struct md_snapshot_dev))) {
+		warn("invalid snapshot size %lu", (unsigned long)st.st_size);
+		close(fd);
+		return -EINVAL;
+	}
+	buf = malloc(st.st_size);
+	if (!buf) {
+		close(fd);
+		return -ENOMEM;
+	}
+	while (len < (size_t)st.st_size) {
+		ret = read(fd, buf + len, st.st_size - len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+	close(fd);
+	hdr = (struct md_snapshot_header *)buf;
+	if (!md_snapshot_valid(hdr, len)) {
+		warn("snapshot invalid, ignored");
+		free(buf);
+		return -EINVAL;
+	}
+	/* The MD state might have changed arbitrarily meanwhile */
+	now = time(NULL);
+	if (hdr->time > (uint64_t)now || now - hdr->time > max_age) {
+		warn("snapshot %u of pid %u is %ld secs old, ignored",
+		     hdr->seq, hdr->pid, (long)(now - hdr->time));
+		free(buf);
+		return -ESTALE;
+	}
+	md_snapshot_release();
+	saved_hdr = hdr;
+	saved_arrays = (struct md_snapshot_array *)(saved_hdr + 1);
+	saved_devs = (struct md_snapshot_dev *)
+		(saved_arrays + saved_hdr->nr_arrays);
+	info("loaded snapshot %u of pid %u, %ld secs old, "
+	     "%u arrays, %u devices", saved_hdr->seq, saved_hdr->pid,
+	     (long)(now - saved_hdr->time), saved_hdr->nr_arrays,
+	     saved_hdr->nr_devices);
+	return 0;
+}
+
+const struct md_snapshot_array *md_snapshot_find_array(const char *name)
+{
+	uint32_t i;
+
+	for (i = 0; saved_hdr && i < saved_hdr->nr_arrays; i++) {
+		if (!strncmp(saved_arrays[i].name, name, MD_SNAPSHOT_NAMELEN))
+			return &saved_arrays[i];
+	}
+	return NULL;
+}
+
+const struct md_snapshot_dev *md_snapshot_find_dev(const char *name,
+						   const char *md_name)
+{
+	uint32_t i;
+
+	for (i = 0; saved_hdr && i < saved_hdr->nr_devices; i++) {
+		if (!strncmp(saved_devs[i].name, name, MD_SNAPSHOT_NAMELEN) &&
+		    !strncmp(saved_devs[i].md_name, md_name,
+			     MD_SNAPSHOT_NAMELEN))
+			return &saved_devs[i];
+	}
+	return NULL;
+}
+
+void md_snapshot_release(void)
+{
+	free(saved_hdr);
+	saved_hdr = NULL;
+	saved_arrays = NULL;
+	saved_devs = NULL;
+}
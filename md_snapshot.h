@@ -0,0 +1,100 @@
+/*
+ * md_snapshot.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MD_SNAPSHOT_H
+#define _MD_SNAPSHOT_H
+
+#include <stdint.h>
+
+#define MD_SNAPSHOT_FILE	"/run/md_monitor/snapshot"
+#define MD_SNAPSHOT_MAGIC	0x4d44534e	/* 'MDSN' */
+#define MD_SNAPSHOT_VERSION	1
+
+#define MD_SNAPSHOT_NAMELEN	32
+#define MD_SNAPSHOT_MAX_ARRAYS	64
+#define MD_SNAPSHOT_MAX_DEVICES	512
+#define MD_SNAPSHOT_PRIO_CLASSES 4
+
+/*
+ * Snapshot file layout.
+ * The header is followed by 'nr_arrays' array records and
+ * 'nr_devices' device records; 'checksum' covers all records.
+ * The file is written under a temporary name and renamed,
+ * so it is either complete or the previous version.
+ */
+struct md_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t array_size;
+	uint32_t dev_size;
+	uint32_t nr_arrays;
+	uint32_t nr_devices;
+	uint32_t checksum;
+	uint32_t pid;
+	uint32_t seq;
+	uint64_t time;		/* CLOCK_REALTIME secs */
+};
+
+struct md_snapshot_array {
+	char name[MD_SNAPSHOT_NAMELEN];
+	int32_t raid_disks;
+	int32_t layout;
+	int32_t degraded;	/* mask of failed mirror sides */
+	int32_t pending_side;
+	int32_t pending_status;
+	int32_t reserved;
+	uint64_t failovers;
+	uint64_t readds;
+	uint64_t degraded_secs;
+	uint64_t degraded_start;	/* CLOCK_REALTIME secs */
+};
+
+struct md_snapshot_probe {
+	uint64_t count;
+	uint64_t sum;		/* usecs */
+	uint64_t max;		/* usecs */
+};
+
+struct md_snapshot_dev {
+	char name[MD_SNAPSHOT_NAMELEN];
+	char md_name[MD_SNAPSHOT_NAMELEN];
+	int32_t slot;
+	int32_t side;
+	int32_t md_status;
+	int32_t io_status;
+	uint64_t latency;	/* usecs */
+	uint64_t svctm;		/* usecs */
+	struct md_snapshot_probe probe[MD_SNAPSHOT_PRIO_CLASSES];
+};
+
+extern int md_snapshot_init(void);
+extern void md_snapshot_exit(void);
+extern void md_snapshot_begin(void);
+extern void md_snapshot_add_array(const struct md_snapshot_array *rec);
+extern void md_snapshot_add_dev(const struct md_snapshot_dev *rec);
+extern int md_snapshot_write(void);
+extern int md_snapshot_load(unsigned long max_age);
+extern const struct md_snapshot_array *
+md_snapshot_find_array(const char *name);
+extern const struct md_snapshot_dev *
+md_snapshot_find_dev(const char *name, const char *md_name);
+extern void md_snapshot_release(void);
+
+#endif /* _MD_SNAPSHOT_H */
@@ -0,0 +1,423 @@
+/*
+ * md_status.c
+ *
+ * Status table for all monitored arrays and devices
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <libaio.h>
+
+#include "list.h"
+#include "md_monitor.h"
+#include "md_debug.h"
+#include "cli_util.h"
+#include "md_status.h"
+#include "md_mutex.h"
+
+#define MD_STATUS_SIZE (sizeof(struct md_status_header) +		\
+		MD_STATUS_MAX_ARRAYS * sizeof(struct md_status_array) +	\
+		MD_STATUS_MAX_DEVICES * sizeof(struct md_status_dev))
+
+/*
+ * Lock order: md_status_lock nests inside all other locks,
+ * so records can be published from any context.
+ * It serializes writers only; readers of the shared
+ * file rely on the per-record sequence counters.
+ */
+static pthread_mutex_t md_status_lock;
+static void *md_status_map;
+static int md_status_shared;
+static struct md_status_array *md_status_arrays;
+static struct md_status_dev *md_status_devs;
+
+static const char *recovery_state_name[] = { "idle", "queued", "running" };
+
+/*
+ * Map the status table from MD_STATUS_FILE.
+ * The file is set up under a temporary name and renamed
+ * once the header is valid, so readers never see a
+ * partially initialized table.
+ */
+static void *md_status_map_file(void)
+{
+	char tmpname[64];
+	void *map;
+	int fd;
+
+	if (mkdir(MD_STATUS_DIR, 0755) < 0 && errno != EEXIST) {
+		warn("cannot create %s: %m", MD_STATUS_DIR);
+		return NULL;
+	}
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", MD_STATUS_FILE, getpid());
+	fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		warn("cannot create %s: %m", tmpname);
+		return NULL;
+	}
+	if (ftruncate(fd, MD_STATUS_SIZE) < 0) {
+		warn("cannot resize %s: %m", tmpname);
+		close(fd);
+		unlink(tmpname);
+		return NULL;
+	}
+	map = mmap(NULL, MD_STATUS_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("cannot map %s: %m", tmpname);
+		unlink(tmpname);
+		return NULL;
+	}
+	memset(map, 0, MD_STATUS_SIZE);
+	return map;
+}
+
+void md_status_init(void)
+{
+	struct md_status_header *hdr;
+	char tmpname[64];
+
+	pthread_mutex_init(&md_status_lock, NULL);
+	md_status_map = md_status_map_file();
+	if (md_status_map) {
+		md_status_shared = 1;
+	} else {
+		warn("status table not shared");
+		md_status_map = calloc(1, MD_STATUS_SIZE);
+		if (!md_status_map) {
+			err("cannot allocate status table");
+			return;
+		}
+	}
+	hdr = md_status_map;
+	hdr->version = MD_STATUS_VERSION;
+	hdr->header_size = sizeof(struct md_status_header);
+	hdr->array_size = sizeof(struct md_status_array);
+	hdr->max_arrays = MD_STATUS_MAX_ARRAYS;
+	hdr->dev_size = sizeof(struct md_status_dev);
+	hdr->max_devices = MD_STATUS_MAX_DEVICES;
+	hdr->pid = getpid();
+	hdr->start_time = time(NULL);
+	__atomic_store_n(&hdr->magic, MD_STATUS_MAGIC, __ATOMIC_RELEASE);
+	md_status_arrays = (struct md_status_array *)(hdr + 1);
+	md_status_devs = (struct md_status_dev *)
+		(md_status_arrays + MD_STATUS_MAX_ARRAYS);
+
+	if (!md_status_shared)
+		return;
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", MD_STATUS_FILE, getpid());
+	if (rename(tmpname, MD_STATUS_FILE) < 0) {
+		warn("cannot rename %s: %m", tmpname);
+		unlink(tmpname);
+	}
+}
+
+void md_status_exit(void)
+{
+	if (!md_status_map)
+		return;
+	md_mutex_lock(&md_status_lock, LOCK_STATUS_TABLE);
+	if (md_status_shared) {
+		unlink(MD_STATUS_FILE);
+		munmap(md_status_map, MD_STATUS_SIZE);
+	} else
+		free(md_status_map);
+	md_status_map = NULL;
+	md_status_arrays = NULL;
+	md_status_devs = NULL;
+	md_mutex_unlock(&md_status_lock);
+}
+
+/*
+ * Update a record in place, bracketed by the
+ * sequence counter which precedes the payload.
+ */
+static void md_status_write(uint32_t *seq, const void *src, size_t len)
+{
+	uint32_t val = *seq;
+
+	__atomic_store_n(seq, val + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (src)
+		memcpy(seq + 1, (const uint32_t *)src + 1, len - sizeof(*seq));
+	else
+		memset(seq + 1, 0, len - sizeof(*seq));
+	__atomic_store_n(seq, val + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Records are only rewritten if the payload changed.
+ * 'idx' caches the table slot of the caller; it is
+ * revalidated on every update as the record might have
+ * been removed in the meantime.
+ */
+#define md_status_unchanged(slot, tmp, type)				\
+	!memcmp(&(slot)->in_use, &(tmp)->in_use,			\
+		sizeof(type) - offsetof(type, in_use))
+
+void md_status_set_array(const struct md_status_array *rec, int *idx)
+{
+	struct md_status_array *slot = NULL, tmp = *rec;
+	int i;
+
+	tmp.in_use = 1;
+	snprintf(tmp.pending, MD_STATUS_STATELEN, "%s",
+		 md_rdev_print_state(tmp.pending_status));
+	snprintf(tmp.recovery, MD_STATUS_STATELEN, "%s",
+		 tmp.recovery_state <= RECOVERY_RUNNING ?
+		 recovery_state_name[tmp.recovery_state] : "unknown");
+
+	md_mutex_lock(&md_status_lock, LOCK_STATUS_TABLE);
+	if (!md_status_arrays) {
+		md_mutex_unlock(&md_status_lock);
+		return;
+	}
+	if (*idx >= 0 && *idx < MD_STATUS_MAX_ARRAYS &&
+	    md_status_arrays[*idx].in_use &&
+	    !strcmp(md_status_arrays[*idx].name, rec->name)) {
+		slot = &md_status_arrays[*idx];
+		if (!md_status_unchanged(slot, &tmp, struct md_status_array))
+			md_status_write(&slot->seq, &tmp, sizeof(tmp));
+		md_mutex_unlock(&md_status_lock);
+		return;
+	}
+	for (i = 0; i < MD_STATUS_MAX_ARRAYS; i++) {
+		if (!md_status_arrays[i].in_use) {
+			if (!slot)
+				slot = &md_status_arrays[i];
+			continue;
+		}
+		if (!strcmp(md_status_arrays[i].name, rec->name)) {
+			slot = &md_status_arrays[i];
+			break;
+		}
+	}
+	if (slot) {
+		*idx = slot - md_status_arrays;
+		md_status_write(&slot->seq, &tmp, sizeof(tmp));
+	}
+	md_mutex_unlock(&md_status_lock);
+	if (!slot)
+		warn("%s: status table full, array not listed", rec->name);
+}
+
+void md_status_remove_array(const char *name)
+{
+	int i;
+
+	md_mutex_lock(&md_status_lock, LOCK_STATUS_TABLE);
+	for (i = 0; md_status_arrays && i < MD_STATUS_MAX_ARRAYS; i++) {
+		if (md_status_arrays[i].in_use &&
+		    !strcmp(md_status_arrays[i].name, name)) {
+			md_status_write(&md_status_arrays[i].seq, NULL,
+					sizeof(struct md_status_array));
+			break;
+		}
+	}
+	md_mutex_unlock(&md_status_lock);
+}
+
+void md_status_set_dev(const struct md_status_dev *rec, int *idx)
+{
+	struct md_status_dev *slot = NULL, tmp = *rec;
+	int i;
+
+	tmp.in_use = 1;
+	snprintf(tmp.md_state, MD_STATUS_STATELEN, "%s",
+		 md_rdev_print_state(tmp.md_status));
+	snprintf(tmp.io_state, MD_STATUS_STATELEN, "%s",
+		 device_io_print_state(tmp.io_status));
+
+	md_mutex_lock(&md_status_lock, LOCK_STATUS_TABLE);
+	if (!md_status_devs) {
+		md_mutex_unlock(&md_status_lock);
+		return;
+	}
+	if (*idx >= 0 && *idx < MD_STATUS_MAX_DEVICES &&
+	    md_status_devs[*idx].in_use &&
+	    !strcmp(md_status_devs[*idx].name, rec->name)) {
+		slot = &md_status_devs[*idx];
+		if (!md_status_unchanged(slot, &tmp, struct md_status_dev))
+			md_status_write(&slot->seq, &tmp, sizeof(tmp));
+		md_mutex_unlock(&md_status_lock);
+		return;
+	}
+	for (i = 0; i < MD_STATUS_MAX_DEVICES; i++) {
+		if (!md_status_devs[i].in_use) {
+			if (!slot)
+				slot = &md_status_devs[i];
+			continue;
+		}
+		if (!strcmp(md_status_devs[i].name, rec->name)) {
+			slot = &md_status_devs[i];
+			break;
+		}
+	}
+	if (slot) {
+		*idx = slot - md_status_devs;
+		md_status_write(&slot->seq, &tmp, sizeof(tmp));
+	}
+	md_mutex_unlock(&md_status_lock);
+	if (!slot)
+		warn("%s: status table full, device not listed", rec->name);
+}
+
+void md_status_remove_dev(const char *name)
+{
+	int i;
+
+	md_mutex_lock(&md_status_lock, LOCK_STATUS_TABLE);
+	for (i = 0; md_status_devs && i < MD_STATUS_MAX_DEVICES; i++) {
+		if (md_status_devs[i].in_use &&
+		    !strcmp(md_status_devs[i].name, name)) {
+			md_status_write(&md_status_devs[i].seq, NULL,
+					sizeof(struct md_status_dev));
+			break;
+		}
+	}
+	md_mutex_unlock(&md_status_lock);
+}
+
+/* Worst case: every character escaped as \u00XX */
+#define MD_STATUS_JSONLEN	(MD_STATUS_NAMELEN * 6 + 1)
+
+/*
+ * Escape a table string for a JSON string literal.
+ * The table strings are not NUL-terminated if they fill the field.
+ */
+static const char *md_status_json(char *out, const char *in, size_t len)
+{
+	char *p = out;
+	size_t i;
+
+	for (i = 0; i < len && in[i]; i++) {
+		unsigned char c = in[i];
+
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if (c < 0x20) {
+			p += sprintf(p, "\\u%04x", c);
+		} else
+			*p++ = c;
+	}
+	*p = '\0';
+	return out;
+}
+
+static int md_status_dump_devs(struct cli_buf *reply,
+			       struct md_status_dev *devs, const char *md_name)
+{
+	struct md_status_dev *dev;
+	char name[MD_STATUS_JSONLEN];
+	int i, rc = 0, first = 1;
+
+	for (i = 0; i < MD_STATUS_MAX_DEVICES && rc >= 0; i++) {
+		dev = &devs[i];
+		if (!dev->in_use ||
+		    strncmp(dev->md_name, md_name, MD_STATUS_NAMELEN))
+			continue;
+		rc = cli_printf(reply, "%s\n      { \"name\": \"%s\", "
+				"\"slot\": %d, \"side\": %d, "
+				"\"md_status\": \"%s\", "
+				"\"io_status\": \"%s\", "
+				"\"latency_usec\": %llu }",
+				first ? "" : ",",
+				md_status_json(name, dev->name,
+					       sizeof(dev->name)),
+				dev->slot, dev->side, dev->md_state,
+				dev->io_state,
+				(unsigned long long)dev->latency);
+		first = 0;
+	}
+	return rc;
+}
+
+/*
+ * Format the status table as JSON.
+ * The table is copied under the lock, so the reply
+ * reflects a single point in time.
+ */
+int md_status_dump(struct cli_buf *reply)
+{
+	struct md_status_array *arrays, *md;
+	struct md_status_dev *devs;
+	size_t arrays_size, devs_size;
+	char name[MD_STATUS_JSONLEN], alias[MD_STATUS_JSONLEN];
+	int i, rc, first = 1;
+
+	arrays_size = MD_STATUS_MAX_ARRAYS * sizeof(struct md_status_array);
+	devs_size = MD_STATUS_MAX_DEVICES * sizeof(struct md_status_dev);
+	arrays = malloc(arrays_size);
+	devs = malloc(devs_size);
+	if (!arrays || !devs) {
+		free(arrays);
+		free(devs);
+		return -ENOMEM;
+	}
+	md_mutex_lock(&md_status_lock, LOCK_STATUS_TABLE);
+	if (md_status_arrays) {
+		memcpy(arrays, md_status_arrays, arrays_size);
+		memcpy(devs, md_status_devs, devs_size);
+	} else {
+		memset(arrays, 0, arrays_size);
+		memset(devs, 0, devs_size);
+	}
+	md_mutex_unlock(&md_status_lock);
+
+	rc = cli_printf(reply, "{ \"arrays\": [");
+	for (i = 0; i < MD_STATUS_MAX_ARRAYS && rc >= 0; i++) {
+		md = &arrays[i];
+		if (!md->in_use)
+			continue;
+		rc = cli_printf(reply, "%s\n  { \"name\": \"%s\", "
+				"\"alias\": \"%s\", \"raid_disks\": %d, "
+				"\"degraded\": %d, \"pending_side\": %d, "
+				"\"pending\": \"%s\", \"recovery\": \"%s\", "
+				"\"in_recovery\": %d,\n    \"devices\": [",
+				first ? "" : ",",
+				md_status_json(name, md->name,
+					       sizeof(md->name)),
+				md_status_json(alias, md->alias,
+					       sizeof(md->alias)),
+				md->raid_disks, md->degraded,
+				md->pending_side, md->pending,
+				md->recovery, md->in_recovery);
+		if (rc >= 0)
+			rc = md_status_dump_devs(reply, devs, md->name);
+		if (rc >= 0)
+			rc = cli_printf(reply, " ] }");
+		first = 0;
+	}
+	if (rc >= 0)
+		rc = cli_printf(reply, " ] }");
+	free(arrays);
+	free(devs);
+	return rc < 0 ? rc : 0;
+}
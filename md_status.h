@@ -0,0 +1,98 @@
+/*
+ * md_status.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MD_STATUS_H
+#define _MD_STATUS_H
+
+#include <stdint.h>
+
+#define MD_STATUS_DIR		"/run/md_monitor"
+#define MD_STATUS_FILE		MD_STATUS_DIR "/status"
+#define MD_STATUS_MAGIC		0x4d445354	/* 'MDST' */
+#define MD_STATUS_VERSION	1
+
+#define MD_STATUS_NAMELEN	32
+#define MD_STATUS_STATELEN	16
+#define MD_STATUS_MAX_ARRAYS	64
+#define MD_STATUS_MAX_DEVICES	512
+
+/*
+ * Status table records.
+ * The monitor publishes a record whenever the status of
+ * an array or a device changes, so the table can be read
+ * without touching the array or device locks.
+ *
+ * The table is shared with other processes via MD_STATUS_FILE:
+ * the header is followed by 'max_arrays' array records and
+ * 'max_devices' device records. 'seq' is odd while a record
+ * is being updated; readers copy the record and retry if
+ * 'seq' was odd or changed during the copy.
+ */
+struct md_status_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t array_size;
+	uint32_t max_arrays;
+	uint32_t dev_size;
+	uint32_t max_devices;
+	uint32_t pid;
+	uint64_t start_time;
+};
+
+struct md_status_array {
+	uint32_t seq;
+	uint32_t in_use;
+	char name[MD_STATUS_NAMELEN];
+	char alias[MD_STATUS_NAMELEN];
+	int32_t raid_disks;
+	int32_t degraded;
+	int32_t pending_side;
+	int32_t pending_status;
+	int32_t recovery_state;
+	int32_t in_recovery;
+	char pending[MD_STATUS_STATELEN];
+	char recovery[MD_STATUS_STATELEN];
+};
+
+struct md_status_dev {
+	uint32_t seq;
+	uint32_t in_use;
+	char name[MD_STATUS_NAMELEN];
+	char md_name[MD_STATUS_NAMELEN];
+	int32_t slot;
+	int32_t side;
+	int32_t md_status;
+	int32_t io_status;
+	uint64_t latency;
+	char md_state[MD_STATUS_STATELEN];
+	char io_state[MD_STATUS_STATELEN];
+};
+
+struct cli_buf;
+
+extern void md_status_init(void);
+extern void md_status_exit(void);
+extern void md_status_set_array(const struct md_status_array *rec, int *idx);
+extern void md_status_remove_array(const char *name);
+extern void md_status_set_dev(const struct md_status_dev *rec, int *idx);
+extern void md_status_remove_dev(const char *name);
+extern int md_status_dump(struct cli_buf *reply);
+
+#endif /* _MD_STATUS_H */
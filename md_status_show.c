@@ -0,0 +1,201 @@
+/*
+ * md_status_show.c
+ *
+ * Display the md_monitor status table
+ *
+ * Reads the status table published by md_monitor in
+ * /run/md_monitor/status without contacting the daemon.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "md_debug.h"
+#include "md_status.h"
+
+#define READ_RETRIES 1000
+
+static int log_priority = LOG_INFO;
+
+void log_fn(int priority, const char *format, ...)
+{
+	va_list ap;
+
+	if (log_priority < priority)
+		return;
+
+	va_start(ap, format);
+	if (priority == LOG_ERR)
+		vfprintf(stderr, format, ap);
+	else
+		vfprintf(stdout, format, ap);
+	va_end(ap);
+}
+
+void usage(void)
+{
+	err("Usage: md_status_show [--file=<file>|-f <file>] "
+	    "[--array=<md>|-a <md>] [--help|-h]\n"
+	    "  --file=<file>                  read status table from <file>\n"
+	    "  --array=<md>                   only display array <md>\n"
+	    "  --help");
+}
+
+/*
+ * Copy a record, retrying while md_monitor updates it.
+ * The sequence counter is odd during an update and
+ * changes whenever the record has been modified.
+ */
+static int read_record(const void *rec, void *copy, size_t len)
+{
+	const uint32_t *seq = rec;
+	uint32_t start, end;
+	int retries = READ_RETRIES;
+
+	while (retries--) {
+		start = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+		if (start & 1)
+			continue;
+		memcpy(copy, rec, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		end = __atomic_load_n(seq, __ATOMIC_RELAXED);
+		if (start == end)
+			return 0;
+	}
+	return -EAGAIN;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filename = MD_STATUS_FILE, *md_name = NULL;
+	const struct md_status_header *hdr;
+	const char *arrays, *devs;
+	struct md_status_array md;
+	struct md_status_dev dev;
+	struct stat st;
+	void *map;
+	int fd, i, j, option, rc = 0;
+
+	static const struct option options[] = {
+		{ "file", required_argument, NULL, 'f' },
+		{ "array", required_argument, NULL, 'a' },
+		{ "help", no_argument, NULL, 'h' },
+		{}
+	};
+
+	while (1) {
+		option = getopt_long(argc, argv, "f:a:h", options, NULL);
+		if (option == -1)
+			break;
+
+		switch (option) {
+		case 'f':
+			filename = optarg;
+			break;
+		case 'a':
+			md_name = optarg;
+			if (!strncmp(md_name, "/dev/", 5))
+				md_name += 5;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err("cannot open %s: %m", filename);
+		return 2;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+		err("%s: invalid status table", filename);
+		close(fd);
+		return 3;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		err("cannot map %s: %m", filename);
+		return 3;
+	}
+	hdr = map;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != MD_STATUS_MAGIC ||
+	    hdr->version != MD_STATUS_VERSION) {
+		err("%s: unsupported status table version", filename);
+		rc = 3;
+		goto out;
+	}
+	/* Newer versions might extend the records */
+	if (hdr->array_size < sizeof(md) || hdr->dev_size < sizeof(dev) ||
+	    hdr->header_size + (size_t)hdr->max_arrays * hdr->array_size +
+	    (size_t)hdr->max_devices * hdr->dev_size > st.st_size) {
+		err("%s: invalid status table layout", filename);
+		rc = 3;
+		goto out;
+	}
+	if (kill(hdr->pid, 0) < 0 && errno == ESRCH)
+		warn("md_monitor (pid %u) is not running, status is stale",
+		     hdr->pid);
+
+	arrays = (const char *)map + hdr->header_size;
+	devs = arrays + (size_t)hdr->max_arrays * hdr->array_size;
+	for (i = 0; i < hdr->max_arrays; i++) {
+		if (read_record(arrays + (size_t)i * hdr->array_size,
+				&md, sizeof(md)) < 0) {
+			warn("array record %d busy, skipped", i);
+			continue;
+		}
+		if (!md.in_use)
+			continue;
+		if (md_name && strcmp(md.name, md_name) &&
+		    strcmp(md.alias, md_name))
+			continue;
+		printf("%s: alias %s disks %d degraded 0x%x pending %s/0x%x "
+		       "recovery %s%s\n", md.name, md.alias, md.raid_disks,
+		       md.degraded, md.pending, md.pending_side, md.recovery,
+		       md.in_recovery ? " (resync)" : "");
+		for (j = 0; j < hdr->max_devices; j++) {
+			if (read_record(devs + (size_t)j * hdr->dev_size,
+					&dev, sizeof(dev)) < 0) {
+				warn("device record %d busy, skipped", j);
+				continue;
+			}
+			if (!dev.in_use || strcmp(dev.md_name, md.name))
+				continue;
+			printf("  %s: slot %d side %d status %s %s "
+			       "latency %llu usecs\n", dev.name, dev.slot,
+			       dev.side, dev.md_state, dev.io_state,
+			       (unsigned long long)dev.latency);
+		}
+	}
+out:
+	munmap(map, st.st_size);
+	return rc;
+}
@@ -0,0 +1,499 @@
+/*
+ * md_trace.c
+ *
+ * Binary flight recorder
+ *
+ * Records state transitions and probe results in fixed-size
+ * per-thread ring buffers. Recording does not take any locks
+ * and does not format anything; the buffers are written out
+ * by the 'DumpTrace' command or on a fatal signal and decoded
+ * with md_trace_decode. The 'TraceExport' command converts the
+ * buffers into the Chrome trace event format.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <libaio.h>
+
+#include "list.h"
+#include "md_monitor.h"
+#include "md_debug.h"
+#include "cli_util.h"
+#include "md_status.h"
+#include "md_trace.h"
+#include "md_mutex.h"
+
+struct md_trace_buf {
+	uint64_t head;
+	struct md_trace_rec recs[MD_TRACE_RECS];
+};
+
+static const char *trace_event_name[TRACE_EVENT_MAX] = {
+	"none", "probe_submit", "probe_done", "md_state",
+	"fail_mirror", "reset_mirror", "fail_md", "reset_md",
+	"queue_wait", "set_timeout", "mdadm", "fail_fanout",
+};
+
+static const int trace_event_span[TRACE_EVENT_MAX] = {
+	[TRACE_PROBE_DONE] = 1,
+	[TRACE_QUEUE_WAIT] = 1,
+	[TRACE_SET_TIMEOUT] = 1,
+	[TRACE_MDADM] = 1,
+	[TRACE_FAIL_FANOUT] = 1,
+};
+
+/*
+ * Everything written by md_trace_write() is allocated
+ * statically, so it can be dumped from a signal handler.
+ */
+static struct md_trace_header trace_hdr;
+static char trace_strings[TRACE_EVENT_MAX + RESERVED + IO_RESERVED]
+	[MD_TRACE_STRLEN];
+static char trace_names[MD_TRACE_NAMES][MD_TRACE_NAMELEN];
+static uint16_t trace_parent[MD_TRACE_NAMES];
+static unsigned int trace_nr_names;
+static pthread_mutex_t trace_name_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct md_trace_buf trace_bufs[MD_TRACE_BUFS];
+static int trace_buf_owned[MD_TRACE_BUFS];
+static unsigned int trace_next_buf;
+static pthread_key_t trace_key;
+static int trace_key_valid;
+
+static __thread struct md_trace_buf *trace_buf;
+static __thread uint32_t trace_tid;
+
+uint64_t md_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Called on thread exit; the history is kept until the buffer is reused */
+static void md_trace_release(void *ctx)
+{
+	struct md_trace_buf *buf = ctx;
+
+	__atomic_store_n(&trace_buf_owned[buf - trace_bufs], 0,
+			 __ATOMIC_RELEASE);
+}
+
+/*
+ * Claim a buffer for the calling thread, so a busy thread
+ * only overwrites its own history. Free buffers are reused
+ * round-robin; with more tracing threads than buffers the
+ * remaining threads share a buffer. Does not allocate memory.
+ */
+static struct md_trace_buf *md_trace_claim(void)
+{
+	unsigned int start, idx, i;
+
+	start = __atomic_fetch_add(&trace_next_buf, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < MD_TRACE_BUFS; i++) {
+		idx = (start + i) % MD_TRACE_BUFS;
+		if (__atomic_exchange_n(&trace_buf_owned[idx], 1,
+					__ATOMIC_ACQUIRE))
+			continue;
+		if (trace_key_valid)
+			pthread_setspecific(trace_key, &trace_bufs[idx]);
+		return &trace_bufs[idx];
+	}
+	return &trace_bufs[start % MD_TRACE_BUFS];
+}
+
+/*
+ * Record an event. Each thread records into its own buffer
+ * if one is available; threads sharing a buffer claim records
+ * with an atomic increment. The timestamp is stored last and
+ * marks the record as valid.
+ */
+void md_trace(int event, int id, int old_state, int new_state,
+	      int io_status, unsigned int arg)
+{
+	struct md_trace_rec *rec;
+	uint64_t pos;
+
+	if (!trace_buf) {
+		trace_buf = md_trace_claim();
+		trace_tid = syscall(SYS_gettid);
+	}
+	pos = __atomic_fetch_add(&trace_buf->head, 1, __ATOMIC_RELAXED);
+	rec = &trace_buf->recs[pos & (MD_TRACE_RECS - 1)];
+	__atomic_store_n(&rec->ts, 0, __ATOMIC_RELAXED);
+	/* Readers check the timestamp before and after copying */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec->tid = trace_tid;
+	rec->arg = arg;
+	rec->event = event;
+	rec->id = id;
+	rec->old_state = old_state;
+	rec->new_state = new_state;
+	rec->io_status = io_status;
+	__atomic_store_n(&rec->ts, md_trace_now(), __ATOMIC_RELEASE);
+}
+
+/*
+ * Record the end of a span which started at 'start'
+ * (as returned by md_trace_now()).
+ */
+void md_trace_span(int event, int id, uint64_t start, int old_state,
+		   int new_state, int io_status)
+{
+	uint64_t now = md_trace_now();
+
+	md_trace(event, id, old_state, new_state, io_status,
+		 now > start ? (now - start) / 1000 : 0);
+}
+
+/*
+ * Returns the index of 'name' in the name table,
+ * adding it if required.
+ */
+int md_trace_register(const char *name)
+{
+	unsigned int i;
+	int id = MD_TRACE_NOID;
+
+	if (!name)
+		return MD_TRACE_NOID;
+	md_mutex_lock(&trace_name_lock, LOCK_TRACE_NAME);
+	for (i = 0; i < trace_nr_names; i++) {
+		if (!strncmp(trace_names[i], name, MD_TRACE_NAMELEN - 1)) {
+			id = i;
+			break;
+		}
+	}
+	if (id == MD_TRACE_NOID && trace_nr_names < MD_TRACE_NAMES) {
+		id = trace_nr_names;
+		snprintf(trace_names[id], MD_TRACE_NAMELEN, "%.*s",
+			 MD_TRACE_NAMELEN - 1, name);
+		trace_parent[id] = MD_TRACE_NOID;
+		__atomic_store_n(&trace_nr_names, id + 1, __ATOMIC_RELEASE);
+	}
+	md_mutex_unlock(&trace_name_lock);
+	if (id == MD_TRACE_NOID)
+		warn("%s: trace name table full", name);
+	return id;
+}
+
+/*
+ * Set the array 'parent' of device 'id';
+ * the export groups the events by array.
+ */
+void md_trace_set_parent(int id, int parent)
+{
+	if (id == MD_TRACE_NOID || id == parent)
+		return;
+	__atomic_store_n(&trace_parent[id], parent, __ATOMIC_RELAXED);
+}
+
+static int md_trace_write_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, ptr, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Write the trace buffers to 'fd'.
+ * Only uses async-signal-safe functions.
+ */
+static int md_trace_write(int fd)
+{
+	struct md_trace_header hdr = trace_hdr;
+	int rc;
+
+	hdr.nr_names = __atomic_load_n(&trace_nr_names, __ATOMIC_ACQUIRE);
+	hdr.dump_time = md_trace_now();
+	rc = md_trace_write_all(fd, &hdr, sizeof(hdr));
+	if (!rc)
+		rc = md_trace_write_all(fd, trace_strings,
+					sizeof(trace_strings));
+	if (!rc)
+		rc = md_trace_write_all(fd, trace_names,
+					hdr.nr_names * MD_TRACE_NAMELEN);
+	if (!rc)
+		rc = md_trace_write_all(fd, trace_bufs, sizeof(trace_bufs));
+	return rc;
+}
+
+/*
+ * Write the trace buffers to 'path'.
+ * Returns the number of recorded events or a negative error.
+ */
+int md_trace_dump(const char *path)
+{
+	char tmpname[PATH_MAX];
+	uint64_t head;
+	int fd, i, rc, num = 0;
+
+	if (mkdir(MD_STATUS_DIR, 0755) < 0 && errno != EEXIST)
+		return -errno;
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", path, getpid());
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+	rc = md_trace_write(fd);
+	close(fd);
+	if (!rc && rename(tmpname, path) < 0)
+		rc = -errno;
+	if (rc < 0) {
+		unlink(tmpname);
+		return rc;
+	}
+	for (i = 0; i < MD_TRACE_BUFS; i++) {
+		head = __atomic_load_n(&trace_bufs[i].head, __ATOMIC_RELAXED);
+		num += head < MD_TRACE_RECS ? head : MD_TRACE_RECS;
+	}
+	return num;
+}
+
+static int md_trace_cmp(const void *a, const void *b)
+{
+	const struct md_trace_rec *r1 = a, *r2 = b;
+
+	if (r1->ts < r2->ts)
+		return -1;
+	return r1->ts > r2->ts;
+}
+
+/*
+ * Copy all valid records into 'recs'. Records which are
+ * rewritten while being copied are skipped.
+ */
+static int md_trace_collect(struct md_trace_rec *recs)
+{
+	struct md_trace_rec *rec;
+	uint64_t ts;
+	int i, j, num = 0;
+
+	for (i = 0; i < MD_TRACE_BUFS; i++) {
+		for (j = 0; j < MD_TRACE_RECS; j++) {
+			rec = &trace_bufs[i].recs[j];
+			ts = __atomic_load_n(&rec->ts, __ATOMIC_ACQUIRE);
+			if (!ts)
+				continue;
+			recs[num] = *rec;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&rec->ts, __ATOMIC_RELAXED) != ts)
+				continue;
+			recs[num].ts = ts;
+			num++;
+		}
+	}
+	qsort(recs, num, sizeof(*recs), md_trace_cmp);
+	return num;
+}
+
+static const char *md_trace_string(int base, int num, int idx)
+{
+	if (idx >= num)
+		return "unknown";
+	return trace_strings[base + idx];
+}
+
+/*
+ * Events are grouped into one process per array; each
+ * device is a thread within the process of its array,
+ * and events on the array itself use the array as thread.
+ */
+static int md_trace_export_names(struct cli_buf *reply, int nr_names,
+				 int filter)
+{
+	int id, parent, rc = 0;
+
+	for (id = 0; id < nr_names && rc >= 0; id++) {
+		parent = __atomic_load_n(&trace_parent[id], __ATOMIC_RELAXED);
+		if (parent == MD_TRACE_NOID) {
+			if (filter != MD_TRACE_NOID && id != filter)
+				continue;
+			rc = cli_printf(reply, "\n{ \"ph\": \"M\", "
+					"\"name\": \"process_name\", "
+					"\"pid\": %d, \"tid\": %d, "
+					"\"args\": { \"name\": \"%s\" } },",
+					id, id, trace_names[id]);
+			parent = id;
+		} else if (filter != MD_TRACE_NOID && parent != filter)
+			continue;
+		if (rc >= 0)
+			rc = cli_printf(reply, "\n{ \"ph\": \"M\", "
+					"\"name\": \"thread_name\", "
+					"\"pid\": %d, \"tid\": %d, "
+					"\"args\": { \"name\": \"%s\" } },",
+					parent, id, trace_names[id]);
+	}
+	return rc;
+}
+
+/*
+ * Format the trace buffers as Chrome trace events,
+ * optionally restricted to the array 'name' and its devices.
+ */
+int md_trace_export(struct cli_buf *reply, const char *name)
+{
+	struct md_trace_rec *recs, *rec;
+	int nr_names, filter = MD_TRACE_NOID;
+	int i, num, pid, rc;
+	uint64_t start, dur;
+
+	nr_names = __atomic_load_n(&trace_nr_names, __ATOMIC_ACQUIRE);
+	if (name) {
+		for (i = 0; i < nr_names; i++) {
+			if (!strcmp(trace_names[i], name))
+				break;
+		}
+		if (i == nr_names)
+			return -ENODEV;
+		filter = i;
+	}
+	recs = malloc(MD_TRACE_BUFS * MD_TRACE_RECS * sizeof(*recs));
+	if (!recs)
+		return -ENOMEM;
+	num = md_trace_collect(recs);
+
+	rc = cli_printf(reply, "{ \"displayTimeUnit\": \"ms\", "
+			"\"traceEvents\": [");
+	if (rc >= 0)
+		rc = md_trace_export_names(reply, nr_names, filter);
+	for (i = 0; i < num && rc >= 0; i++) {
+		rec = &recs[i];
+		if (rec->id >= nr_names || rec->event >= TRACE_EVENT_MAX)
+			continue;
+		pid = __atomic_load_n(&trace_parent[rec->id],
+				      __ATOMIC_RELAXED);
+		if (pid == MD_TRACE_NOID)
+			pid = rec->id;
+		if (filter != MD_TRACE_NOID && pid != filter)
+			continue;
+		/* Timestamps are in usecs */
+		if (trace_event_span[rec->event]) {
+			dur = (uint64_t)rec->arg * 1000;
+			start = rec->ts > dur ? rec->ts - dur : 0;
+			rc = cli_printf(reply, "\n{ \"ph\": \"X\", "
+					"\"ts\": %llu.%03llu, "
+					"\"dur\": %u, ",
+					(unsigned long long)start / 1000,
+					(unsigned long long)start % 1000,
+					rec->arg);
+		} else {
+			rc = cli_printf(reply, "\n{ \"ph\": \"i\", "
+					"\"s\": \"t\", "
+					"\"ts\": %llu.%03llu, ",
+					(unsigned long long)rec->ts / 1000,
+					(unsigned long long)rec->ts % 1000);
+		}
+		if (rc < 0)
+			break;
+		rc = cli_printf(reply, "\"name\": \"%s\", "
+				"\"pid\": %d, \"tid\": %d, "
+				"\"args\": { \"old\": \"%s\", "
+				"\"new\": \"%s\", \"io\": \"%s\", "
+				"\"arg\": %d, \"thread\": %u } },",
+				trace_event_name[rec->event], pid, rec->id,
+				md_trace_string(TRACE_EVENT_MAX, RESERVED,
+						rec->old_state),
+				md_trace_string(TRACE_EVENT_MAX, RESERVED,
+						rec->new_state),
+				md_trace_string(TRACE_EVENT_MAX + RESERVED,
+						IO_RESERVED, rec->io_status),
+				(int)rec->arg, rec->tid);
+	}
+	/* Drop the trailing comma */
+	if (rc >= 0 && reply->len && reply->buf[reply->len - 1] == ',')
+		reply->buf[--reply->len] = '\0';
+	if (rc >= 0)
+		rc = cli_printf(reply, " ] }");
+	free(recs);
+	return rc < 0 ? rc : 0;
+}
+
+static void md_trace_fatal(int signum)
+{
+	int fd;
+
+	fd = open(MD_TRACE_CRASH_FILE, O_WRONLY | O_CREAT | O_TRUNC |
+		  O_CLOEXEC, 0600);
+	if (fd >= 0) {
+		md_trace_write(fd);
+		close(fd);
+	}
+	/* SA_RESETHAND restored the default action */
+	raise(signum);
+}
+
+void md_trace_init(void)
+{
+	static const int fatal_signals[] = {
+		SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT,
+	};
+	struct sigaction act;
+	int i;
+
+	if (pthread_key_create(&trace_key, md_trace_release) == 0)
+		trace_key_valid = 1;
+	trace_hdr.magic = MD_TRACE_MAGIC;
+	trace_hdr.version = MD_TRACE_VERSION;
+	trace_hdr.rec_size = sizeof(struct md_trace_rec);
+	trace_hdr.nr_bufs = MD_TRACE_BUFS;
+	trace_hdr.nr_recs = MD_TRACE_RECS;
+	trace_hdr.name_len = MD_TRACE_NAMELEN;
+	trace_hdr.str_len = MD_TRACE_STRLEN;
+	trace_hdr.nr_events = TRACE_EVENT_MAX;
+	trace_hdr.nr_md_states = RESERVED;
+	trace_hdr.nr_io_states = IO_RESERVED;
+	trace_hdr.pid = getpid();
+	for (i = 0; i < TRACE_EVENT_MAX; i++)
+		snprintf(trace_strings[i], MD_TRACE_STRLEN, "%s",
+			 trace_event_name[i]);
+	for (i = 0; i < RESERVED; i++)
+		snprintf(trace_strings[TRACE_EVENT_MAX + i], MD_TRACE_STRLEN,
+			 "%s", md_rdev_print_state(i));
+	for (i = 0; i < IO_RESERVED; i++)
+		snprintf(trace_strings[TRACE_EVENT_MAX + RESERVED + i],
+			 MD_TRACE_STRLEN, "%s", device_io_print_state(i));
+
+	memset(&act, 0x00, sizeof(struct sigaction));
+	act.sa_handler = md_trace_fatal;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_RESETHAND | SA_NODEFER;
+	for (i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++)
+		sigaction(fatal_signals[i], &act, NULL);
+}
@@ -0,0 +1,106 @@
+/*
+ * md_trace.h
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MD_TRACE_H
+#define _MD_TRACE_H
+
+#include <stdint.h>
+
+#define MD_TRACE_FILE		"/run/md_monitor/trace"
+#define MD_TRACE_CRASH_FILE	"/run/md_monitor/trace.crash"
+#define MD_TRACE_MAGIC		0x4d445452	/* 'MDTR' */
+#define MD_TRACE_VERSION	1
+
+#define MD_TRACE_BUFS		256	/* one per tracing thread */
+#define MD_TRACE_RECS		512	/* per buffer, must be a power of 2 */
+#define MD_TRACE_NAMES		4096
+#define MD_TRACE_NAMELEN	32
+#define MD_TRACE_STRLEN		16
+#define MD_TRACE_NOID		0xffff
+
+/*
+ * Span events are recorded when the span ends;
+ * 'arg' holds the duration of the span in usecs.
+ */
+enum md_trace_event {
+	TRACE_NONE,
+	TRACE_PROBE_SUBMIT,	/* arg: I/Os in flight */
+	TRACE_PROBE_DONE,	/* span: probe submission to result */
+	TRACE_MD_STATE,		/* arg: slot number */
+	TRACE_FAIL_MIRROR,	/* arg: mirror side */
+	TRACE_RESET_MIRROR,	/* arg: devices ready */
+	TRACE_FAIL_MD,		/* arg: mdadm exit status */
+	TRACE_RESET_MD,		/* arg: mdadm exit status */
+	TRACE_QUEUE_WAIT,	/* span: request queued for mdadm_exec */
+	TRACE_SET_TIMEOUT,	/* span: setting the DASD timeout */
+	TRACE_MDADM,		/* span: mdadm invocation */
+	TRACE_FAIL_FANOUT,	/* span: failing the component devices */
+	TRACE_EVENT_MAX,
+};
+
+/*
+ * Trace dump layout: the header is followed by the string
+ * tables for event names, md states and I/O states, the
+ * name table for devices and arrays, and the trace buffers.
+ * Each buffer consists of the 64-bit position of the next
+ * record followed by 'nr_recs' records; records with a zero
+ * timestamp are unused.
+ */
+struct md_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t nr_bufs;
+	uint32_t nr_recs;
+	uint32_t nr_names;
+	uint32_t name_len;
+	uint32_t str_len;
+	uint32_t nr_events;
+	uint32_t nr_md_states;
+	uint32_t nr_io_states;
+	uint32_t pid;
+	uint64_t dump_time;	/* CLOCK_MONOTONIC nsecs */
+};
+
+struct md_trace_rec {
+	uint64_t ts;		/* CLOCK_MONOTONIC nsecs */
+	uint32_t tid;
+	uint32_t arg;
+	uint16_t event;
+	uint16_t id;		/* index into the name table */
+	uint8_t old_state;
+	uint8_t new_state;
+	uint8_t io_status;
+	uint8_t pad;
+};
+
+struct cli_buf;
+
+extern uint64_t md_trace_now(void);
+extern void md_trace(int event, int id, int old_state, int new_state,
+		     int io_status, unsigned int arg);
+extern void md_trace_span(int event, int id, uint64_t start, int old_state,
+			  int new_state, int io_status);
+extern int md_trace_register(const char *name);
+extern void md_trace_set_parent(int id, int parent);
+extern int md_trace_export(struct cli_buf *reply, const char *name);
+extern int md_trace_dump(const char *path);
+extern void md_trace_init(void);
+
+#endif /* _MD_TRACE_H */
@@ -0,0 +1,231 @@
+/*
+ * md_trace_decode.c
+ *
+ * Decode an md_monitor trace dump
+ *
+ * Reads a trace dump written by the 'DumpTrace' command or
+ * on a fatal signal and prints the recorded events as a single
+ * timeline ordered by time.
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "md_debug.h"
+#include "md_trace.h"
+
+static int log_priority = LOG_INFO;
+
+void log_fn(int priority, const char *format, ...)
+{
+	va_list ap;
+
+	if (log_priority < priority)
+		return;
+
+	va_start(ap, format);
+	if (priority == LOG_ERR)
+		vfprintf(stderr, format, ap);
+	else
+		vfprintf(stdout, format, ap);
+	va_end(ap);
+}
+
+void usage(void)
+{
+	err("Usage: md_trace_decode [--file=<file>|-f <file>] "
+	    "[--name=<dev>|-n <dev>] [--help|-h]\n"
+	    "  --file=<file>                  read trace dump from <file>\n"
+	    "  --name=<dev>                   only display events for "
+	    "device or array <dev>\n"
+	    "  --help");
+}
+
+static const struct md_trace_header *hdr;
+static const char *strings, *names;
+
+static const char *trace_string(unsigned int base, unsigned int num,
+				unsigned int idx)
+{
+	if (idx >= num)
+		return "?";
+	return strings + (size_t)(base + idx) * hdr->str_len;
+}
+
+static const char *trace_name(unsigned int id)
+{
+	if (id >= hdr->nr_names)
+		return "-";
+	return names + (size_t)id * hdr->name_len;
+}
+
+static int trace_cmp(const void *a, const void *b)
+{
+	const struct md_trace_rec *r1 = a, *r2 = b;
+
+	if (r1->ts < r2->ts)
+		return -1;
+	return r1->ts > r2->ts;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *filename = MD_TRACE_FILE, *name = NULL;
+	const char *bufs, *ptr;
+	struct md_trace_rec *recs;
+	unsigned int nr_strings, md_base, io_base;
+	size_t buf_size, size, num = 0, i, j;
+	struct stat st;
+	char *data;
+	int fd, option;
+	ssize_t ret;
+
+	static const struct option options[] = {
+		{ "file", required_argument, NULL, 'f' },
+		{ "name", required_argument, NULL, 'n' },
+		{ "help", no_argument, NULL, 'h' },
+		{}
+	};
+
+	while (1) {
+		option = getopt_long(argc, argv, "f:n:h", options, NULL);
+		if (option == -1)
+			break;
+
+		switch (option) {
+		case 'f':
+			filename = optarg;
+			break;
+		case 'n':
+			name = optarg;
+			if (!strncmp(name, "/dev/", 5))
+				name += 5;
+			break;
+		case 'h':
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err("cannot open %s: %m", filename);
+		return 2;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+		err("%s: invalid trace dump", filename);
+		close(fd);
+		return 3;
+	}
+	data = malloc(st.st_size);
+	if (!data) {
+		err("cannot allocate %lu bytes", (unsigned long)st.st_size);
+		close(fd);
+		return 3;
+	}
+	for (size = 0; size < st.st_size; size += ret) {
+		ret = read(fd, data + size, st.st_size - size);
+		if (ret <= 0) {
+			err("cannot read %s: %s", filename,
+			    ret ? strerror(errno) : "short read");
+			close(fd);
+			free(data);
+			return 3;
+		}
+	}
+	close(fd);
+
+	hdr = (const struct md_trace_header *)data;
+	if (hdr->magic != MD_TRACE_MAGIC || hdr->version != MD_TRACE_VERSION ||
+	    hdr->rec_size != sizeof(struct md_trace_rec)) {
+		err("%s: unsupported trace dump version", filename);
+		free(data);
+		return 3;
+	}
+	nr_strings = hdr->nr_events + hdr->nr_md_states + hdr->nr_io_states;
+	buf_size = sizeof(uint64_t) + (size_t)hdr->nr_recs * hdr->rec_size;
+	size = sizeof(*hdr) + (size_t)nr_strings * hdr->str_len +
+		(size_t)hdr->nr_names * hdr->name_len +
+		(size_t)hdr->nr_bufs * buf_size;
+	if (!hdr->str_len || !hdr->name_len || size != st.st_size) {
+		err("%s: invalid trace dump layout", filename);
+		free(data);
+		return 3;
+	}
+	strings = data + sizeof(*hdr);
+	names = strings + (size_t)nr_strings * hdr->str_len;
+	bufs = names + (size_t)hdr->nr_names * hdr->name_len;
+	md_base = hdr->nr_events;
+	io_base = md_base + hdr->nr_md_states;
+
+	recs = malloc((size_t)hdr->nr_bufs * hdr->nr_recs * sizeof(*recs));
+	if (!recs) {
+		err("cannot allocate trace records");
+		free(data);
+		return 3;
+	}
+	for (i = 0; i < hdr->nr_bufs; i++) {
+		ptr = bufs + i * buf_size + sizeof(uint64_t);
+		for (j = 0; j < hdr->nr_recs; j++) {
+			memcpy(&recs[num], ptr + j * hdr->rec_size,
+			       sizeof(*recs));
+			if (!recs[num].ts)
+				continue;
+			if (name && strcmp(trace_name(recs[num].id), name))
+				continue;
+			num++;
+		}
+	}
+	qsort(recs, num, sizeof(*recs), trace_cmp);
+
+	printf("md_monitor pid %u, %lu events\n", hdr->pid,
+	       (unsigned long)num);
+	for (i = 0; i < num; i++) {
+		/* Timestamps are relative to the time of the dump */
+		uint64_t delta = 0;
+
+		if (recs[i].ts < hdr->dump_time)
+			delta = hdr->dump_time - recs[i].ts;
+
+		printf("-%llu.%06llu %6u %-13s %-12s %s -> %s io %s arg %d\n",
+		       (unsigned long long)(delta / 1000000000ULL),
+		       (unsigned long long)(delta % 1000000000ULL) / 1000,
+		       recs[i].tid,
+		       trace_string(0, hdr->nr_events, recs[i].event),
+		       trace_name(recs[i].id),
+		       trace_string(md_base, hdr->nr_md_states,
+				    recs[i].old_state),
+		       trace_string(md_base, hdr->nr_md_states,
+				    recs[i].new_state),
+		       trace_string(io_base, hdr->nr_io_states,
+				    recs[i].io_status),
+		       (int)recs[i].arg);
+	}
+	free(recs);
+	free(data);
+	return 0;
+}
@@ -29,11 +29,20 @@
 #include "list.h"
 #include "md_debug.h"
 #include "md_monitor.h"
+#include "md_mutex.h"
+#include "md_rusage.h"
 
 #define DEFAULT_SOCKET "/org/kernel/linux/storage/multipathd"
+#define MPATH_REPLY_LEN 256
+#define MPATH_STATUS_LEN 65536
+
 pthread_t mpath_thread;
 static unsigned long mpath_timeout;
 
+/* Reply buffer for 'show maps', only used by the status thread */
+static char *mpath_reply;
+static size_t mpath_reply_size;
+
 /*
  * connect to a unix domain socket
  */
@@ -148,37 +157,36 @@ int send_packet(int fd, const char *buf, size_t len)
 }
 
 /*
- * receive a packet in length prefix format
+ * receive a packet in length prefix format into 'buf'.
+ * Returns -EMSGSIZE with the packet length in 'len' if
+ * the packet does not fit into 'size' bytes.
  */
-int recv_packet(int fd, char **buf, size_t *len, unsigned int timeout)
+int recv_packet(int fd, char *buf, size_t size, size_t *len,
+		unsigned int timeout)
 {
 	ssize_t ret;
 
+	buf[0] = '\0';
 	ret = read_all(fd, len, sizeof(*len), timeout);
 	if (ret < 0) {
-		(*buf) = NULL;
 		*len = 0;
 		return ret;
 	}
 	if (ret < sizeof(*len)) {
-		(*buf) = NULL;
 		*len = 0;
 		return -EIO;
 	}
-	if (len == 0) {
-		(*buf) = NULL;
+	if (*len == 0)
 		return 0;
-	}
-	(*buf) = malloc(*len);
-	if (!*buf)
-		return -ENOMEM;
-	ret = read_all(fd, *buf, *len, timeout);
+	if (*len >= size)
+		return -EMSGSIZE;
+	ret = read_all(fd, buf, *len, timeout);
 	if (ret != *len) {
-		free(*buf);
-		(*buf) = NULL;
+		buf[0] = '\0';
 		*len = 0;
 		return ret < 0 ? ret : -EIO;
 	}
+	buf[*len] = '\0';
 	return 0;
 }
 
@@ -187,7 +195,7 @@ enum device_io_status mpath_check_status(struct device_monitor *dev,
 {
 	int fd;
 	char inbuf[280];
-	char *reply, *ptr, *eptr;
+	char reply[MPATH_REPLY_LEN], *ptr, *eptr;
 	size_t len;
 	unsigned long num_paths;
 	int ret;
@@ -206,7 +214,7 @@ enum device_io_status mpath_check_status(struct device_monitor *dev,
 		close(fd);
 		return IO_ERROR;
 	}
-	ret = recv_packet(fd, &reply, &len, timeout);
+	ret = recv_packet(fd, reply, sizeof(reply), &len, timeout);
 	close(fd);
 	if (ret < 0) {
 		warn("%s: error receiving packet from multipathd: %s",
@@ -242,7 +250,6 @@ enum device_io_status mpath_check_status(struct device_monitor *dev,
 	else
 		io_status = IO_PENDING;
 out:
-	free(reply);
 	return io_status;
 }
 
@@ -250,7 +257,7 @@ int mpath_modify_queueing(struct device_monitor *dev, int enable, int timeout)
 {
 	int fd;
 	char inbuf[276];
-	char *reply;
+	char reply[MPATH_REPLY_LEN];
 	size_t len;
 	int ret;
 
@@ -274,14 +281,14 @@ int mpath_modify_queueing(struct device_monitor *dev, int enable, int timeout)
 		close(fd);
 		return IO_ERROR;
 	}
-	ret = recv_packet(fd, &reply, &len, timeout);
+	ret = recv_packet(fd, reply, sizeof(reply), &len, timeout);
 	close(fd);
 	if (ret < 0) {
 		warn("%s: error receiving packet from multipathd: %s",
 		     dev->dev_name, strerror(-ret));
 	} else {
 		/* multipathd calculates the length including the NULL byte */
-		if (len && reply[len - 2] == '\n') {
+		if (len > 1 && reply[len - 2] == '\n') {
 			len--;
 			reply[len - 1] = 0;
 		}
@@ -297,7 +304,6 @@ int mpath_modify_queueing(struct device_monitor *dev, int enable, int timeout)
 	if (ret)
 		warn("%s: cannot modify multipath queueing", dev->dev_name);
 
-	free(reply);
 	return ret;
 }
 
@@ -307,7 +313,9 @@ ssize_t mpath_status(char **reply, int timeout)
 	char inbuf[64];
 	size_t len;
 	int ret;
+	char *newbuf;
 
+retry:
 	fd = socket_connect(DEFAULT_SOCKET);
 	if (fd < 0) {
 		warn("mpath: failed to connect to multipathd: %m");
@@ -321,8 +329,19 @@ ssize_t mpath_status(char **reply, int timeout)
 		close(fd);
 		return ret;
 	}
-	ret = recv_packet(fd, reply, &len, timeout);
+	ret = recv_packet(fd, mpath_reply, mpath_reply_size, &len, timeout);
 	close(fd);
+	if (ret == -EMSGSIZE) {
+		/* Grow the buffer, this is not on the failover path */
+		newbuf = realloc(mpath_reply, len + 1);
+		if (newbuf) {
+			info("mpath: reply buffer increased to %lu bytes",
+			     (unsigned long)len + 1);
+			mpath_reply = newbuf;
+			mpath_reply_size = len + 1;
+			goto retry;
+		}
+	}
 	if (ret < 0) {
 		warn("mpath: error receiving packet from multipathd: %s",
 		     strerror(-ret));
@@ -330,6 +349,7 @@ ssize_t mpath_status(char **reply, int timeout)
 			ret = 0;
 		return ret;
 	}
+	*reply = mpath_reply;
 	return len;
 }
 
@@ -345,6 +365,7 @@ void *mpath_status_thread (void *ctx)
 	unsigned long num_paths;
 	int rc, md_slot;
 
+	md_rusage_start(SUBSYS_MPATH);
 	while (1) {
 		len = mpath_status(&reply, mpath_timeout);
 		if (len < 0) {
@@ -353,7 +374,6 @@ void *mpath_status_thread (void *ctx)
 		}
 		if (len == 0) {
 			warn("timeout while reading multipath status, retry");
-			free(reply);
 			continue;
 		}
 		ptr = reply;
@@ -415,28 +435,25 @@ void *mpath_status_thread (void *ctx)
 			if (!dev) {
 				continue;
 			}
-			warn("%s: update status", devname);
+			dbg("%s: update status", devname);
 			md_status = md_rdev_check_state(dev, &md_slot);
 			if (md_status == UNKNOWN) {
 				/* array has been stopped */
 				continue;
 			}
 			/* Write status back */
-			pthread_mutex_lock(&dev->lock);
+			md_mutex_lock(&dev->lock, LOCK_DEVICE);
 			new_status = md_rdev_update_state(dev, md_status, md_slot);
 			dev->io_status = io_status;
 			pthread_cond_signal(&dev->io_cond);
-			pthread_mutex_unlock(&dev->lock);
+			md_mutex_unlock(&dev->lock);
 			new_status = device_monitor_update(dev, io_status,
 							   new_status);
-			info("%s: state %s / %s",
-			     dev->dev_name, md_rdev_print_state(new_status),
-			     device_io_print_state(io_status));
+			md_log_state(dev, new_status, io_status);
 		}
-		free(reply);
-		tmo.tv_sec = mpath_timeout;
-		tmo.tv_nsec = 0;
-		info("mpath: waiting %ld seconds ...", (long)tmo.tv_sec);
+		md_rusage_account(1);
+		md_msecs_to_timespec(mpath_timeout, &tmo);
+		dbg("mpath: waiting %lu msecs ...", mpath_timeout);
 		rc = sigtimedwait(&thread_sigmask, NULL, &tmo);
 		if (rc < 0) {
 			if (errno == EINTR) {
@@ -449,6 +466,7 @@ void *mpath_status_thread (void *ctx)
 			info("mpath: wait interrupted");
 		}
 	}
+	md_rusage_stop();
 	return ((void *)0);
 }
 
@@ -458,6 +476,12 @@ int start_mpath_check(unsigned long timeout)
 
 	info("Start mpath status thread");
 	mpath_timeout = timeout;
+	mpath_reply = malloc(MPATH_STATUS_LEN);
+	if (!mpath_reply) {
+		err("Failed to allocate mpath reply buffer");
+		return -ENOMEM;
+	}
+	mpath_reply_size = MPATH_STATUS_LEN;
 
 	rc = pthread_create(&mpath_thread, NULL, mpath_status_thread, NULL);
 	if (rc) {
@@ -474,4 +498,7 @@ void stop_mpath_check(void)
 		pthread_cancel(mpath_thread);
 		pthread_join(mpath_thread, NULL);
 	}
+	free(mpath_reply);
+	mpath_reply = NULL;
+	mpath_reply_size = 0;
 }
@@ -24,6 +24,8 @@ enum device_io_status mpath_check_status(struct device_monitor *dev,
 					 int timeout);
 int mpath_modify_queueing(struct device_monitor *dev, int enable, int timeout);
 int start_mpath_check(unsigned long);
+size_t write_all(int fd, const void *buf, size_t len);
+ssize_t read_all(int fd, void *buf, size_t len, unsigned int timeout);
 void stop_mpath_check(void);
 
 #endif /* _MPATH_UTIL_H */
@@ -0,0 +1,40 @@
+#!/bin/bash
+#
+# Notification benchmark: compare 'md_monitor -c' with md_notify
+#
+# Sends <count> 'NewArray' events, which are ignored by md_monitor,
+# with each client and reports the average time per notification.
+# md_monitor needs to be running.
+#
+
+COUNT=${1:-1000}
+EVENT="NewArray:/dev/console"
+
+function run_bench() {
+    local name=$1
+    shift
+    local start end i
+
+    start=$(date +%s%N)
+    for ((i = 0; i < COUNT; i++)) ; do
+	"$@" > /dev/null || {
+	    echo "$name: notification failed"
+	    return 1
+	}
+    done
+    end=$(date +%s%N)
+    echo "$name: $COUNT notifications in $(( (end - start) / 1000000 )) msecs," \
+	"$(( (end - start) / COUNT / 1000 )) usecs each"
+}
+
+if ! /sbin/md_monitor -c CliStatus > /dev/null ; then
+    echo "md_monitor is not running"
+    exit 1
+fi
+
+run_bench "md_monitor -c" /sbin/md_monitor -c "$EVENT"
+if [ -x /sbin/md_notify ] ; then
+    run_bench "md_notify" /sbin/md_notify "$EVENT"
+else
+    echo "md_notify not installed, skipping"
+fi
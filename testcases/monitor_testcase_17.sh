@@ -0,0 +1,115 @@
+#!/bin/bash
+#
+# Testcase 17: Allocation-free failover
+#
+# md_monitor needs to be built with 'make OPTFLAGS=-DMD_ALLOC_CHECK'
+#
+
+set -o errexit
+
+. $(dirname "$0")/monitor_testcase_functions.sh
+
+MD_NAME="testcase17"
+MD_DEV="/dev/md/${MD_NAME}"
+
+MONITOR_TIMEOUT=60
+MONITOR_ARGS="--mlock"
+
+function resume_dasd() {
+    local dasd=$1
+
+    setdasd -q 0 -d /dev/${dasd} || \
+	error_exit "Cannot resume /dev/${dasd}"
+}
+
+function online_scsi() {
+    local sdev=$1
+
+    if ! echo running > /sys/block/$sdev/device/state ; then
+	error_exit "Cannot set device $sdev online"
+    fi
+}
+
+function check_alloc() {
+    local step=$1
+    local status
+
+    status=$(md_monitor -c AllocStatus)
+    echo "$status"
+    if ! echo "$status" | grep -q "memory locked" ; then
+	error_exit "$step: md_monitor memory not locked"
+    fi
+    if echo "$status" | grep -q "not checked" ; then
+	error_exit "md_monitor built without MD_ALLOC_CHECK"
+    fi
+    if ! echo "$status" | grep -q " 0 allocations" ; then
+	error_exit "$step: allocations on the failover path"
+    fi
+}
+
+logger "Monitor Testcase 17: Allocation-free failover"
+
+stop_md ${MD_DEV}
+
+activate_devices
+
+clear_metadata
+
+ulimit -c unlimited
+start_md ${MD_NAME}
+
+echo "$(date) Create filesystem ..."
+if ! mkfs.ext3 ${MD_DEV} ; then
+    error_exit "Cannot create fs"
+fi
+
+echo "$(date) Mount filesystem ..."
+if ! mount ${MD_DEV} /mnt ; then
+    error_exit "Cannot mount MD array."
+fi
+
+echo "$(date) Write test file 1 ..."
+dd if=/dev/zero of=/mnt/testfile1 bs=4096 count=1024
+
+if [ -n "$DEVNOS_LEFT" ] ; then
+    echo "$(date) Quiesce disks on first half ..."
+    for d in ${DEVICES_LEFT[@]} ; do
+	setdasd -q 1 -d /dev/${d} || \
+	    error_exit "Cannot quiesce /dev/${d}"
+	push_recovery_fn "resume_dasd ${d}"
+    done
+else
+    for sdev in ${SDEVS_LEFT[@]} ; do
+	echo offline > /sys/block/$sdev/device/state || \
+	    error_exit "Cannot offline device $sdev"
+	push_recovery_fn "online_scsi $sdev"
+    done
+fi
+
+wait_for_md_failed $MONITOR_TIMEOUT
+
+check_alloc "fail"
+
+echo "$(date) Resume disks on first half ..."
+while true ; do
+    if ! pop_recovery_fn ; then
+	break;
+    fi
+done
+
+wait_for_md_running_left $MONITOR_TIMEOUT
+
+echo "$(date) Wait for sync"
+wait_for_sync ${MD_DEV} || \
+    error_exit "Failed to synchronize array"
+
+check_alloc "re-add"
+
+check_md_log step1
+
+echo "$(date) Umount filesystem ..."
+umount /mnt
+
+logger "${MD_NAME}: success"
+
+stop_md ${MD_DEV}
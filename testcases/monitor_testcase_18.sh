@@ -0,0 +1,173 @@
+#!/bin/bash
+#
+# Testcase 18: Warm restart from a state snapshot
+#
+
+set -o errexit
+
+. $(dirname "$0")/monitor_testcase_functions.sh
+
+MD_NAME="testcase18"
+MD_DEV="/dev/md/${MD_NAME}"
+SNAPSHOT=/run/md_monitor/snapshot
+STALE_SNAPSHOT=/tmp/monitor_${MD_NAME}_snapshot
+
+MONITOR_TIMEOUT=60
+MONITOR_ARGS="--snapshot=1"
+
+function resume_dasd() {
+    local dasd=$1
+
+    setdasd -q 0 -d /dev/${dasd} || \
+	error_exit "Cannot resume /dev/${dasd}"
+}
+
+function online_scsi() {
+    local sdev=$1
+
+    if ! echo running > /sys/block/$sdev/device/state ; then
+	error_exit "Cannot set device $sdev online"
+    fi
+}
+
+function degraded_mask() {
+    local MD_NUM
+
+    MD_NUM=$(resolve_md ${MD_DEV})
+    md_monitor -c DumpStatus | \
+	sed -n "s/.*\"name\": \"${MD_NUM}\".*\"degraded\": \([0-9]*\).*/\1/p"
+}
+
+function wait_monitor_exit() {
+    local pid=$MONITOR_PID
+    local n=0
+
+    stop_monitor || error_exit "Cannot stop md_monitor"
+    while [ -n "$pid" ] && kill -0 $pid 2> /dev/null ; do
+	[ $n -ge $MONITOR_TIMEOUT ] && \
+	    error_exit "md_monitor did not exit after $n seconds"
+	sleep 1
+	(( n++ )) || true
+    done
+}
+
+function restart_monitor() {
+    local snapshot=$1
+
+    echo "$(date) Restart md_monitor ..."
+    wait_monitor_exit
+    if [ -n "$snapshot" ] ; then
+	cp ${snapshot} ${SNAPSHOT} || \
+	    error_exit "Cannot install snapshot ${snapshot}"
+    fi
+    MONITOR_PID=$(/sbin/md_monitor -y -p 7 -d -s ${MONITOR_ARGS})
+    if [ -z "$MONITOR_PID" ] ; then
+	error_exit "Failed to restart md_monitor"
+    fi
+}
+
+function check_restored() {
+    local step=$1
+    local status=$2
+    local mask=$3
+    local newmask
+
+    wait_for_monitor ${MD_DEV} "${status}" $MONITOR_TIMEOUT || \
+	error_exit "$step: monitor status not restored"
+    newmask=$(degraded_mask)
+    if [ "$newmask" != "$mask" ] ; then
+	error_exit "$step: degraded mask is '$newmask', expected '$mask'"
+    fi
+    echo "$(date) $step: monitor status ${status} degraded ${mask}"
+}
+
+logger "Monitor Testcase 18: Warm restart from a state snapshot"
+
+stop_md ${MD_DEV}
+
+activate_devices
+
+clear_metadata
+
+rm -f ${SNAPSHOT} ${STALE_SNAPSHOT}
+
+ulimit -c unlimited
+start_md ${MD_NAME}
+
+echo "$(date) Create filesystem ..."
+if ! mkfs.ext3 ${MD_DEV} ; then
+    error_exit "Cannot create fs"
+fi
+
+echo "$(date) Mount filesystem ..."
+if ! mount ${MD_DEV} /mnt ; then
+    error_exit "Cannot mount MD array."
+fi
+
+echo "$(date) Write test file 1 ..."
+dd if=/dev/zero of=/mnt/testfile1 bs=4096 count=1024
+
+CLEAN_STATUS=$(md_monitor -c"MonitorStatus:${MD_DEV}")
+CLEAN_MASK=$(degraded_mask)
+
+if [ -n "$DEVNOS_LEFT" ] ; then
+    echo "$(date) Quiesce disks on first half ..."
+    for d in ${DEVICES_LEFT[@]} ; do
+	setdasd -q 1 -d /dev/${d} || \
+	    error_exit "Cannot quiesce /dev/${d}"
+	push_recovery_fn "resume_dasd ${d}"
+    done
+else
+    for sdev in ${SDEVS_LEFT[@]} ; do
+	echo offline > /sys/block/$sdev/device/state || \
+	    error_exit "Cannot offline device $sdev"
+	push_recovery_fn "online_scsi $sdev"
+    done
+fi
+
+wait_for_md_failed $MONITOR_TIMEOUT
+
+FAILED_STATUS=$(md_monitor -c"MonitorStatus:${MD_DEV}")
+FAILED_MASK=$(degraded_mask)
+if [ -z "$FAILED_MASK" ] || [ "$FAILED_MASK" = "0" ] ; then
+    error_exit "Array not degraded after failing the first half"
+fi
+
+# Let the snapshot thread catch up with the failure
+sleep 3
+[ -f ${SNAPSHOT} ] || error_exit "No snapshot written"
+
+restart_monitor
+check_restored "restart" "${FAILED_STATUS}" "${FAILED_MASK}"
+
+# Keep the degraded snapshot for the stale restart below
+wait_monitor_exit
+cp ${SNAPSHOT} ${STALE_SNAPSHOT} || \
+    error_exit "Cannot save snapshot"
+restart_monitor
+
+echo "$(date) Resume disks on first half ..."
+while true ; do
+    if ! pop_recovery_fn ; then
+	break;
+    fi
+done
+
+wait_for_md_running_left $MONITOR_TIMEOUT
+
+echo "$(date) Wait for sync"
+wait_for_sync ${MD_DEV} || \
+    error_exit "Failed to synchronize array"
+
+restart_monitor ${STALE_SNAPSHOT}
+check_restored "stale snapshot" "${CLEAN_STATUS}" "${CLEAN_MASK}"
+rm -f ${STALE_SNAPSHOT}
+
+check_md_log step1
+
+echo "$(date) Umount filesystem ..."
+umount /mnt
+
+logger "${MD_NAME}: success"
+
+stop_md ${MD_DEV}
@@ -76,7 +76,7 @@ function start_md() {
 	rcsyslog restart
     fi
 
-    MONITOR_PID=$(/sbin/md_monitor -y -p 7 -d -s)
+    MONITOR_PID=$(/sbin/md_monitor -y -p 7 -d -s ${MONITOR_ARGS})
     trapcmd="[ \$? -ne 0 ] && echo TEST FAILED while executing \'\$BASH_COMMAND\', EXITING"
     trapcmd="$trapcmd ; logger ${MD_NAME}: failed"
     trapcmd="$trapcmd ; reset_devices ; stop_iotest"